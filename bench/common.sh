@@ -0,0 +1,66 @@
+# Scaffolding shared by the benchmarks and tests, sourced from the
+# repository root once a script has read its parameters:
+#
+#   . bench/common.sh
+#
+# Sets SERVER, CLIENT, a SOCKET for this run and a WORKDIR that, like the
+# socket, is removed on exit, along with any server still running.
+
+SERVER=server/tecnicofs
+CLIENT=client/tecnicofs-client
+SOCKET=/tmp/tecnicofs-bench-$$
+WORKDIR=$(mktemp -d)
+SERVER_PID=
+PIDS=
+
+trap 'stop_server; rm -rf "$WORKDIR"; rm -f "$SOCKET"' EXIT
+
+# Starts a server on SOCKET in the background and waits until it listens.
+# Its output goes to SERVER_LOG, if set.
+# Usage: start_server [options] threads
+start_server() {
+    rm -f "$SOCKET"
+    $SERVER "$@" "$SOCKET" > "${SERVER_LOG:-/dev/null}" 2>&1 &
+    SERVER_PID=$!
+    while [ ! -S "$SOCKET" ]; do
+        if ! kill -0 "$SERVER_PID" 2>/dev/null; then
+            echo "server did not start: $SERVER $*" >&2
+            SERVER_PID=
+            exit 1
+        fi
+        sleep 0.05
+    done
+}
+
+# Stops the server started last, letting it flush its image, if any.
+stop_server() {
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null
+        wait "$SERVER_PID" 2>/dev/null
+        SERVER_PID=
+    fi
+}
+
+# Runs a client against SOCKET.
+# Usage: run_client [options] inputfile
+run_client() {
+    $CLIENT "$@" "$SOCKET"
+}
+
+# Runs a client against SOCKET in the background, adding it to PIDS.
+# Usage: spawn_client [options] inputfile
+spawn_client() {
+    $CLIENT "$@" "$SOCKET" &
+    PIDS="$PIDS $!"
+}
+
+# Waits for every client in PIDS.
+# Returns: nonzero if any of them failed
+wait_clients() {
+    status=0
+    for pid in $PIDS; do
+        wait "$pid" || status=1
+    done
+    PIDS=
+    return $status
+}
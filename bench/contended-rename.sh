@@ -0,0 +1,44 @@
+#!/bin/sh
+# Contended-rename benchmark: several clients keep moving their own file
+# back and forth between the same two directories, so every move contends
+# for the same parent locks. Reports each client's move latency.
+#
+# Usage: bench/contended-rename.sh [clients] [iterations] [threads]
+# Run from the repository root after `make`.
+
+CLIENTS=${1:-8}
+ITERATIONS=${2:-2000}
+THREADS=${3:-4}
+
+. bench/common.sh
+
+{
+    echo "c src d"
+    echo "c dst d"
+    for c in $(seq 1 "$CLIENTS"); do
+        echo "c src/f$c f"
+    done
+} > "$WORKDIR/setup.txt"
+
+for c in $(seq 1 "$CLIENTS"); do
+    for i in $(seq 1 "$ITERATIONS"); do
+        echo "m src/f$c dst/f$c"
+        echo "m dst/f$c src/f$c"
+    done > "$WORKDIR/input-$c.txt"
+done
+
+start_server "$THREADS"
+
+run_client "$WORKDIR/setup.txt" > /dev/null
+
+for c in $(seq 1 "$CLIENTS"); do
+    spawn_client -v "$WORKDIR/input-$c.txt" > "$WORKDIR/output-$c.txt"
+done
+wait_clients
+
+stop_server
+
+for c in $(seq 1 "$CLIENTS"); do
+    printf "client %d: " "$c"
+    grep "^Latency m:" "$WORKDIR/output-$c.txt"
+done
@@ -0,0 +1,39 @@
+#!/bin/sh
+# File data benchmark: writes files of growing size and reads them back,
+# over each session transport (files are opened through the session), and
+# reports the write and read throughput.
+#
+# Usage: bench/file-io.sh [max size in MiB] [threads]
+# Run from the repository root after `make`.
+
+MAX_MIB=${1:-64}
+THREADS=${2:-4}
+
+. bench/common.sh
+
+for transport in seqpacket shm; do
+    server_transport=$transport
+    [ "$transport" = shm ] && server_transport=seqpacket
+
+    start_server -t "$server_transport" "$THREADS"
+
+    echo "$transport:"
+    mib=1
+    while [ "$mib" -le "$MAX_MIB" ]; do
+        bytes=$((mib * 1024 * 1024))
+        printf 'c /f%d f\nw /f%d %d\nr /f%d\n' "$mib" "$mib" "$bytes" "$mib" \
+            > "$WORKDIR/input.txt"
+        run_client -v -t "$transport" "$WORKDIR/input.txt" \
+            > "$WORKDIR/output.txt"
+
+        # p50 of a single operation is its latency, in microseconds
+        write_us=$(grep "^Latency w:" "$WORKDIR/output.txt" | sed 's/.*p50 //; s/ us.*//')
+        read_us=$(grep "^Latency r:" "$WORKDIR/output.txt" | sed 's/.*p50 //; s/ us.*//')
+        echo "$mib $write_us $read_us" | awk '{
+            printf "  %4d MiB: write %7.1f MiB/s, read %7.1f MiB/s\n",
+                $1, $1 / ($2 / 1e6), $1 / ($3 / 1e6) }'
+        mib=$((mib * 4))
+    done
+
+    stop_server
+done
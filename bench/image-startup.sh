@@ -0,0 +1,54 @@
+#!/bin/sh
+# Image startup benchmark: fills file systems of growing size, stops the
+# server so it flushes its image (-i), and then times how long a server
+# started on that image takes to answer a first lookup.
+#
+# Contents are mapped, not read, but loading still walks every i-node
+# record to build the in-memory table and its free stack, so expect the
+# time to grow with the number of entries, only slowly.
+#
+# Usage: bench/image-startup.sh [max entries] [threads]
+# Run from the repository root after `make`.
+
+MAX_ENTRIES=${1:-100000}
+THREADS=${2:-4}
+FANOUT=1000
+
+. bench/common.sh
+IMAGE=$WORKDIR/image
+
+echo "l /" > "$WORKDIR/lookup.txt"
+
+printf "%-10s %-12s %-12s\n" entries image-KiB startup-ms
+entries=1000
+while [ "$entries" -le "$MAX_ENTRIES" ]; do
+    rm -f "$IMAGE" "$IMAGE.wal"
+
+    # FANOUT empty files per directory
+    awk -v n="$entries" -v f="$FANOUT" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            if (i % f == 0)
+                printf "c /d%d d\n", i / f
+            printf "c /d%d/f%d f\n", int(i / f), i
+        }
+    }' > "$WORKDIR/fill.txt"
+
+    start_server -i "$IMAGE" "$THREADS"
+    run_client "$WORKDIR/fill.txt" > /dev/null
+    stop_server
+
+    # time to serve: from starting the server to its first answer, so it
+    # is started by hand rather than by start_server, which polls
+    START=$(date +%s%N)
+    $SERVER -i "$IMAGE" "$THREADS" "$SOCKET" > /dev/null 2>&1 &
+    SERVER_PID=$!
+    until run_client "$WORKDIR/lookup.txt" > /dev/null 2>&1; do
+        :
+    done
+    END=$(date +%s%N)
+    stop_server
+
+    echo "$entries $(du -k "$IMAGE" | cut -f1) $START $END" | awk '{
+        printf "%-10d %-12d %-12.1f\n", $1, $2, ($4 - $3) / 1e6 }'
+    entries=$((entries * 10))
+done
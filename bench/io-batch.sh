@@ -0,0 +1,48 @@
+#!/bin/sh
+# Batched socket I/O benchmark: runs pipelined clients against a server
+# whose front end receives one datagram per system call, then against one
+# that drains up to BATCH datagrams per recvmmsg, and reports the server's
+# system calls per request next to the clients' throughput.
+#
+# Usage: bench/io-batch.sh [clients] [iterations] [threads] [batch] [depth]
+# Run from the repository root after `make`.
+
+CLIENTS=${1:-4}
+ITERATIONS=${2:-5000}
+THREADS=${3:-4}
+BATCH=${4:-32}
+DEPTH=${5:-32}
+
+. bench/common.sh
+
+for c in $(seq 1 "$CLIENTS"); do
+    {
+        echo "c /client$c d"
+        for i in $(seq 1 "$ITERATIONS"); do
+            echo "l /client$c/file-$i"
+        done
+    } > "$WORKDIR/input-$c.txt"
+done
+echo "p $WORKDIR/tree.txt" > "$WORKDIR/print.txt"
+
+for batch in 1 "$BATCH"; do
+    SERVER_LOG="$WORKDIR/server-$batch.txt" start_server -m "$batch" "$THREADS"
+
+    for c in $(seq 1 "$CLIENTS"); do
+        spawn_client -v -p "$DEPTH" "$WORKDIR/input-$c.txt" > "$WORKDIR/output-$c.txt"
+    done
+    wait_clients
+
+    # Print reports the server's I/O statistics
+    run_client "$WORKDIR/print.txt" > /dev/null
+
+    stop_server
+
+    echo "-m $batch:"
+    for c in $(seq 1 "$CLIENTS"); do
+        printf "  client %d: " "$c"
+        grep "^Executed" "$WORKDIR/output-$c.txt"
+    done
+    printf "  server: "
+    grep "^I/O:" "$WORKDIR/server-$batch.txt"
+done
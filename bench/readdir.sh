@@ -0,0 +1,63 @@
+#!/bin/sh
+# Directory listing benchmark: fills one directory with ENTRIES files,
+# then runs a client that keeps creating and deleting files in it, once
+# alone, once alongside a client that lists the directory page by page
+# ("e", TFS_OP_READDIR) over and over, and once alongside one that prints
+# the whole tree ("p") instead. Reports the churn's ops/sec in each run
+# and the median time a listing or print took.
+#
+# Usage: bench/readdir.sh [entries] [iterations] [threads]
+# Run from the repository root after `make`.
+
+ENTRIES=${1:-100000}
+ITERATIONS=${2:-5000}
+THREADS=${3:-4}
+LISTINGS=20
+
+. bench/common.sh
+
+awk -v n="$ENTRIES" 'BEGIN {
+    print "c /big d"
+    for (i = 0; i < n; i++)
+        printf "c /big/f%d f\n", i
+}' > "$WORKDIR/fill.txt"
+
+awk -v n="$ITERATIONS" 'BEGIN {
+    for (i = 0; i < n; i++)
+        printf "c /big/churn%d f\nd /big/churn%d\n", i, i
+}' > "$WORKDIR/churn.txt"
+
+for i in $(seq 1 "$LISTINGS"); do echo "e /big"; done > "$WORKDIR/list-e.txt"
+for i in $(seq 1 "$LISTINGS"); do echo "p $WORKDIR/tree.txt"; done > "$WORKDIR/list-p.txt"
+
+OPS=$((ITERATIONS * 2))
+
+echo "$ENTRIES entries"
+printf "%-10s %-10s %-10s %-12s\n" alongside seconds ops/sec listing-p50-ms
+for reader in none e p; do
+    start_server "$THREADS"
+    run_client "$WORKDIR/fill.txt" > /dev/null
+
+    READER_PID=
+    if [ "$reader" != none ]; then
+        run_client -v "$WORKDIR/list-$reader.txt" > "$WORKDIR/list.log" &
+        READER_PID=$!
+    fi
+
+    START=$(date +%s.%N)
+    run_client "$WORKDIR/churn.txt" > /dev/null
+    END=$(date +%s.%N)
+
+    LIST_MS=-
+    if [ -n "$READER_PID" ]; then
+        wait "$READER_PID"
+        # "Latency e: <n> ops, p50 <us> us, ..."
+        LIST_MS=$(awk -v op="$reader:" '$1 == "Latency" && $2 == op {
+            printf "%.1f", $6 / 1000 }' "$WORKDIR/list.log")
+    fi
+
+    stop_server
+
+    echo "$START $END $reader $OPS $LIST_MS" | awk '{ s = $2 - $1;
+        printf "%-10s %-10.3f %-10.0f %-12s\n", $3, s, $4 / s, $5 }'
+done
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Allocator churn benchmark: concurrent clients keep creating and deleting
+# directories full of entries, so every operation allocates or frees a
+# directory table, its slots, a name or a file header. Runs the workload
+# with the slab allocator and with plain malloc (TECNICOFS_SLAB=off, see
+# server/fs/slab.h) and reports ops/sec and the server's peak memory.
+#
+# Usage: bench/slab-churn.sh [clients] [iterations] [threads]
+# Run from the repository root after `make`.
+
+CLIENTS=${1:-8}
+ITERATIONS=${2:-500}
+THREADS=${3:-4}
+ENTRIES=8
+
+. bench/common.sh
+
+# Each client churns its own directory tree; names vary in length so every
+# size class sees traffic
+for c in $(seq 1 "$CLIENTS"); do
+    {
+        for i in $(seq 1 "$ITERATIONS"); do
+            echo "c d$c d"
+            for e in $(seq 1 "$ENTRIES"); do
+                echo "c d$c/entry-$e-$i f"
+                echo "c d$c/sub$e d"
+            done
+            for e in $(seq 1 "$ENTRIES"); do
+                echo "d d$c/entry-$e-$i"
+                echo "d d$c/sub$e"
+            done
+            echo "d d$c"
+        done
+    } > "$WORKDIR/input-$c.txt"
+done
+
+OPS=$((CLIENTS * ITERATIONS * (ENTRIES * 4 + 2)))
+
+printf "%-10s %-10s %-10s %-10s\n" allocator seconds ops/sec peak-KiB
+for allocator in malloc slab; do
+    slab=on
+    [ "$allocator" = malloc ] && slab=off
+
+    TECNICOFS_SLAB=$slab start_server "$THREADS"
+
+    START=$(date +%s.%N)
+    for c in $(seq 1 "$CLIENTS"); do
+        spawn_client "$WORKDIR/input-$c.txt" > /dev/null
+    done
+    wait_clients
+    END=$(date +%s.%N)
+
+    PEAK=$(awk '/^VmHWM:/ { print $2 }' "/proc/$SERVER_PID/status")
+    stop_server
+
+    echo "$START $END $allocator $OPS $PEAK" | awk '{ s = $2 - $1;
+        printf "%-10s %-10.3f %-10.0f %-10d\n", $3, s, $4 / s, $5 }'
+done
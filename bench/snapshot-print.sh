@@ -0,0 +1,71 @@
+#!/bin/sh
+# Snapshot print benchmark: fills a tree, then runs clients that keep
+# creating and deleting files, once alone and once alongside a client that
+# prints the whole tree over and over. Reports the churn's ops/sec in both
+# runs and the median time a print took, to show how much a dump slows down
+# the commands running next to it.
+#
+# Usage: bench/snapshot-print.sh [entries] [clients] [iterations] [threads]
+# Run from the repository root after `make`.
+
+ENTRIES=${1:-50000}
+CLIENTS=${2:-4}
+ITERATIONS=${3:-2000}
+THREADS=${4:-8}
+PRINTS=20
+FANOUT=500
+
+. bench/common.sh
+
+awk -v n="$ENTRIES" -v f="$FANOUT" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        if (i % f == 0)
+            printf "c /d%d d\n", i / f
+        printf "c /d%d/f%d f\n", int(i / f), i
+    }
+}' > "$WORKDIR/fill.txt"
+
+for c in $(seq 1 "$CLIENTS"); do
+    awk -v c="$c" -v n="$ITERATIONS" 'BEGIN {
+        printf "c /churn%d d\n", c
+        for (i = 0; i < n; i++)
+            printf "c /churn%d/f%d f\nd /churn%d/f%d\n", c, i, c, i
+    }' > "$WORKDIR/churn-$c.txt"
+done
+
+for i in $(seq 1 "$PRINTS"); do
+    echo "p $WORKDIR/tree.txt"
+done > "$WORKDIR/print.txt"
+
+OPS=$((CLIENTS * (ITERATIONS * 2 + 1)))
+
+printf "%-10s %-10s %-10s %-12s\n" prints seconds ops/sec print-p50-ms
+for prints in no yes; do
+    start_server "$THREADS"
+    run_client "$WORKDIR/fill.txt" > /dev/null
+
+    PRINT_PID=
+    if [ "$prints" = yes ]; then
+        run_client -v "$WORKDIR/print.txt" > "$WORKDIR/print.log" &
+        PRINT_PID=$!
+    fi
+
+    START=$(date +%s.%N)
+    for c in $(seq 1 "$CLIENTS"); do
+        spawn_client "$WORKDIR/churn-$c.txt" > /dev/null
+    done
+    wait_clients
+    END=$(date +%s.%N)
+
+    PRINT_MS=-
+    if [ -n "$PRINT_PID" ]; then
+        wait "$PRINT_PID"
+        # "Latency p: <n> ops, p50 <us> us, ..."
+        PRINT_MS=$(awk '/^Latency p:/ { printf "%.1f", $6 / 1000 }' "$WORKDIR/print.log")
+    fi
+
+    stop_server
+
+    echo "$START $END $prints $OPS $PRINT_MS" | awk '{ s = $2 - $1;
+        printf "%-10s %-10.3f %-10.0f %-12s\n", $3, s, $4 / s, $5 }'
+done
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Cache validation benchmark: writes FILES files of SIZE bytes, then checks
+# each of them ROUNDS times the way a client caching their contents could:
+# by reading the file again ("r": open, reads, close) or by asking for its
+# metadata in one round-trip ("s", TFS_OP_STAT) and comparing the version.
+# A lookup ("l") of each is timed too, as the cheapest request there is.
+# Reports the time and the median latency of each.
+#
+# Usage: bench/stat.sh [files] [size] [rounds] [threads]
+# Run from the repository root after `make`.
+
+FILES=${1:-100}
+SIZE=${2:-65536}
+ROUNDS=${3:-20}
+THREADS=${4:-4}
+
+. bench/common.sh
+
+awk -v n="$FILES" -v size="$SIZE" 'BEGIN {
+    for (i = 0; i < n; i++)
+        printf "c /f%d f\nw /f%d %d\n", i, i, size
+}' > "$WORKDIR/fill.txt"
+
+for op in r s l; do
+    awk -v n="$FILES" -v rounds="$ROUNDS" -v op="$op" 'BEGIN {
+        for (r = 0; r < rounds; r++)
+            for (i = 0; i < n; i++)
+                printf "%s /f%d\n", op, i
+    }' > "$WORKDIR/check-$op.txt"
+done
+
+# Runs an input file one request at a time and prints its time and p50
+run() {
+    START=$(date +%s.%N)
+    run_client -v -t seqpacket -p 1 "$WORKDIR/check-$1.txt" > "$WORKDIR/check.log"
+    END=$(date +%s.%N)
+    # "Latency <op>: <n> ops, p50 <us> us, ..."
+    P50=$(awk -v op="$1:" '$1 == "Latency" && $2 == op { print $6 }' "$WORKDIR/check.log")
+    echo "$START $END $(wc -l < "$WORKDIR/check-$1.txt") $2 $P50" | awk '{
+        printf "%-10s %-10d %-10.3f %-10s\n", $4, $3, $2 - $1, $5 }'
+}
+
+echo "$FILES files of $SIZE bytes, $ROUNDS rounds"
+printf "%-10s %-10s %-10s %-10s\n" check requests seconds p50-us
+start_server -t seqpacket "$THREADS"
+run_client -t seqpacket "$WORKDIR/fill.txt" > /dev/null
+
+run r read
+run s stat
+run l lookup
+
+stop_server
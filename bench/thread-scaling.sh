@@ -0,0 +1,48 @@
+#!/bin/sh
+# Thread-scaling benchmark: runs the same concurrent client workload against
+# servers with a growing number of worker threads and reports ops/sec.
+#
+# Usage: bench/thread-scaling.sh [clients] [iterations] [threads...]
+# Run from the repository root after `make`; build the server with
+# `make INJECT=1` to give every i-node operation synthetic work (see
+# server/fs/inject.h).
+
+CLIENTS=${1:-8}
+ITERATIONS=${2:-2000}
+shift 2 2>/dev/null
+THREADS=${*:-1 2 4 8}
+
+. bench/common.sh
+
+# Each client owns a directory and churns a file inside it, so clients never
+# conflict on the same i-node locks and only the server's own serialization
+# limits scaling.
+for c in $(seq 1 "$CLIENTS"); do
+    {
+        echo "c d$c d"
+        for i in $(seq 1 "$ITERATIONS"); do
+            echo "c d$c/f f"
+            echo "l d$c/f"
+            echo "d d$c/f"
+        done
+        echo "d d$c"
+    } > "$WORKDIR/input-$c.txt"
+done
+
+OPS=$((CLIENTS * (ITERATIONS * 3 + 2)))
+
+printf "%-8s %-10s %-10s\n" threads seconds ops/sec
+for t in $THREADS; do
+    start_server "$t"
+
+    START=$(date +%s.%N)
+    for c in $(seq 1 "$CLIENTS"); do
+        spawn_client "$WORKDIR/input-$c.txt" > /dev/null
+    done
+    wait_clients
+    END=$(date +%s.%N)
+
+    stop_server
+
+    echo "$START $END $t $OPS" | awk '{ s = $2 - $1; printf "%-8d %-10.3f %-10.0f\n", $3, s, $4 / s }'
+done
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Transport benchmark: runs the same create/lookup/delete workload over
+# datagrams, over seqpacket sessions and over shared-memory rings (attached
+# through a seqpacket session), then streams the listing of a
+# large tree back to a client over each, and reports the throughput.
+#
+# Usage: bench/transport.sh [clients] [iterations] [threads] [depth]
+# Run from the repository root after `make`.
+
+CLIENTS=${1:-4}
+ITERATIONS=${2:-2000}
+THREADS=${3:-4}
+DEPTH=${4:-1}
+
+. bench/common.sh
+
+for c in $(seq 1 "$CLIENTS"); do
+    {
+        echo "c /client$c d"
+        for i in $(seq 1 "$ITERATIONS"); do
+            echo "c /client$c/f$i f"
+            echo "l /client$c/f$i"
+        done
+    } > "$WORKDIR/input-$c.txt"
+done
+echo "p -" > "$WORKDIR/list.txt"
+
+for transport in dgram seqpacket shm; do
+    # The rings of a client are handed to the server over its session
+    server_transport=$transport
+    [ "$transport" = shm ] && server_transport=seqpacket
+
+    start_server -t "$server_transport" "$THREADS"
+
+    for c in $(seq 1 "$CLIENTS"); do
+        spawn_client -v -t "$transport" -p "$DEPTH" "$WORKDIR/input-$c.txt" \
+            > "$WORKDIR/output-$c.txt"
+    done
+    wait_clients
+
+    # The tree now holds CLIENTS * ITERATIONS files
+    run_client -v -t "$transport" "$WORKDIR/list.txt" > "$WORKDIR/list-output.txt"
+
+    stop_server
+
+    echo "$transport:"
+    for c in $(seq 1 "$CLIENTS"); do
+        printf "  client %d: " "$c"
+        grep "^Executed" "$WORKDIR/output-$c.txt"
+    done
+    printf "  listing: %d lines, " "$(grep -c "^/" "$WORKDIR/list-output.txt")"
+    grep "^Latency p:" "$WORKDIR/list-output.txt" | sed 's/.*p50 //; s/, p99.*//'
+done
@@ -0,0 +1,77 @@
+#!/bin/sh
+# Subtree operations benchmark: builds a tree of directories FANOUT wide
+# and DEPTH deep with FILES files in each leaf, then removes it, once with
+# one request per node (deepest first, as a client must) and once with a
+# single recursive delete ("d /t r"). Then creates a set of deep directory
+# paths, once level by level and once with one "c <path> p" each. Reports
+# the time and requests of each.
+#
+# Usage: bench/tree-ops.sh [fanout] [depth] [files] [threads]
+# Run from the repository root after `make`.
+
+FANOUT=${1:-8}
+DEPTH=${2:-3}
+FILES=${3:-20}
+THREADS=${4:-4}
+PATHS=2000
+PATH_DEPTH=6
+
+. bench/common.sh
+
+# Tree creation and its node-by-node removal, children before parents
+awk -v fanout="$FANOUT" -v depth="$DEPTH" -v files="$FILES" -v out="$WORKDIR" '
+    function fill(path, level,    i) {
+        printf "c %s d\n", path > (out "/fill.txt")
+        if (level == depth) {
+            for (i = 0; i < files; i++) {
+                printf "c %s/f%d f\n", path, i > (out "/fill.txt")
+                printf "d %s/f%d\n", path, i > (out "/delete.txt")
+            }
+        }
+        else {
+            for (i = 0; i < fanout; i++)
+                fill(path "/d" i, level + 1)
+        }
+        printf "d %s\n", path > (out "/delete.txt")
+    }
+    BEGIN { fill("/t", 0) }'
+echo "d /t r" > "$WORKDIR/delete-r.txt"
+NODES=$(wc -l < "$WORKDIR/fill.txt")
+
+# Deep paths sharing their first levels, created level by level or at once
+awk -v n="$PATHS" -v depth="$PATH_DEPTH" -v out="$WORKDIR" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        path = "/p" (i % 10)
+        for (level = 1; level < depth; level++)
+            path = path "/l" level "x" i
+        printf "c %s p\n", path > (out "/mkdir-p.txt")
+    }
+}'
+awk '{ n = split($2, parts, "/"); path = ""
+    for (i = 2; i <= n; i++) { path = path "/" parts[i]; if (!seen[path]++) print "c " path " d" } }' \
+    "$WORKDIR/mkdir-p.txt" > "$WORKDIR/mkdir.txt"
+
+# Runs an input file and prints its time and request count
+run() {
+    START=$(date +%s.%N)
+    run_client -p 16 "$1" > /dev/null
+    END=$(date +%s.%N)
+    echo "$START $END $(wc -l < "$1") $2" | awk '{
+        printf "%-24s %-10d %-10.3f\n", $4, $3, $2 - $1 }'
+}
+
+echo "$NODES nodes to delete, $PATHS paths of $PATH_DEPTH levels to create"
+printf "%-24s %-10s %-10s\n" operation requests seconds
+start_server "$THREADS"
+
+run_client "$WORKDIR/fill.txt" > /dev/null
+run "$WORKDIR/delete.txt" delete-per-node
+run_client "$WORKDIR/fill.txt" > /dev/null
+run "$WORKDIR/delete-r.txt" delete-recursive
+
+run "$WORKDIR/mkdir.txt" create-per-level
+for p in $(seq 0 9); do echo "d /p$p r"; done > "$WORKDIR/clean.txt"
+run_client "$WORKDIR/clean.txt" > /dev/null
+run "$WORKDIR/mkdir-p.txt" create-parents
+
+stop_server
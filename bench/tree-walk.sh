@@ -0,0 +1,58 @@
+#!/bin/sh
+# Tree walk benchmark: builds a synthetic tree of about a million nodes
+# once, keeps it in an image (-i), and then times print on it with the
+# traversal engine limited to 1, 2, 4, ... threads (TECNICOFS_WALK_THREADS,
+# see server/fs/walk.h). Directories fan out FANOUT ways down to DEPTH
+# levels and every directory at the bottom holds FILES files.
+#
+# Usage: bench/tree-walk.sh [max threads] [prints] [server threads]
+# Run from the repository root after `make`.
+
+MAX_THREADS=${1:-8}
+PRINTS=${2:-5}
+THREADS=${3:-4}
+FANOUT=10
+DEPTH=4
+FILES=100
+
+. bench/common.sh
+IMAGE=$WORKDIR/image
+
+awk -v fanout="$FANOUT" -v depth="$DEPTH" -v files="$FILES" '
+    function fill(path, level,    i) {
+        if (level == depth) {
+            for (i = 0; i < files; i++)
+                printf "c %s/f%d f\n", path, i
+            return
+        }
+        for (i = 0; i < fanout; i++) {
+            printf "c %s/d%d d\n", path, i
+            fill(path "/d" i, level + 1)
+        }
+    }
+    BEGIN { fill("", 0) }' > "$WORKDIR/fill.txt"
+NODES=$(($(wc -l < "$WORKDIR/fill.txt") + 1))
+
+start_server -i "$IMAGE" "$THREADS"
+run_client "$WORKDIR/fill.txt" > /dev/null
+stop_server
+
+for i in $(seq 1 "$PRINTS"); do
+    echo "p $WORKDIR/tree.txt"
+done > "$WORKDIR/print.txt"
+
+echo "$NODES nodes, $(nproc) CPUs"
+printf "%-10s %-12s %-12s\n" threads print-p50-ms nodes/sec
+threads=1
+while [ "$threads" -le "$MAX_THREADS" ]; do
+    TECNICOFS_WALK_THREADS=$threads start_server -i "$IMAGE" "$THREADS"
+    until run_client -v "$WORKDIR/print.txt" > "$WORKDIR/print.log" 2>/dev/null; do
+        sleep 0.1
+    done
+    stop_server
+
+    # "Latency p: <n> ops, p50 <us> us, ..."
+    awk -v t="$threads" -v n="$NODES" '/^Latency p:/ {
+        printf "%-10d %-12.1f %-12.0f\n", t, $6 / 1000, n / ($6 / 1e6) }' "$WORKDIR/print.log"
+    threads=$((threads * 2))
+done
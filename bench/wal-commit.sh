@@ -0,0 +1,61 @@
+#!/bin/sh
+# Group commit benchmark: concurrent clients create, move and delete files
+# on a server that logs every change (-i) and answers only once its record
+# is durable. Runs each client count with several commit windows (-g) and
+# reports ops/sec, records per fdatasync and the average commit latency
+# the server measured, from append to sync.
+#
+# Usage: bench/wal-commit.sh [iterations] [threads] [clients...]
+# Run from the repository root after `make`.
+
+ITERATIONS=${1:-200}
+THREADS=${2:-8}
+[ $# -gt 2 ] && shift 2 && CLIENT_COUNTS="$*"
+CLIENT_COUNTS=${CLIENT_COUNTS:-1 4 16}
+WINDOWS="0 100 1000"
+
+. bench/common.sh
+IMAGE=$WORKDIR/image
+
+MAX_CLIENTS=0
+for clients in $CLIENT_COUNTS; do
+    [ "$clients" -gt "$MAX_CLIENTS" ] && MAX_CLIENTS=$clients
+done
+
+# Each client works in its own directory: 4 logged operations per iteration
+for c in $(seq 1 "$MAX_CLIENTS"); do
+    {
+        echo "c /d$c d"
+        for i in $(seq 1 "$ITERATIONS"); do
+            echo "c /d$c/f$i f"
+            echo "m /d$c/f$i /d$c/g$i"
+            echo "c /d$c/h$i f"
+            echo "d /d$c/g$i"
+        done
+    } > "$WORKDIR/input-$c.txt"
+done
+
+printf "%-8s %-10s %-10s %-10s %-14s %-14s\n" clients window-us seconds ops/sec \
+    records/commit latency-us
+for clients in $CLIENT_COUNTS; do
+    for window in $WINDOWS; do
+        rm -f "$IMAGE" "$IMAGE.wal"
+        SERVER_LOG="$WORKDIR/server.log" start_server -i "$IMAGE" -g "$window" "$THREADS"
+
+        START=$(date +%s.%N)
+        for c in $(seq 1 "$clients"); do
+            spawn_client "$WORKDIR/input-$c.txt" > /dev/null
+        done
+        wait_clients
+        END=$(date +%s.%N)
+
+        stop_server
+
+        # "WAL: <records> records in <commits> commits, <latency> us ..."
+        STATS=$(awk '/^WAL: .* commits,/ { print $2, $5, $7 }' "$WORKDIR/server.log")
+        echo "$START $END $clients $window $((clients * (ITERATIONS * 4 + 1))) $STATS" |
+            awk '{ s = $2 - $1;
+                printf "%-8d %-10d %-10.3f %-10.0f %-14.1f %-14.1f\n",
+                    $3, $4, s, $5 / s, $7 ? $6 / $7 : 0, $8 }'
+    done
+done
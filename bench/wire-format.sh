@@ -0,0 +1,49 @@
+#!/bin/sh
+# Wire-format benchmark: runs the same create/lookup/move/delete workload
+# once with text requests and once with binary requests, and reports the
+# server's parse cost per request next to the clients' throughput.
+#
+# Usage: bench/wire-format.sh [clients] [iterations] [threads]
+# Run from the repository root after `make`.
+
+CLIENTS=${1:-4}
+ITERATIONS=${2:-2000}
+THREADS=${3:-4}
+
+. bench/common.sh
+
+for c in $(seq 1 "$CLIENTS"); do
+    {
+        echo "c /client$c d"
+        echo "c /client$c/moved d"
+        for i in $(seq 1 "$ITERATIONS"); do
+            echo "c /client$c/some-longer-file-name-$i f"
+            echo "l /client$c/some-longer-file-name-$i"
+            echo "m /client$c/some-longer-file-name-$i /client$c/moved/file-$i"
+            echo "d /client$c/moved/file-$i"
+        done
+    } > "$WORKDIR/input-$c.txt"
+done
+echo "p $WORKDIR/tree.txt" > "$WORKDIR/print.txt"
+
+for format in text binary; do
+    SERVER_LOG="$WORKDIR/server-$format.txt" start_server "$THREADS"
+
+    for c in $(seq 1 "$CLIENTS"); do
+        spawn_client -v -w "$format" "$WORKDIR/input-$c.txt" > "$WORKDIR/output-$c.txt"
+    done
+    wait_clients
+
+    # Print reports the server's parse statistics
+    run_client -w "$format" "$WORKDIR/print.txt" > /dev/null
+
+    stop_server
+
+    echo "$format:"
+    for c in $(seq 1 "$CLIENTS"); do
+        printf "  client %d: " "$c"
+        grep "^Executed" "$WORKDIR/output-$c.txt"
+    done
+    printf "  server: "
+    grep "^Parse:" "$WORKDIR/server-$format.txt"
+done
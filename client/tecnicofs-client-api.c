@@ -1,14 +1,38 @@
+#define _GNU_SOURCE
 #include "tecnicofs-client-api.h"
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <poll.h>
 #include <stdio.h>
+#include "../tecnicofs-protocol.h"
+#include "../tecnicofs-ring.h"
 
 char *server_path;
 int sockfd;
 
+/* Shared-memory rings and their eventfds (TFS_TRANSPORT_SHM) */
+tfs_ring_pair *rings = NULL;
+int request_event = -1, response_event = -1;
+
+/* Transport and wire format of the requests, and the path limit agreed on
+ * mount */
+int transport = TFS_TRANSPORT_DGRAM;
+int wire_format = TFS_WIRE_BINARY;
+size_t max_path = MAX_FILE_NAME;
+uint32_t request_id = 0;
+
 int setSockAddrUn(char *path, struct sockaddr_un *addr) {
     if (addr == NULL)
         return 0;
@@ -20,154 +44,951 @@ int setSockAddrUn(char *path, struct sockaddr_un *addr) {
     return SUN_LEN(addr);
 }
 
-int tfsCreate(char *filename, char nodeType) {
-    socklen_t server_len;
-    struct sockaddr_un server_addr;
-    server_len = setSockAddrUn(server_path, &server_addr);
-    char str[MAX_INPUT_SIZE];
-    int answer;
+/*
+ * Requests sent and not yet answered. A request lives in slot
+ * request_id % TFS_MAX_IN_FLIGHT; a free slot has request_id 0.
+ */
+typedef struct pending {
+    uint32_t request_id;
+    tfs_callback callback;
+    void *data;
+    int *results;   /* batches only */
+    FILE *out;      /* streamed answers (list) only */
+    char *buffer;   /* reads only */
+    int received;   /* bytes streamed so far */
+} pending;
+
+pending in_flight[TFS_MAX_IN_FLIGHT];
+int in_flight_count = 0;
+
+static int tfsReceive(int wait);
+
+/*
+ * Fills in the header of a binary request for an operation.
+ * Input:
+ *  - o: the operation
+ *  - request: header to fill in (request_id is left alone)
+ * Returns: 0, or TECNICOFS_ERROR_OTHER if the operation is invalid or a
+ *  path is longer than the limit agreed with the server
+ */
+static int tfsEncode(tfs_op *o, tfs_request *request) {
+    request->flags = 0;
+    request->path_len[1] = 0;
+
+    switch (o->op) {
+        case 'c':
+            if (o->arg == NULL || (o->arg[0] != 'f' && o->arg[0] != 'd' && o->arg[0] != 'p'))
+                return TECNICOFS_ERROR_OTHER;
+            request->opcode = TFS_OP_CREATE;
+            if (o->arg[0] == 'p')
+                request->flags = TFS_FLAG_DIRECTORY | TFS_FLAG_PARENTS;
+            else
+                request->flags = o->arg[0] == 'd' ? TFS_FLAG_DIRECTORY : 0;
+            break;
+        case 'd':
+            if (o->arg != NULL && o->arg[0] != 'r')
+                return TECNICOFS_ERROR_OTHER;
+            request->opcode = TFS_OP_DELETE;
+            request->flags = o->arg != NULL ? TFS_FLAG_RECURSIVE : 0;
+            break;
+        case 'l':
+            request->opcode = TFS_OP_LOOKUP;
+            break;
+        case 'm':
+            if (o->arg == NULL || strlen(o->arg) + 1 > max_path)
+                return TECNICOFS_ERROR_OTHER;
+            request->opcode = TFS_OP_MOVE;
+            request->path_len[1] = strlen(o->arg) + 1;
+            break;
+        case 'p':
+            request->opcode = TFS_OP_PRINT;
+            break;
+        default:
+            return TECNICOFS_ERROR_OTHER;
+    }
 
-    sprintf(str, "c %s %c", filename, nodeType);
+    if (o->path == NULL || strlen(o->path) + 1 > max_path)
+        return TECNICOFS_ERROR_OTHER;
+    request->path_len[0] = strlen(o->path) + 1;
 
-    if (sendto(sockfd, str, strlen(str)+1, 0,
-                (struct sockaddr *) &server_addr, server_len) < 0) {
-        fprintf(stderr,"client: sendto error\n");
-        exit(EXIT_FAILURE);
+    return 0;
+}
+
+/*
+ * Sends a message to the server. If the server's queue is full, takes in
+ * answers while waiting for room: a server thread may be blocked answering
+ * us, and it would never get to our request otherwise.
+ */
+static void tfsSendMessage(struct msghdr *msg) {
+    uint64_t one = 1;
+
+    /*
+     * A full request ring only holds requests in flight: wait for their
+     * answers. Then wake the server only if it is about to sleep.
+     */
+    if (rings != NULL) {
+        while (tfs_ring_push(&rings->requests, msg->msg_iov,
+                    msg->msg_iovlen) < 0) {
+            if (in_flight_count > 0)
+                tfsReceive(1);
+            else
+                sched_yield();
+        }
+        if (__atomic_load_n(&rings->requests.consumer_waiting,
+                    __ATOMIC_SEQ_CST) &&
+                write(request_event, &one, sizeof(one)) < 0) {
+            fprintf(stderr,"client: sendto error\n");
+            exit(EXIT_FAILURE);
+        }
+        return;
     }
 
-    if (recvfrom(sockfd, &answer, sizeof(int), 0, 0, 0) < 0) {
-        fprintf(stderr,"client: recvfrom error");
-        exit(EXIT_FAILURE);
+    while (sendmsg(sockfd, msg, MSG_DONTWAIT) < 0) {
+        struct pollfd pfd = { sockfd, POLLIN | POLLOUT, 0 };
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            fprintf(stderr,"client: sendto error\n");
+            exit(EXIT_FAILURE);
+        }
+
+        poll(&pfd, 1, -1);
+        if (pfd.revents & POLLIN)
+            while (in_flight_count > 0 && tfsReceive(0))
+                ;
+    }
+}
+
+/*
+ * Sends an operation as a single request, in the current wire format.
+ * Input:
+ *  - o: the operation
+ *  - request: its header, from tfsEncode
+ */
+static void tfsSend(tfs_op *o, tfs_request *request) {
+    char str[TFS_MAX_MESSAGE];
+    struct iovec iov[3];
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+
+    if (wire_format == TFS_WIRE_TEXT) {
+        if (o->op == 'c' || (o->op == 'd' && o->arg != NULL))
+            sprintf(str, "%c %s %c", o->op, o->path, o->arg[0]);
+        else if (o->op == 'm')
+            sprintf(str, "m %s %s", o->path, o->arg);
+        else
+            sprintf(str, "%c %s", o->op, o->path);
+
+        iov[0].iov_base = str;
+        iov[0].iov_len = strlen(str) + 1;
+        msg.msg_iovlen = 1;
+    }
+    else {
+        /* Header and paths go out as they are, without being copied */
+        iov[0].iov_base = request;
+        iov[0].iov_len = sizeof(tfs_request);
+        iov[1].iov_base = o->path;
+        iov[1].iov_len = request->path_len[0];
+        iov[2].iov_base = o->arg;
+        iov[2].iov_len = request->path_len[1];
+        msg.msg_iovlen = request->path_len[1] ? 3 : 2;
     }
 
-    return answer;
+    tfsSendMessage(&msg);
 }
 
-int tfsDelete(char *path) {
-    socklen_t server_len;
-    struct sockaddr_un server_addr;
-    server_len = setSockAddrUn(server_path, &server_addr);
-    char str[MAX_INPUT_SIZE];
-    int answer;
+/* Largest answer, and the results of a batch or the data of a chunk */
+typedef struct response {
+    tfs_response header;
+    union {
+        int32_t results[TFS_MAX_BATCH];
+        char chunk[TFS_MAX_CHUNK];
+    };
+} response;
+
+/*
+ * Completes the request an answer belongs to.
+ * Input:
+ *  - r: the answer
+ *  - size: its size
+ * Returns: 1 if a request was completed, 0 otherwise
+ */
+static int tfsDeliver(response *r, int size) {
+    pending *p;
+
+    /* Answers to requests no longer in flight are stale: skip them */
+    p = &in_flight[r->header.request_id % TFS_MAX_IN_FLIGHT];
+    if (size < sizeof(tfs_response) || r->header.request_id == 0 ||
+            p->request_id != r->header.request_id)
+        return 0;
 
-    sprintf(str, "d %s", path);
+    /* A chunk of a streamed answer: the request stays in flight */
+    if (r->header.result == TFS_PARTIAL) {
+        if (p->buffer)
+            memcpy(p->buffer + p->received, r->chunk,
+                    size - sizeof(tfs_response));
+        else if (p->out)
+            fwrite(r->chunk, 1, size - sizeof(tfs_response), p->out);
+        p->received += size - sizeof(tfs_response);
+        return 0;
+    }
 
-    if (sendto(sockfd, str, strlen(str)+1, 0,
-                (struct sockaddr *) &server_addr, server_len) < 0) {
-        fprintf(stderr,"client: sendto error\n");
-        exit(EXIT_FAILURE);
+    /* The answer to a read carries the bytes not streamed before it */
+    if (p->buffer && r->header.result > p->received &&
+            r->header.result - p->received <= size - sizeof(tfs_response))
+        memcpy(p->buffer + p->received, r->chunk,
+                r->header.result - p->received);
+
+    if (p->results)
+        for (int i = 0; i < r->header.result &&
+                sizeof(tfs_response) + (i + 1) * sizeof(int32_t) <= size; i++)
+            p->results[i] = r->results[i];
+
+    p->request_id = 0;
+    in_flight_count--;
+    p->callback(r->header.result, p->data);
+    return 1;
+}
+
+/*
+ * Takes the next answer off the answer ring, sleeping on the answer
+ * eventfd (or a server disconnect) when the ring is empty and wait is set.
+ * Returns: 1 if a request was completed, 0 otherwise
+ */
+static int tfsReceiveRing(int wait) {
+    tfs_ring *ring = &rings->responses;
+    struct pollfd pfds[2] = {
+        { response_event, POLLIN, 0 }, { sockfd, POLLIN, 0 }
+    };
+    response r;
+    uint64_t count;
+    uint32_t size, copied;
+    char *data;
+
+    while ((data = tfs_ring_peek(ring, &size)) == NULL) {
+        if (size == TFS_RING_WRAP) {
+            fprintf(stderr, "client: answer ring is inconsistent\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!wait)
+            return 0;
+
+        __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (tfs_ring_peek(ring, &size) == NULL) {
+            poll(pfds, 2, -1);
+            if (pfds[1].revents) {
+                fprintf(stderr, "client: session closed by the server\n");
+                exit(EXIT_FAILURE);
+            }
+            if (read(response_event, &count, sizeof(count)) < 0) {
+                fprintf(stderr,"client: recvfrom error");
+                exit(EXIT_FAILURE);
+            }
+        }
+        __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+    /* Copied out first: the callback may well send or receive again */
+    copied = size < sizeof(r) ? size : sizeof(r);
+    memcpy(&r, data, copied);
+
+    if (tfs_ring_pop(ring, size)) {
+        __atomic_fetch_add(&ring->consumed, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &ring->consumed, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
     }
 
-    if (recvfrom(sockfd, &answer, sizeof(int), 0, 0, 0) < 0) {
+    return tfsDeliver(&r, copied);
+}
+
+/*
+ * Receives one answer and completes the request it belongs to.
+ * Input:
+ *  - wait: whether to block until an answer arrives
+ * Returns: 1 if a request was completed, 0 otherwise
+ */
+static int tfsReceive(int wait) {
+    response r;
+    int size;
+
+    if (rings != NULL)
+        return tfsReceiveRing(wait);
+
+    if ((size = recv(sockfd, &r, sizeof(r), wait ? 0 : MSG_DONTWAIT)) < 0) {
+        if (!wait && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
         fprintf(stderr,"client: recvfrom error");
         exit(EXIT_FAILURE);
     }
+    if (size == 0 && transport != TFS_TRANSPORT_DGRAM) {
+        fprintf(stderr, "client: session closed by the server\n");
+        exit(EXIT_FAILURE);
+    }
 
-    return answer;
+    return tfsDeliver(&r, size);
 }
 
-int tfsMove(char *from, char *to) {
-    socklen_t server_len;
-    struct sockaddr_un server_addr;
-    server_len = setSockAddrUn(server_path, &server_addr);
-    char str[MAX_INPUT_SIZE];
+/*
+ * Takes a request id and its slot in in_flight.
+ * Returns: the request id
+ */
+static uint32_t tfsReserve(tfs_callback callback, void *data, int *results,
+        FILE *out, char *buffer) {
+    pending *p;
+
+    /* Ids are never 0; wait for the slot of the new id to be free */
+    if (++request_id == 0)
+        request_id = 1;
+    p = &in_flight[request_id % TFS_MAX_IN_FLIGHT];
+    while (p->request_id != 0)
+        tfsReceive(1);
+
+    p->request_id = request_id;
+    p->callback = callback;
+    p->data = data;
+    p->results = results;
+    p->out = out;
+    p->buffer = buffer;
+    p->received = 0;
+    in_flight_count++;
+
+    return request_id;
+}
+
+/*
+ * Sends a request without waiting for its answer. Many requests may be in
+ * flight; the server may answer them in any order.
+ * Input:
+ *  - op: 'c', 'd', 'l', 'm' or 'p', as in the input files
+ *  - path: path of the node (or output file, for print)
+ *  - arg: "f", "d" or "p" (a directory and its missing ancestors) for
+ *    create, "r" (recursive) or NULL for delete, the new path for move,
+ *    NULL otherwise
+ *  - callback: called with the answer, from tfsPoll, tfsWaitAll or any
+ *    later request
+ *  - data: passed to callback
+ * Returns: the request id, or TECNICOFS_ERROR_OTHER for invalid requests
+ *  (in the text format, which has no ids, 0 after completing the request)
+ */
+int tfsSubmit(char op, char *path, char *arg, tfs_callback callback,
+        void *data) {
+    tfs_op o = { op, path, arg };
+    tfs_request request;
     int answer;
 
-    sprintf(str, "m %s %s", from, to);
+    if (tfsEncode(&o, &request) < 0)
+        return TECNICOFS_ERROR_OTHER;
+
+    /* Text answers carry no id: complete the request right away */
+    if (wire_format == TFS_WIRE_TEXT) {
+        tfsSend(&o, &request);
+        if (recvfrom(sockfd, &answer, sizeof(int), 0, 0, 0) < 0) {
+            fprintf(stderr,"client: recvfrom error");
+            exit(EXIT_FAILURE);
+        }
+        callback(answer, data);
+        return 0;
+    }
 
-    if (sendto(sockfd, str, strlen(str)+1, 0,
-                (struct sockaddr *) &server_addr, server_len) < 0) {
-        fprintf(stderr,"client: sendto error\n");
-        exit(EXIT_FAILURE);
+    request.request_id = tfsReserve(callback, data, NULL, NULL, NULL);
+    tfsSend(&o, &request);
+
+    return request.request_id;
+}
+
+/* Result of a synchronous request */
+typedef struct completion {
+    int done;
+    int result;
+} completion;
+
+static void complete(int result, void *data) {
+    completion *c = data;
+    c->result = result;
+    c->done = 1;
+}
+
+/*
+ * Sends several operations in one request, without waiting for the answer.
+ * They run in order on the server.
+ * Input:
+ *  - ops: the operations, as for tfsSubmit
+ *  - count: number of operations, up to TFS_MAX_BATCH
+ *  - stopOnFailure: whether the first negative result ends the batch
+ *  - results: result of each operation run; must stay valid until the
+ *    batch completes
+ *  - callback: called with the number of operations run
+ *  - data: passed to callback
+ * Returns: the request id, or TECNICOFS_ERROR_OTHER for invalid batches
+ *  (in the text format, 0 after running the operations one at a time)
+ */
+int tfsSubmitBatch(tfs_op *ops, int count, int stopOnFailure, int *results,
+        tfs_callback callback, void *data) {
+    static const char padding[3];
+    tfs_request batch, requests[TFS_MAX_BATCH];
+    struct iovec iov[1 + 4 * TFS_MAX_BATCH];
+    struct msghdr msg;
+    int i, n = 0;
+
+    if (count < 1 || count > TFS_MAX_BATCH)
+        return TECNICOFS_ERROR_OTHER;
+    for (i = 0; i < count; i++)
+        if (tfsEncode(&ops[i], &requests[i]) < 0)
+            return TECNICOFS_ERROR_OTHER;
+
+    /* The text format has no batches: run the operations one by one */
+    if (wire_format == TFS_WIRE_TEXT) {
+        for (i = 0; i < count; i++) {
+            completion c = { 0, 0 };
+            tfsSubmit(ops[i].op, ops[i].path, ops[i].arg, complete, &c);
+            results[i] = c.result;
+            if (stopOnFailure && c.result < 0) {
+                i++;
+                break;
+            }
+        }
+        callback(i, data);
+        return 0;
     }
 
-    if (recvfrom(sockfd, &answer, sizeof(int), 0, 0, 0) < 0) {
-        fprintf(stderr,"client: recvfrom error");
-        exit(EXIT_FAILURE);
+    batch.opcode = TFS_OP_BATCH;
+    batch.flags = stopOnFailure ? TFS_FLAG_STOP_ON_FAILURE : 0;
+    batch.path_len[0] = count;
+    batch.path_len[1] = 0;
+    batch.request_id = tfsReserve(callback, data, results, NULL, NULL);
+
+    iov[n].iov_base = &batch;
+    iov[n++].iov_len = sizeof(batch);
+
+    for (i = 0; i < count; i++) {
+        size_t size = sizeof(tfs_request) + requests[i].path_len[0] +
+            requests[i].path_len[1];
+
+        requests[i].request_id = i;
+        iov[n].iov_base = &requests[i];
+        iov[n++].iov_len = sizeof(tfs_request);
+        iov[n].iov_base = ops[i].path;
+        iov[n++].iov_len = requests[i].path_len[0];
+        if (requests[i].path_len[1]) {
+            iov[n].iov_base = ops[i].arg;
+            iov[n++].iov_len = requests[i].path_len[1];
+        }
+        if (TFS_ALIGN(size) != size) {
+            iov[n].iov_base = (void *) padding;
+            iov[n++].iov_len = TFS_ALIGN(size) - size;
+        }
     }
 
-    return answer;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    tfsSendMessage(&msg);
+
+    return batch.request_id;
 }
 
-int tfsLookup(char *path) {
-    socklen_t server_len;
-    struct sockaddr_un server_addr;
-    server_len = setSockAddrUn(server_path, &server_addr);
-    char str[MAX_INPUT_SIZE];
-    int answer;
+/*
+ * Asks for the tree listing, streamed back to the client, without waiting
+ * for it. Binary format only.
+ * Input:
+ *  - out: where the listing is written as it arrives
+ *  - callback: called with the final result
+ *  - data: passed to callback
+ * Returns: the request id, or TECNICOFS_ERROR_OTHER
+ */
+int tfsSubmitList(FILE *out, tfs_callback callback, void *data) {
+    tfs_request request;
+    struct iovec iov;
+    struct msghdr msg;
+
+    if (wire_format == TFS_WIRE_TEXT)
+        return TECNICOFS_ERROR_OTHER;
+
+    memset(&request, 0, sizeof(request));
+    request.opcode = TFS_OP_LIST;
+    request.request_id = tfsReserve(callback, data, NULL, out, NULL);
+
+    iov.iov_base = &request;
+    iov.iov_len = sizeof(request);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    tfsSendMessage(&msg);
+
+    return request.request_id;
+}
 
-    sprintf(str, "l %s", path);
+/*
+ * Completes the requests whose answers have arrived.
+ * Input:
+ *  - wait: whether to block until at least one request completes
+ * Returns: number of requests completed
+ */
+int tfsPoll(int wait) {
+    int completed = 0;
 
-    if (sendto(sockfd, str, strlen(str)+1, 0,
-                (struct sockaddr *) &server_addr, server_len) < 0) {
-        fprintf(stderr,"client: sendto error\n");
-        exit(EXIT_FAILURE);
+    if (in_flight_count == 0)
+        return 0;
+
+    if (wait)
+        completed += tfsReceive(1);
+    while (in_flight_count > 0 && tfsReceive(0))
+        completed++;
+
+    return completed;
+}
+
+/* Waits until every request in flight has completed */
+int tfsWaitAll() {
+    while (in_flight_count > 0)
+        tfsReceive(1);
+
+    return 0;
+}
+
+/*
+ * Submits a request and waits for its answer.
+ * Returns: the server's answer, or TECNICOFS_ERROR_OTHER if the request
+ *  could not be submitted
+ */
+static int tfsRequest(char op, char *path, char *arg) {
+    completion c = { 0, 0 };
+    int id = tfsSubmit(op, path, arg, complete, &c);
+
+    if (id < 0)
+        return id;
+    while (!c.done)
+        tfsReceive(1);
+
+    return c.result;
+}
+
+/*
+ * Runs a batch and waits for its answer.
+ * Returns: number of operations run, or TECNICOFS_ERROR_OTHER for invalid
+ *  batches
+ */
+int tfsBatch(tfs_op *ops, int count, int stopOnFailure, int *results) {
+    completion c = { 0, 0 };
+    int id = tfsSubmitBatch(ops, count, stopOnFailure, results, complete, &c);
+
+    if (id < 0)
+        return id;
+    while (!c.done)
+        tfsReceive(1);
+
+    return c.result;
+}
+
+/*
+ * Writes the tree listing to out, as the server streams it.
+ * Returns: 0, or an error code
+ */
+int tfsList(FILE *out) {
+    completion c = { 0, 0 };
+    int id = tfsSubmitList(out, complete, &c);
+
+    if (id < 0)
+        return id;
+    while (!c.done)
+        tfsReceive(1);
+
+    return c.result;
+}
+
+/*
+ * Sends a file request and waits for its answer.
+ * Input:
+ *  - opcode: TFS_OP_OPEN to TFS_OP_STAT
+ *  - flags: the permission, for open
+ *  - path: path of the file, for open and stat, or directory, for readdir
+ *    (NULL otherwise)
+ *  - handle: the file, but for open, readdir and stat
+ *  - size: new size, for truncate; cursor, for readdir
+ *  - buffer: where read bytes (or the readdir or stat answer) go, or the
+ *    bytes to write
+ *  - length: number of bytes (up to TFS_MAX_IO for writes); most
+ *    entries, for readdir
+ * Returns: the server's answer
+ */
+static int tfsFileRequest(uint8_t opcode, uint8_t flags, char *path,
+        int handle, long size, char *buffer, int length) {
+    completion c = { 0, 0 };
+    tfs_request request;
+    tfs_io io;
+    struct iovec iov[3];
+    struct msghdr msg;
+
+    if (wire_format == TFS_WIRE_TEXT)
+        return TECNICOFS_ERROR_OTHER;
+
+    request.opcode = opcode;
+    request.flags = flags;
+    request.path_len[0] = path ? strlen(path) + 1 : 0;
+    request.path_len[1] = opcode == TFS_OP_WRITE ? length : 0;
+    request.request_id = tfsReserve(complete, &c, NULL, NULL,
+            opcode == TFS_OP_READ || opcode == TFS_OP_READDIR ||
+            opcode == TFS_OP_STAT ? buffer : NULL);
+
+    io.size = size;
+    io.length = length;
+    io.handle = handle;
+
+    iov[0].iov_base = &request;
+    iov[0].iov_len = sizeof(request);
+    iov[1].iov_base = &io;
+    iov[1].iov_len = sizeof(io);
+    iov[2].iov_base = path ? path : buffer;
+    iov[2].iov_len = request.path_len[0] + request.path_len[1];
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov[2].iov_len ? 3 : 2;
+    tfsSendMessage(&msg);
+
+    while (!c.done)
+        tfsReceive(1);
+    return c.result;
+}
+
+/*
+ * Opens a file, at offset 0, in the open-file table the server keeps for
+ * the session (seqpacket and shm transports, binary format).
+ * Input:
+ *  - filename: path of the file
+ *  - mode: READ, WRITE or RW
+ * Returns: the file's handle, or TECNICOFS_ERROR_INVALID_MODE,
+ *  TECNICOFS_ERROR_MAXED_OPEN_FILES, TECNICOFS_ERROR_FILE_NOT_FOUND,
+ *  TECNICOFS_ERROR_NO_OPEN_SESSION or TECNICOFS_ERROR_OTHER
+ */
+int tfsOpen(char *filename, permission mode) {
+    if (strlen(filename) + 1 > max_path)
+        return TECNICOFS_ERROR_OTHER;
+
+    return tfsFileRequest(TFS_OP_OPEN, mode, filename, 0, 0, NULL, 0);
+}
+
+int tfsClose(int fd) {
+    return tfsFileRequest(TFS_OP_CLOSE, 0, NULL, fd, 0, NULL, 0);
+}
+
+/*
+ * Reads up to len bytes from an open file, at its offset, in one request.
+ * Returns: number of bytes read (0 at the end of the file), or an error
+ *  code
+ */
+int tfsRead(int fd, char *buffer, int len) {
+    if (len < 0)
+        return TECNICOFS_ERROR_OTHER;
+
+    return tfsFileRequest(TFS_OP_READ, 0, NULL, fd, 0, buffer, len);
+}
+
+/*
+ * Writes len bytes to an open file, at its offset, growing it if needed.
+ * Requests carry up to TFS_MAX_IO bytes each; they go one at a time,
+ * since each one writes where the last left the offset.
+ * Returns: number of bytes written, or an error code
+ */
+int tfsWrite(int fd, char *buffer, int len) {
+    int written = 0;
+
+    while (written < len) {
+        int part = len - written < TFS_MAX_IO ? len - written : TFS_MAX_IO;
+        int res = tfsFileRequest(TFS_OP_WRITE, 0, NULL, fd, 0,
+                buffer + written, part);
+
+        if (res < 0)
+            return written ? written : res;
+        written += res;
+        if (res < part)
+            break;
     }
+    return written;
+}
 
-    if (recvfrom(sockfd, &answer, sizeof(int), 0, 0, 0) < 0) {
-        fprintf(stderr,"client: recvfrom error");
-        exit(EXIT_FAILURE);
+/*
+ * Sets the size of an open file; its offset stays where it is.
+ * Returns: 0, or an error code
+ */
+int tfsTruncate(int fd, long size) {
+    return tfsFileRequest(TFS_OP_TRUNCATE, 0, NULL, fd, size, NULL, 0);
+}
+
+/*
+ * Lists a page of a directory's entries, in one request. A listing starts
+ * with *cursor at 0 and goes on from where each page leaves it until it
+ * is TFS_DIR_END. Every entry that stays in the directory meanwhile is
+ * listed exactly once, whatever else is created or deleted.
+ * Input:
+ *  - path: path of the directory
+ *  - cursor: where the page starts; set to where the next one does
+ *  - entries: where the entries are stored
+ *  - max: most entries (the server sends up to TFS_MAX_DIRENTS)
+ * Returns: number of entries listed, or an error code
+ */
+int tfsReadDir(char *path, uint64_t *cursor, tfs_entry *entries, int max) {
+    char answer[TFS_MAX_IO];
+    int count = 0, offset = sizeof(*cursor);
+
+    if (strlen(path) + 1 > max_path || max < 1)
+        return TECNICOFS_ERROR_OTHER;
+
+    int bytes = tfsFileRequest(TFS_OP_READDIR, 0, path, 0, *cursor, answer, max);
+
+    if (bytes < 0)
+        return bytes;
+    if (bytes < sizeof(*cursor) || bytes > sizeof(answer))
+        return TECNICOFS_ERROR_OTHER;
+
+    memcpy(cursor, answer, sizeof(*cursor));
+    while (offset + sizeof(tfs_dirent) <= bytes && count < max) {
+        tfs_dirent entry;
+
+        memcpy(&entry, answer + offset, sizeof(entry));
+        offset += sizeof(entry);
+        if (entry.name_len >= TFS_MAX_NAME || offset + entry.name_len > bytes)
+            return TECNICOFS_ERROR_OTHER;
+
+        entries[count].inumber = entry.inumber;
+        entries[count].nodeType = entry.type;
+        memcpy(entries[count].name, answer + offset, entry.name_len);
+        entries[count].name[entry.name_len] = '\0';
+        offset += entry.name_len;
+        count++;
     }
+    return count;
+}
 
-    return answer;
+/*
+ * Reads the metadata of a node in one request. A client that cached what
+ * it read from a node along with its inumber and version can keep using
+ * it for as long as both stay the same.
+ * Input:
+ *  - path: path of the node
+ *  - attr: where the metadata is stored
+ * Returns: 0, or an error code
+ */
+int tfsStat(char *path, tfs_attr *attr) {
+    char answer[TFS_MAX_IO];
+    tfs_stat st;
+
+    if (strlen(path) + 1 > max_path)
+        return TECNICOFS_ERROR_OTHER;
+
+    int bytes = tfsFileRequest(TFS_OP_STAT, 0, path, 0, 0, answer, 0);
+
+    if (bytes < 0)
+        return bytes;
+    if (bytes != sizeof(st))
+        return TECNICOFS_ERROR_OTHER;
+
+    memcpy(&st, answer, sizeof(st));
+    attr->inumber = st.inumber;
+    attr->nodeType = st.type;
+    attr->size = st.size;
+    attr->nlink = st.nlink;
+    attr->version = st.version;
+    attr->ctime = st.ctime;
+    attr->mtime = st.mtime;
+    return 0;
+}
+
+int tfsCreate(char *filename, char nodeType) {
+    char type[2] = { nodeType, '\0' };
+    return tfsRequest('c', filename, type);
+}
+
+int tfsDelete(char *path) {
+    return tfsRequest('d', path, NULL);
+}
+
+/*
+ * Creates a directory and any of its ancestors that are missing, as one
+ * request.
+ * Returns: number of directories created, or an error
+ */
+int tfsCreateParents(char *path) {
+    return tfsRequest('c', path, "p");
+}
+
+/*
+ * Deletes a node and everything under it, as one request.
+ * Returns: number of nodes deleted, or an error
+ */
+int tfsDeleteRecursive(char *path) {
+    return tfsRequest('d', path, "r");
+}
+
+int tfsMove(char *from, char *to) {
+    return tfsRequest('m', from, to);
+}
+
+int tfsLookup(char *path) {
+    return tfsRequest('l', path, NULL);
 }
 
 int tfsPrint(char *path) {
-    socklen_t server_len;
-    struct sockaddr_un server_addr;
-    server_len = setSockAddrUn(server_path, &server_addr);
-    char str[MAX_INPUT_SIZE];
-    int answer;
+    return tfsRequest('p', path, NULL);
+}
 
-    sprintf(str, "p %s", path);
+int tfsSetTransport(int kind) {
+    if (kind != TFS_TRANSPORT_DGRAM && kind != TFS_TRANSPORT_SEQPACKET &&
+            kind != TFS_TRANSPORT_SHM)
+        return TECNICOFS_ERROR_OTHER;
 
-    if (sendto(sockfd, str, strlen(str)+1, 0,
-                (struct sockaddr *) &server_addr, server_len) < 0) {
-        fprintf(stderr,"client: sendto error\n");
-        exit(EXIT_FAILURE);
-    }
+    transport = kind;
+    return 0;
+}
 
-    if (recvfrom(sockfd, &answer, sizeof(int), 0, 0, 0) < 0) {
-        fprintf(stderr,"client: recvfrom error");
-        exit(EXIT_FAILURE);
-    }
+int tfsSetWireFormat(int format) {
+    if (format != TFS_WIRE_TEXT && format != TFS_WIRE_BINARY)
+        return TECNICOFS_ERROR_OTHER;
 
-    return answer;
+    wire_format = format;
+    return 0;
 }
 
+/*
+ * Agrees on the longest path (terminator included) with the server.
+ * Returns: 0 or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+static int tfsHello() {
+    tfs_request request;
+    tfs_response response;
+
+    memset(&request, 0, sizeof(request));
+    request.opcode = TFS_OP_HELLO;
+    request.path_len[0] = MAX_FILE_NAME;
+    request.request_id = ++request_id;
+
+    if (send(sockfd, &request, sizeof(request), 0) < 0)
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+
+    do {
+        if (recvfrom(sockfd, &response, sizeof(response), 0, 0, 0) < 0)
+            return TECNICOFS_ERROR_CONNECTION_ERROR;
+    } while (response.request_id != request.request_id);
+
+    if (response.result <= 0)
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+
+    max_path = response.result;
+    return 0;
+}
+
+/*
+ * Maps a pair of rings in shared memory and hands it to the server, with
+ * the eventfds each side sleeps on, over the session.
+ * Returns: 0 or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+static int tfsAttach() {
+    int fds[TFS_ATTACH_FDS];
+    char control[CMSG_SPACE(sizeof(fds))];
+    tfs_request request;
+    tfs_response response;
+    struct iovec iov = { &request, sizeof(request) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    void *map;
+
+    /* sealed at its size: the server maps it and must not see it shrink */
+    if ((fds[0] = memfd_create("tecnicofs-rings", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 ||
+            ftruncate(fds[0], sizeof(tfs_ring_pair)) < 0 ||
+            fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+            (map = mmap(NULL, sizeof(tfs_ring_pair), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fds[0], 0)) == MAP_FAILED)
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+
+    /* The server polls the request eventfd, the client blocks on the other */
+    if ((fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+            (fds[2] = eventfd(0, EFD_CLOEXEC)) < 0)
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+
+    memset(&request, 0, sizeof(request));
+    request.opcode = TFS_OP_ATTACH;
+    request.request_id = ++request_id;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sockfd, &msg, 0) < 0 ||
+            recv(sockfd, &response, sizeof(response), 0) < sizeof(response) ||
+            response.request_id != request.request_id || response.result != 0)
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+
+    /* The mapping outlives the memfd */
+    close(fds[0]);
+    request_event = fds[1];
+    response_event = fds[2];
+    rings = map;
+    return 0;
+}
 
 int tfsMount(char* clientName, char* sockPath) {
-    socklen_t client_len;
-    struct sockaddr_un client_addr;
+    socklen_t client_len, server_len;
+    struct sockaddr_un client_addr, server_addr;
     server_path = malloc((strlen(sockPath)+1));
 
-    if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    /* The rings only carry the binary format */
+    if (transport == TFS_TRANSPORT_SHM && wire_format == TFS_WIRE_TEXT)
+        return TECNICOFS_ERROR_OTHER;
+
+    /* The rings are attached through a session */
+    if ((sockfd = socket(AF_UNIX, transport == TFS_TRANSPORT_DGRAM ?
+                    SOCK_DGRAM : SOCK_SEQPACKET, 0)) < 0) {
         fprintf(stderr,"client: can't open socket\n");
         exit(EXIT_FAILURE);
     }
 
-    unlink(clientName);
-    client_len = setSockAddrUn(clientName, &client_addr);
+    /* A session needs no address of its own: answers come back on it */
+    if (transport == TFS_TRANSPORT_DGRAM) {
+        unlink(clientName);
+        client_len = setSockAddrUn(clientName, &client_addr);
 
-    if (bind(sockfd, (struct sockaddr *) &client_addr, client_len) < 0) {
-        fprintf(stderr,"client: bind error\n");
-        exit(EXIT_FAILURE);
+        if (bind(sockfd, (struct sockaddr *) &client_addr, client_len) < 0) {
+            fprintf(stderr,"client: bind error\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
     strcpy(server_path, sockPath);
 
-    return 0;
+    /* Connected, the socket reports whether the server's queue has room */
+    server_len = setSockAddrUn(server_path, &server_addr);
+    if (connect(sockfd, (struct sockaddr *) &server_addr, server_len) < 0)
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+
+    if (tfsHello() < 0)
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+
+    return transport == TFS_TRANSPORT_SHM ? tfsAttach() : 0;
 }
 
 int tfsUnmount(char* clientName) {
     free(server_path);
 
+    if (rings != NULL) {
+        munmap(rings, sizeof(tfs_ring_pair));
+        close(request_event);
+        close(response_event);
+        rings = NULL;
+    }
+
     if (close(sockfd) < 0){
         fprintf(stderr, "client: close error \n");
         exit(EXIT_FAILURE);
     }
 
-    if (unlink(clientName) < 0){
+    if (transport == TFS_TRANSPORT_DGRAM && unlink(clientName) < 0){
         fprintf(stderr, "client: unlink error \n");
         exit(EXIT_FAILURE);
     }
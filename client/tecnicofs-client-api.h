@@ -1,13 +1,83 @@
 #ifndef API_H
 #define API_H
 
+#include <stdio.h>
+#include <stdint.h>
 #include "../tecnicofs-api-constants.h"
 
+/* Transports, see tfsSetTransport */
+#define TFS_TRANSPORT_DGRAM 0
+#define TFS_TRANSPORT_SEQPACKET 1
+#define TFS_TRANSPORT_SHM 2
+
+/* Wire formats, see tfsSetWireFormat */
+#define TFS_WIRE_TEXT 0
+#define TFS_WIRE_BINARY 1
+
+/* Most requests tfsSubmit keeps in flight at once */
+#define TFS_MAX_IN_FLIGHT 64
+
+/* Completion of a submitted request, called with the server's answer */
+typedef void (*tfs_callback)(int result, void *data);
+
+/* Most operations in a batch (as in tecnicofs-protocol.h) */
+#define TFS_MAX_BATCH 32
+
+/* An operation of a batch: op, path and arg as for tfsSubmit */
+typedef struct tfs_op {
+    char op;
+    char *path;
+    char *arg;
+} tfs_op;
+
+/* Directory listings (as in tecnicofs-protocol.h), see tfsReadDir */
+#define TFS_MAX_DIRENTS 128
+#define TFS_DIR_END ((uint64_t) 1 << 32)
+#define TFS_MAX_NAME 256 /* longest entry name, terminator included */
+
+/* An entry listed by tfsReadDir */
+typedef struct tfs_entry {
+    int inumber;
+    type nodeType;
+    char name[TFS_MAX_NAME];
+} tfs_entry;
+
+/* Metadata of a node, see tfsStat */
+typedef struct tfs_attr {
+    int inumber;
+    type nodeType;
+    long size; /* files: bytes; directories: entries */
+    int nlink;
+    uint64_t version; /* changes whenever the node does */
+    long long ctime; /* ns since the epoch */
+    long long mtime;
+} tfs_attr;
+
 int tfsCreate(char *path, char nodeType);
 int tfsDelete(char *path);
+int tfsCreateParents(char *path);
+int tfsDeleteRecursive(char *path);
 int tfsLookup(char *path);
 int tfsMove(char *from, char *to);
 int tfsPrint(char *path);
+int tfsSubmit(char op, char *path, char *arg, tfs_callback callback,
+        void *data);
+int tfsSubmitBatch(tfs_op *ops, int count, int stopOnFailure, int *results,
+        tfs_callback callback, void *data);
+int tfsBatch(tfs_op *ops, int count, int stopOnFailure, int *results);
+int tfsSubmitList(FILE *out, tfs_callback callback, void *data);
+int tfsList(FILE *out);
+int tfsOpen(char *filename, permission mode);
+int tfsClose(int fd);
+int tfsRead(int fd, char *buffer, int len);
+int tfsWrite(int fd, char *buffer, int len);
+int tfsTruncate(int fd, long size);
+int tfsReadDir(char *path, uint64_t *cursor, tfs_entry *entries, int max);
+int tfsStat(char *path, tfs_attr *attr);
+int tfsPoll(int wait);
+int tfsWaitAll();
+int tfsSetTransport(int kind);
+int tfsSetWireFormat(int format);
 int tfsMount(char* clientName, char* serverName);
 int tfsUnmount(char* clientName);
 
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include "tecnicofs-client-api.h"
 #include "../tecnicofs-api-constants.h"
@@ -11,20 +12,134 @@
 FILE* inputFile;
 char* serverName, clientName[MAX_FILE_NAME];
 
+/* Transport (-t) and wire format (-w) of the requests */
+int transportKind = TFS_TRANSPORT_DGRAM;
+int wireFormat = TFS_WIRE_BINARY;
+
+/* Requests in flight at once (-p); 1 waits for each answer in turn */
+int pipelineDepth = 1;
+
+/* Operations per request (-b), and whether a failure ends a batch (-s) */
+int batchSize = 1;
+int stopOnFailure = 0;
+
+/* Whether throughput and latencies are reported (-v) */
+int reportStats = 0;
+
+/* Number of operations sent to the server */
+int numberOperations = 0;
+
+/*
+ * Latencies (in microseconds) of the operations of one kind
+ */
+typedef struct latencies {
+    char op;
+    int count, size;
+    double *samples;
+} latencies;
+
+latencies opLatencies[] = {
+    { 'c', 0, 0, NULL }, { 'l', 0, 0, NULL }, { 'd', 0, 0, NULL },
+    { 'm', 0, 0, NULL }, { 'p', 0, 0, NULL }, { 'w', 0, 0, NULL },
+    { 'r', 0, 0, NULL }, { 'e', 0, 0, NULL }, { 's', 0, 0, NULL }
+};
+#define OP_KINDS (sizeof(opLatencies) / sizeof(latencies))
+
+void recordLatency(char op, struct timeval *start, struct timeval *end) {
+    if (!reportStats)
+        return;
+    for (int i = 0; i < OP_KINDS; i++) {
+        latencies *l = &opLatencies[i];
+        if (l->op != op)
+            continue;
+
+        if (l->count == l->size) {
+            l->size = l->size ? l->size * 2 : 1024;
+            l->samples = realloc(l->samples, sizeof(double) * l->size);
+        }
+        l->samples[l->count++] = (end->tv_sec - start->tv_sec) * 1000000.0 +
+            (end->tv_usec - start->tv_usec);
+        return;
+    }
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Prints the p50, p99 and maximum latency of every kind of operation */
+void printLatencies() {
+    for (int i = 0; i < OP_KINDS; i++) {
+        latencies *l = &opLatencies[i];
+        if (l->count == 0)
+            continue;
+
+        qsort(l->samples, l->count, sizeof(double), compareDoubles);
+        printf("Latency %c: %d ops, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                l->op, l->count, l->samples[l->count / 2],
+                l->samples[(int) (l->count * 0.99)], l->samples[l->count - 1]);
+        free(l->samples);
+    }
+}
+
 static void displayUsage(const char* appName) {
-    printf("Usage: %s inputfile server_socket_name\n", appName);
+    printf("Usage: %s [-t dgram|seqpacket|shm] [-w text|binary] [-p depth] [-b size [-s]] [-v] inputfile server_socket_name\n", appName);
     exit(EXIT_FAILURE);
 }
 
 static void parseArgs(long argc, char* const argv[]) {
-    if (argc != 3) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:w:p:b:sv")) != -1) {
+        switch (opt) {
+            case 't':
+                if (!strcmp(optarg, "dgram"))
+                    transportKind = TFS_TRANSPORT_DGRAM;
+                else if (!strcmp(optarg, "seqpacket"))
+                    transportKind = TFS_TRANSPORT_SEQPACKET;
+                else if (!strcmp(optarg, "shm"))
+                    transportKind = TFS_TRANSPORT_SHM;
+                else
+                    displayUsage(argv[0]);
+                break;
+            case 'w':
+                if (!strcmp(optarg, "text"))
+                    wireFormat = TFS_WIRE_TEXT;
+                else if (!strcmp(optarg, "binary"))
+                    wireFormat = TFS_WIRE_BINARY;
+                else
+                    displayUsage(argv[0]);
+                break;
+            case 'p':
+                pipelineDepth = atoi(optarg);
+                if (pipelineDepth < 1 || pipelineDepth > TFS_MAX_IN_FLIGHT)
+                    displayUsage(argv[0]);
+                break;
+            case 'b':
+                batchSize = atoi(optarg);
+                if (batchSize < 1 || batchSize > TFS_MAX_BATCH)
+                    displayUsage(argv[0]);
+                break;
+            case 's':
+                stopOnFailure = 1;
+                break;
+            case 'v':
+                reportStats = 1;
+                break;
+            default:
+                displayUsage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2) {
         fprintf(stderr, "Invalid format:\n");
         displayUsage(argv[0]);
     }
 
-    serverName = argv[2];
+    serverName = argv[optind + 1];
 
-    inputFile = fopen(argv[1], "r");
+    inputFile = fopen(argv[optind], "r");
 
     if (inputFile == NULL) {
         fprintf(stderr, "Error: cannot open input file\n");
@@ -37,88 +152,338 @@ void errorParse(){
     exit(EXIT_FAILURE);
 }
 
+/* An operation read from the input, until it completes */
+typedef struct operation {
+    char op;
+    char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
+    struct timeval start;
+} operation;
+
+/* Requests submitted and not yet completed */
+int inFlight = 0;
+
+void printResult(operation *o, int res) {
+    switch (o->op) {
+        case 'c':
+            if (o->arg2[0] == 'p') {
+                if (res >= 0)
+                    printf("Created directories: %s, %d new\n", o->arg1, res);
+                else
+                    printf("Unable to create directories: %s\n", o->arg1);
+            }
+            else if (o->arg2[0] == 'f') {
+                if (!res)
+                    printf("Created file: %s\n", o->arg1);
+                else
+                    printf("Unable to create file: %s\n", o->arg1);
+            }
+            else {
+                if (!res)
+                    printf("Created directory: %s\n", o->arg1);
+                else
+                    printf("Unable to create directory: %s\n", o->arg1);
+            }
+            break;
+        case 'l':
+            if (res >= 0)
+                printf("Search: %s found\n", o->arg1);
+            else
+                printf("Search: %s not found\n", o->arg1);
+            break;
+        case 'd':
+            if (o->arg2[0] == 'r') {
+                if (res >= 0)
+                    printf("Deleted: %s, %d nodes\n", o->arg1, res);
+                else
+                    printf("Unable to delete: %s\n", o->arg1);
+            }
+            else if (!res)
+                printf("Deleted: %s\n", o->arg1);
+            else
+                printf("Unable to delete: %s\n", o->arg1);
+            break;
+        case 'm':
+            if (!res)
+                printf("Moved: %s to %s\n", o->arg1, o->arg2);
+            else
+                printf("Unable to move: %s to %s\n", o->arg1, o->arg2);
+            break;
+        case 'p':
+            if (!res)
+                printf("Print tree to: %s\n", o->arg1);
+            else
+                printf("Unable to print to: %s\n", o->arg1);
+            break;
+        case 'w':
+            if (!res)
+                printf("Wrote: %s, %s bytes\n", o->arg1, o->arg2);
+            else
+                printf("Unable to write: %s\n", o->arg1);
+            break;
+        case 'r':
+            if (res >= 0)
+                printf("Read: %s, %d bytes\n", o->arg1, res);
+            else
+                printf("Unable to read: %s\n", o->arg1);
+            break;
+        case 'e':
+            if (res >= 0)
+                printf("Listed: %s, %d entries\n", o->arg1, res);
+            else
+                printf("Unable to list: %s\n", o->arg1);
+            break;
+        case 's':
+            if (!res)
+                printf("Stat: %s\n", o->arg1);
+            else
+                printf("Unable to stat: %s\n", o->arg1);
+            break;
+    }
+}
+
+/* Byte at a position of the files written by "w" */
+static char patternByte(long position) {
+    return 'a' + position % 26;
+}
+
+/*
+ * Replaces the contents of a file with size bytes of a known pattern.
+ * Returns: 0, or an error code
+ */
+int writeFile(char *path, int size) {
+    char *buffer = malloc(size > 0 ? size : 1);
+    int fd, res;
+
+    for (int i = 0; i < size; i++)
+        buffer[i] = patternByte(i);
+
+    if ((fd = tfsOpen(path, WRITE)) < 0) {
+        free(buffer);
+        return fd;
+    }
+
+    res = tfsTruncate(fd, 0);
+    if (!res && (res = tfsWrite(fd, buffer, size)) == size)
+        res = 0;
+
+    tfsClose(fd);
+    free(buffer);
+    return res < 0 ? res : 0;
+}
+
+/*
+ * Reads a whole file, checking it holds the pattern "w" writes.
+ * Returns: its size, or an error code
+ */
+int readFile(char *path) {
+    static char buffer[64 * 1024];
+    long total = 0;
+    int fd, res;
+
+    if ((fd = tfsOpen(path, READ)) < 0)
+        return fd;
+
+    while ((res = tfsRead(fd, buffer, sizeof(buffer))) > 0) {
+        for (int i = 0; i < res; i++)
+            if (buffer[i] != patternByte(total + i))
+                res = TECNICOFS_ERROR_OTHER;
+        if (res < 0)
+            break;
+        total += res;
+    }
+
+    tfsClose(fd);
+    return res < 0 ? res : total;
+}
+
+/*
+ * Lists a directory page by page, printing its entries.
+ * Returns: number of entries, or an error code
+ */
+int listDir(char *path) {
+    static tfs_entry entries[TFS_MAX_DIRENTS];
+    uint64_t cursor = 0;
+    int total = 0;
+
+    while (cursor != TFS_DIR_END) {
+        int res = tfsReadDir(path, &cursor, entries, TFS_MAX_DIRENTS);
+
+        if (res < 0)
+            return res;
+        for (int i = 0; i < res; i++)
+            printf("  %s %c\n", entries[i].name,
+                    entries[i].nodeType == T_DIRECTORY ? 'd' : 'f');
+        total += res;
+    }
+    return total;
+}
+
+/*
+ * Prints the metadata of a node.
+ * Returns: 0, or an error code
+ */
+int statPath(char *path) {
+    tfs_attr attr;
+    int res = tfsStat(path, &attr);
+
+    if (res < 0)
+        return res;
+    printf("  %s, %ld %s, %d links, version %llu, inumber %d\n",
+            attr.nodeType == T_DIRECTORY ? "directory" : "file", attr.size,
+            attr.nodeType == T_DIRECTORY ? "entries" : "bytes", attr.nlink,
+            (unsigned long long) attr.version, attr.inumber);
+    return 0;
+}
+
+/* Operations sent together in one request (-b) */
+typedef struct batch {
+    int count;
+    operation *ops[TFS_MAX_BATCH];
+    tfs_op requests[TFS_MAX_BATCH];
+    int results[TFS_MAX_BATCH];
+} batch;
+
+/* Reports a completed operation and releases it */
+void finishOperation(operation *o, int res) {
+    struct timeval end;
+
+    gettimeofday(&end, NULL);
+    recordLatency(o->op, &o->start, &end);
+    printResult(o, res);
+    free(o);
+}
+
+/* Completion of a submitted operation */
+void completeOperation(int res, void *data) {
+    inFlight--;
+    finishOperation(data, res);
+}
+
+/* Completion of a submitted batch, of which executed operations ran */
+void completeBatch(int executed, void *data) {
+    batch *b = data;
+
+    inFlight--;
+    for (int i = 0; i < b->count; i++) {
+        if (i < executed)
+            finishOperation(b->ops[i], b->results[i]);
+        else {
+            printf("Skipped: %c %s\n", b->ops[i]->op, b->ops[i]->arg1);
+            free(b->ops[i]);
+        }
+    }
+    free(b);
+}
+
+/* Sends the operations gathered in a batch */
+void submitBatch(batch *b) {
+    inFlight++;
+    if (tfsSubmitBatch(b->requests, b->count, stopOnFailure, b->results,
+                completeBatch, b) < 0)
+        completeBatch(0, b);
+}
+
 void *processInput() {
     char line[MAX_INPUT_SIZE];
+    batch *b = NULL;
 
     while (fgets(line, sizeof(line)/sizeof(char), inputFile)) {
-        char op;
-        char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
-        int res;
-
-        int numTokens = sscanf(line, "%c %s %s", &op, arg1, arg2);
+        operation *o = malloc(sizeof(operation));
+        int numTokens = sscanf(line, "%c %s %s", &o->op, o->arg1, o->arg2);
+        char *arg;
 
         /* perform minimal validation */
-        if (numTokens < 1) {
+        if (numTokens < 1 || o->op == '#') {
+            free(o);
             continue;
         }
-        switch (op) {
+
+        switch (o->op) {
             case 'c':
-                if(numTokens != 3) {
-                    errorParse();
-                    break;
-                }
-                switch (arg2[0]) {
-                    case 'f':
-                        res = tfsCreate(arg1, 'f');
-                        if (!res)
-                            printf("Created file: %s\n", arg1);
-                        else
-                            printf("Unable to create file: %s\n", arg1);
-                        break;
-                    case 'd':
-                        res = tfsCreate(arg1, 'd');
-                        if (!res)
-                            printf("Created directory: %s\n", arg1);
-                        else
-                            printf("Unable to create directory: %s\n", arg1);
-                        break;
-                    default:
-                        fprintf(stderr, "Error: invalid node type\n");
-                }
-                break;
-            case 'l':
-                if(numTokens != 2)
+            case 'm':
+            case 'w':
+                if (numTokens != 3)
                     errorParse();
-                res = tfsLookup(arg1);
-                if (res >= 0)
-                    printf("Search: %s found\n", arg1);
-                else
-                    printf("Search: %s not found\n", arg1);
                 break;
             case 'd':
-                if(numTokens != 2)
-                    errorParse();
-                res = tfsDelete(arg1);
-                if (!res)
-                    printf("Deleted: %s\n", arg1);
-                else
-                    printf("Unable to delete: %s\n", arg1);
-                break;
-            case 'm':
-                if(numTokens != 3)
+                if (numTokens == 2)
+                    o->arg2[0] = '\0';
+                else if (numTokens != 3 || strcmp(o->arg2, "r"))
                     errorParse();
-                res = tfsMove(arg1, arg2);
-                if (!res)
-                    printf("Moved: %s to %s\n", arg1, arg2);
-                else
-                    printf("Unable to move: %s to %s\n", arg1, arg2);
                 break;
+            case 'l':
             case 'p':
-                if(numTokens != 2)
+            case 'r':
+            case 'e':
+            case 's':
+                if (numTokens != 2)
                     errorParse();
-                res = tfsPrint(arg1);
-                if (!res)
-                    printf("Print tree to: %s\n", arg1);
-                else
-                    printf("Unable to print to: %s\n", arg1);
-                break;
-            case '#':
                 break;
             default: { /* error */
                          errorParse();
                      }
         }
+        if (o->op == 'c' && o->arg2[0] != 'f' && o->arg2[0] != 'd' && o->arg2[0] != 'p') {
+            fprintf(stderr, "Error: invalid node type\n");
+            free(o);
+            continue;
+        }
+
+        numberOperations++;
+        gettimeofday(&o->start, NULL);
+        arg = o->op == 'c' || o->op == 'm' || (o->op == 'd' && o->arg2[0]) ? o->arg2 : NULL;
+
+        /* File contents, listings and metadata are moved synchronously,
+         * after what is in flight */
+        if (o->op == 'w' || o->op == 'r' || o->op == 'e' || o->op == 's') {
+            if (b != NULL) {
+                submitBatch(b);
+                b = NULL;
+            }
+            tfsWaitAll();
+            if (o->op == 'w')
+                finishOperation(o, writeFile(o->arg1, atoi(o->arg2)));
+            else if (o->op == 's')
+                finishOperation(o, statPath(o->arg1));
+            else
+                finishOperation(o, o->op == 'r' ? readFile(o->arg1) : listDir(o->arg1));
+            continue;
+        }
+
+        /* "p -" streams the tree listing to standard output */
+        if (o->op == 'p' && !strcmp(o->arg1, "-")) {
+            inFlight++;
+            if (tfsSubmitList(stdout, completeOperation, o) < 0)
+                completeOperation(TECNICOFS_ERROR_OTHER, o);
+        }
+        else if (batchSize > 1) {
+            if (b == NULL) {
+                b = malloc(sizeof(batch));
+                b->count = 0;
+            }
+            b->ops[b->count] = o;
+            b->requests[b->count].op = o->op;
+            b->requests[b->count].path = o->arg1;
+            b->requests[b->count].arg = arg;
+            if (++b->count < batchSize)
+                continue;
+
+            submitBatch(b);
+            b = NULL;
+        }
+        else {
+            inFlight++;
+            if (tfsSubmit(o->op, o->arg1, arg, completeOperation, o) < 0)
+                completeOperation(TECNICOFS_ERROR_OTHER, o);
+        }
+
+        /* Keep at most pipelineDepth requests in flight */
+        while (inFlight >= pipelineDepth)
+            tfsPoll(1);
     }
+    if (b != NULL)
+        submitBatch(b);
+    tfsWaitAll();
     fclose(inputFile);
     return NULL;
 }
@@ -133,6 +498,8 @@ void updateClientName() {
 int main(int argc, char* argv[]) {
     parseArgs(argc, argv);
     updateClientName();
+    tfsSetTransport(transportKind);
+    tfsSetWireFormat(wireFormat);
 
     if (tfsMount(clientName, serverName) == 0)
         printf("Mounted! (socket = %s)\n", serverName);
@@ -141,8 +508,21 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
     processInput();
 
+    gettimeofday(&end, NULL);
+    double elapsed = (end.tv_sec - start.tv_sec) +
+        (end.tv_usec - start.tv_usec) / 1000000.0;
+    if (reportStats)
+        printf("Executed %d operations in %.4f seconds (%.0f ops/sec)\n",
+                numberOperations, elapsed,
+                elapsed > 0 ? numberOperations / elapsed : 0);
+    if (reportStats)
+        printLatencies();
+
     if (tfsUnmount(clientName) == 0)
         printf("Unmounted client socket!\n");
     else {
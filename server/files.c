@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "files.h"
+#include "fs/operations.h"
+
+/*
+ * Allocates an open-file table.
+ * Input:
+ *  - size: most files open at once
+ * Returns: the table, or NULL if memory is exhausted
+ */
+file_table *file_table_create(int size) {
+    file_table *table = malloc(sizeof(file_table) + sizeof(file_handle) * size);
+
+    if (table == NULL)
+        return NULL;
+
+    pthread_mutex_init(&table->lock, NULL);
+    table->size = size;
+    table->free_head = 0;
+
+    for (int i = 0; i < size; i++) {
+        pthread_mutex_init(&table->files[i].lock, NULL);
+        table->files[i].inumber = FREE_INODE;
+        table->files[i].next_free = i + 1 < size ? i + 1 : FREE_INODE;
+    }
+    return table;
+}
+
+/*
+ * Closes every file still open and releases the table. No request of the
+ * session may be running.
+ */
+void file_table_destroy(file_table *table) {
+    for (int i = 0; i < table->size; i++) {
+        if (table->files[i].inumber != FREE_INODE)
+            close_file(table->files[i].inumber);
+        pthread_mutex_destroy(&table->files[i].lock);
+    }
+    pthread_mutex_destroy(&table->lock);
+    free(table);
+}
+
+/*
+ * Records an open file.
+ * Input:
+ *  - table: the table
+ *  - inumber: the file, as returned by open_file
+ *  - mode: READ, WRITE or RW
+ * Returns: the handle, or TECNICOFS_ERROR_MAXED_OPEN_FILES
+ */
+int file_table_open(file_table *table, int inumber, permission mode) {
+    int handle;
+
+    if (pthread_mutex_lock(&table->lock)) {
+        fprintf(stderr, "Error: could not lock mutex: file table\n");
+    }
+
+    handle = table->free_head;
+    if (handle != FREE_INODE) {
+        file_handle *file = &table->files[handle];
+
+        table->free_head = file->next_free;
+        pthread_mutex_lock(&file->lock);
+        file->inumber = inumber;
+        file->mode = mode;
+        file->offset = 0;
+        pthread_mutex_unlock(&file->lock);
+    }
+
+    if (pthread_mutex_unlock(&table->lock)) {
+        fprintf(stderr, "Error: could not unlock mutex: file table\n");
+    }
+
+    return handle == FREE_INODE ? TECNICOFS_ERROR_MAXED_OPEN_FILES : handle;
+}
+
+/*
+ * Finds the open file of a handle and locks it, so the offset moves by
+ * one request at a time and the handle is not closed meanwhile.
+ * Input:
+ *  - table: the table
+ *  - handle: the handle
+ * Returns: the locked open file, or NULL if the handle is not open
+ */
+file_handle *file_table_acquire(file_table *table, int handle) {
+    file_handle *file;
+
+    if (handle < 0 || handle >= table->size)
+        return NULL;
+
+    file = &table->files[handle];
+    pthread_mutex_lock(&file->lock);
+    if (file->inumber == FREE_INODE) {
+        pthread_mutex_unlock(&file->lock);
+        return NULL;
+    }
+    return file;
+}
+
+/* Unlocks an open file locked by file_table_acquire */
+void file_table_release(file_handle *file) {
+    pthread_mutex_unlock(&file->lock);
+}
+
+/*
+ * Closes a handle.
+ * Input:
+ *  - table: the table
+ *  - handle: the handle
+ * Returns: SUCCESS or TECNICOFS_ERROR_FILE_NOT_OPEN
+ */
+int file_table_close(file_table *table, int handle) {
+    file_handle *file = file_table_acquire(table, handle);
+
+    if (file == NULL)
+        return TECNICOFS_ERROR_FILE_NOT_OPEN;
+
+    close_file(file->inumber);
+    file->inumber = FREE_INODE;
+    file_table_release(file);
+
+    if (pthread_mutex_lock(&table->lock)) {
+        fprintf(stderr, "Error: could not lock mutex: file table\n");
+    }
+    file->next_free = table->free_head;
+    table->free_head = handle;
+    if (pthread_mutex_unlock(&table->lock)) {
+        fprintf(stderr, "Error: could not unlock mutex: file table\n");
+    }
+    return SUCCESS;
+}
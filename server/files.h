@@ -0,0 +1,40 @@
+#ifndef FILES_H
+#define FILES_H
+
+#include <pthread.h>
+#include "../tecnicofs-api-constants.h"
+
+/*
+ * Open-file table of a session. A handle is an index into an array of
+ * open files, each holding the file's inumber, the mode it was opened in
+ * and the offset of the next read or write, so a request on an open file
+ * reaches its i-node without resolving a path. Free entries are chained,
+ * so opening and closing are O(1) too.
+ */
+
+#define FILES_DEFAULT_LIMIT 16
+#define FILES_MAX_LIMIT 4096
+
+typedef struct file_handle {
+    pthread_mutex_t lock;   /* held by the request using the handle */
+    int inumber;            /* FREE_INODE while the entry is free */
+    permission mode;
+    long offset;
+    int next_free;
+} file_handle;
+
+typedef struct file_table {
+    pthread_mutex_t lock;   /* serializes opens and closes */
+    int size;
+    int free_head;
+    file_handle files[];
+} file_table;
+
+file_table *file_table_create(int size);
+void file_table_destroy(file_table *table);
+int file_table_open(file_table *table, int inumber, permission mode);
+file_handle *file_table_acquire(file_table *table, int handle);
+void file_table_release(file_handle *file);
+int file_table_close(file_table *table, int handle);
+
+#endif /* FILES_H */
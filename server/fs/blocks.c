@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "blocks.h"
+
+/* A free run, linked through its first bytes */
+typedef struct free_run {
+    struct free_run *next, *prev;
+} free_run;
+
+/* A chunk taken from malloc, remembered until the pool is destroyed.
+ * free_class[b] is c + 1 if a free run of 1 << c blocks starts at block
+ * b, and 0 otherwise, so a freed run can tell whether its buddy is free */
+typedef struct block_chunk {
+    struct block_chunk *next;
+    char *blocks;
+    unsigned char free_class[BLOCK_MAX_RUN];
+} block_chunk;
+
+/* Bytes of a chunk, which is aligned to them */
+#define BLOCK_CHUNK_BYTES ((size_t) BLOCK_MAX_RUN * BLOCK_SIZE)
+
+/* Free runs of 1 << c blocks, for every class c */
+free_run *block_free_lists[BLOCK_RUN_CLASSES];
+block_chunk *block_chunks = NULL;
+unsigned long block_chunk_count = 0, block_free_blocks = 0;
+
+/* Every chunk, by address, to find the one a run belongs to */
+block_chunk **block_chunk_index = NULL;
+unsigned long block_chunk_capacity = 0;
+
+/* Serializes every change to the pool; runs are long, so it is rarely
+ * taken compared to the bytes copied in and out of them */
+pthread_mutex_t block_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void block_pool_lock() {
+    if (pthread_mutex_lock(&block_pool_mutex)) {
+        fprintf(stderr, "Error: could not lock mutex: block_pool_mutex\n");
+    }
+}
+
+static void block_pool_unlock() {
+    if (pthread_mutex_unlock(&block_pool_mutex)) {
+        fprintf(stderr, "Error: could not unlock mutex: block_pool_mutex\n");
+    }
+}
+
+/*
+ * Returns the class of a run length, the smallest c with 1 << c >= blocks.
+ */
+static int block_run_class(int blocks) {
+    int c = 0;
+
+    while ((1 << c) < blocks)
+        c++;
+    return c;
+}
+
+/*
+ * Returns the chunk a run lies in. Caller holds the pool lock.
+ */
+static block_chunk *block_chunk_of(char *run) {
+    char *base = (char *) ((uintptr_t) run & ~(uintptr_t) (BLOCK_CHUNK_BYTES - 1));
+    unsigned long low = 0, high = block_chunk_count;
+
+    while (low < high) {
+        unsigned long middle = (low + high) / 2;
+
+        if (block_chunk_index[middle]->blocks < base)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return block_chunk_index[low];
+}
+
+static int block_of(block_chunk *chunk, char *run) {
+    return (run - chunk->blocks) / BLOCK_SIZE;
+}
+
+static void block_free_push(block_chunk *chunk, int c, char *run) {
+    free_run *node = (free_run *) run;
+
+    node->next = block_free_lists[c];
+    node->prev = NULL;
+    if (node->next != NULL)
+        node->next->prev = node;
+    block_free_lists[c] = node;
+    chunk->free_class[block_of(chunk, run)] = c + 1;
+    block_free_blocks += 1 << c;
+}
+
+static void block_free_remove(block_chunk *chunk, int c, char *run) {
+    free_run *node = (free_run *) run;
+
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    else
+        block_free_lists[c] = node->next;
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    chunk->free_class[block_of(chunk, run)] = 0;
+    block_free_blocks -= 1 << c;
+}
+
+/*
+ * Adds a chunk of BLOCK_MAX_RUN blocks to the pool. Caller holds the
+ * pool lock.
+ * Returns: 0, or -1 if memory is exhausted
+ */
+static int block_pool_grow() {
+    block_chunk *chunk = calloc(1, sizeof(block_chunk));
+
+    if (block_chunk_count == block_chunk_capacity) {
+        unsigned long capacity = block_chunk_capacity ? block_chunk_capacity * 2 : 16;
+        block_chunk **index = realloc(block_chunk_index, sizeof(block_chunk *) * capacity);
+
+        if (index != NULL) {
+            block_chunk_index = index;
+            block_chunk_capacity = capacity;
+        }
+    }
+
+    if (chunk == NULL || block_chunk_count == block_chunk_capacity ||
+            posix_memalign((void **) &chunk->blocks, BLOCK_CHUNK_BYTES, BLOCK_CHUNK_BYTES)) {
+        fprintf(stderr, "Error: could not allocate block chunk\n");
+        free(chunk);
+        return -1;
+    }
+
+    /* keep the index sorted by address */
+    unsigned long i = block_chunk_count;
+
+    for (; i > 0 && block_chunk_index[i - 1]->blocks > chunk->blocks; i--)
+        block_chunk_index[i] = block_chunk_index[i - 1];
+    block_chunk_index[i] = chunk;
+
+    chunk->next = block_chunks;
+    block_chunks = chunk;
+    block_chunk_count++;
+    block_free_push(chunk, BLOCK_RUN_CLASSES - 1, chunk->blocks);
+    return 0;
+}
+
+/*
+ * Initializes the block pool.
+ */
+void block_pool_init() {
+    for (int c = 0; c < BLOCK_RUN_CLASSES; c++)
+        block_free_lists[c] = NULL;
+    block_chunks = NULL;
+    block_chunk_count = 0;
+    block_free_blocks = 0;
+}
+
+/*
+ * Releases every chunk, whether its runs are free or not.
+ */
+void block_pool_destroy() {
+    while (block_chunks != NULL) {
+        block_chunk *chunk = block_chunks;
+
+        block_chunks = chunk->next;
+        free(chunk->blocks);
+        free(chunk);
+    }
+    free(block_chunk_index);
+    block_chunk_index = NULL;
+    block_chunk_capacity = 0;
+    block_pool_init();
+}
+
+/*
+ * Takes a run of contiguous blocks from the pool, splitting a longer run
+ * if there is no free one of the right length.
+ * Input:
+ *  - blocks: length of the run, a power of two up to BLOCK_MAX_RUN
+ * Returns: the run, or NULL if memory is exhausted
+ */
+char *block_run_alloc(int blocks) {
+    int want = block_run_class(blocks), c;
+    char *run = NULL;
+
+    block_pool_lock();
+
+    for (c = want; c < BLOCK_RUN_CLASSES && block_free_lists[c] == NULL; c++)
+        ;
+
+    if (c < BLOCK_RUN_CLASSES || block_pool_grow() == 0) {
+        if (c == BLOCK_RUN_CLASSES)
+            c--;
+        run = (char *) block_free_lists[c];
+
+        block_chunk *chunk = block_chunk_of(run);
+
+        block_free_remove(chunk, c, run);
+
+        /* keep the first half, give back the second, until it fits */
+        while (c > want) {
+            c--;
+            block_free_push(chunk, c, run + ((size_t) BLOCK_SIZE << c));
+        }
+    }
+
+    block_pool_unlock();
+    return run;
+}
+
+/*
+ * Gives a run back to the pool, merging it with its buddy (the other half
+ * of the run it was split from) for as long as that is free too, so
+ * freed memory serves long runs again.
+ * Input:
+ *  - run: the run, as returned by block_run_alloc
+ *  - blocks: its length
+ */
+void block_run_free(char *run, int blocks) {
+    int c = block_run_class(blocks);
+
+    block_pool_lock();
+
+    block_chunk *chunk = block_chunk_of(run);
+
+    while (c < BLOCK_RUN_CLASSES - 1) {
+        int block = block_of(chunk, run);
+        int buddy = block ^ (1 << c);
+
+        if (chunk->free_class[buddy] != c + 1)
+            break;
+        block_free_remove(chunk, c, chunk->blocks + (size_t) buddy * BLOCK_SIZE);
+        run = chunk->blocks + (size_t) (block & buddy) * BLOCK_SIZE;
+        c++;
+    }
+    block_free_push(chunk, c, run);
+
+    block_pool_unlock();
+}
+
+/*
+ * Reads the pool's size.
+ * Input:
+ *  - chunks: set to the number of chunks taken from malloc
+ *  - free_blocks: set to the number of blocks in free runs
+ */
+void block_pool_stats(unsigned long *chunks, unsigned long *free_blocks) {
+    block_pool_lock();
+    *chunks = block_chunk_count;
+    *free_blocks = block_free_blocks;
+    block_pool_unlock();
+}
@@ -0,0 +1,23 @@
+#ifndef BLOCKS_H
+#define BLOCKS_H
+
+/*
+ * Block pool: file contents live in runs of contiguous fixed-size blocks
+ * (extents). Runs come in BLOCK_RUN_CLASSES power-of-two lengths, carved
+ * out of BLOCK_MAX_RUN-block chunks by halving (a buddy allocator). A
+ * freed run is merged with its buddy whenever that is free too, so whole
+ * chunks become free again, but memory taken from malloc is only given
+ * back by block_pool_destroy.
+ */
+
+#define BLOCK_SIZE 4096
+#define BLOCK_RUN_CLASSES 7
+#define BLOCK_MAX_RUN (1 << (BLOCK_RUN_CLASSES - 1))
+
+void block_pool_init();
+void block_pool_destroy();
+char *block_run_alloc(int blocks);
+void block_run_free(char *run, int blocks);
+void block_pool_stats(unsigned long *chunks, unsigned long *free_blocks);
+
+#endif /* BLOCKS_H */
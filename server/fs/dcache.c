@@ -0,0 +1,198 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "dcache.h"
+#include "state.h"
+
+/*
+ * A cached name: parent directory (and its sequence number), name and the
+ * inumber it resolves to. inumber is FAIL for a negative entry and parent
+ * is FREE_INODE for an unused one. seq is odd while the entry is being
+ * rewritten.
+ */
+typedef struct dentry {
+    unsigned int seq;
+    int parent;
+    unsigned int parent_seq;
+    unsigned int hash;
+    int inumber;
+    char name[DCACHE_NAME_LEN];
+} dentry;
+
+/*
+ * Hit and miss counters of one thread, on their own cache line
+ */
+typedef struct dcache_counters {
+    unsigned long hits;
+    unsigned long misses;
+} __attribute__((aligned(64))) dcache_counters;
+
+/* Direct-mapped table; each stripe lock serializes writers of every
+ * DCACHE_STRIPES-th slot */
+dentry dcache_table[DCACHE_SIZE];
+pthread_mutex_t dcache_locks[DCACHE_STRIPES];
+
+dcache_counters *dcache_thread_counters = NULL;
+int dcache_thread_count = 0;
+int dcache_max_threads = 0;
+
+static __thread dcache_counters *counters = NULL;
+
+static unsigned int dcache_slot(int parent, unsigned int hash) {
+    return (hash ^ ((unsigned int) parent * 2654435761u)) & (DCACHE_SIZE - 1);
+}
+
+static void dcache_lock(unsigned int slot) {
+    if (pthread_mutex_lock(&dcache_locks[slot % DCACHE_STRIPES])) {
+        fprintf(stderr, "Error: could not lock mutex: dcache\n");
+    }
+}
+
+static void dcache_unlock(unsigned int slot) {
+    if (pthread_mutex_unlock(&dcache_locks[slot % DCACHE_STRIPES])) {
+        fprintf(stderr, "Error: could not unlock mutex: dcache\n");
+    }
+}
+
+/*
+ * Returns the calling thread's counters, registering them on first use.
+ * Threads beyond the count given to dcache_init share the last slot.
+ */
+static dcache_counters *dcache_counters_self() {
+    if (counters == NULL) {
+        int index = __atomic_fetch_add(&dcache_thread_count, 1, __ATOMIC_RELAXED);
+
+        if (index >= dcache_max_threads)
+            index = dcache_max_threads - 1;
+        counters = &dcache_thread_counters[index];
+    }
+    return counters;
+}
+
+/*
+ * Initializes the dentry cache.
+ * Input:
+ *  - threads: number of threads that may ever look names up
+ */
+void dcache_init(int threads) {
+    if (posix_memalign((void **) &dcache_thread_counters, 64, sizeof(dcache_counters) * threads)) {
+        fprintf(stderr, "Error: could not allocate dcache counters\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(dcache_thread_counters, 0, sizeof(dcache_counters) * threads);
+    dcache_max_threads = threads;
+
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        dcache_table[i].seq = 0;
+        dcache_table[i].parent = FREE_INODE;
+    }
+
+    for (int i = 0; i < DCACHE_STRIPES; i++) {
+        if (pthread_mutex_init(&dcache_locks[i], NULL)) {
+            fprintf(stderr, "Error: could not initialize mutex: dcache\n");
+        }
+    }
+}
+
+/*
+ * Destroys the dentry cache.
+ */
+void dcache_destroy() {
+    for (int i = 0; i < DCACHE_STRIPES; i++) {
+        if (pthread_mutex_destroy(&dcache_locks[i])) {
+            fprintf(stderr, "Error: could not destroy mutex: dcache\n");
+        }
+    }
+    free(dcache_thread_counters);
+    dcache_thread_counters = NULL;
+    dcache_thread_count = 0;
+    dcache_max_threads = 0;
+}
+
+/*
+ * Looks for a name in the cache.
+ * Input:
+ *  - parent: inumber of the directory
+ *  - parent_seq: sequence number of the directory, from inode_seq_begin
+ *  - name: name of the entry
+ *  - hash: dir_hash of name
+ *  - inumber: where the cached result (inumber or FAIL) is stored
+ * Returns: 1 on a hit, 0 on a miss
+ */
+int dcache_lookup(int parent, unsigned int parent_seq, const char *name, unsigned int hash, int *inumber) {
+    dentry *entry = &dcache_table[dcache_slot(parent, hash)];
+    dcache_counters *mine = dcache_counters_self();
+    size_t len = strlen(name);
+    int hit = 0;
+
+    unsigned int seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+
+    if (!(seq & 1) && len < DCACHE_NAME_LEN &&
+            __atomic_load_n(&entry->parent, __ATOMIC_RELAXED) == parent &&
+            __atomic_load_n(&entry->parent_seq, __ATOMIC_RELAXED) == parent_seq &&
+            __atomic_load_n(&entry->hash, __ATOMIC_RELAXED) == hash &&
+            memcmp(entry->name, name, len + 1) == 0) {
+        int result = __atomic_load_n(&entry->inumber, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == seq) {
+            *inumber = result;
+            hit = 1;
+        }
+    }
+
+    if (hit)
+        mine->hits++;
+    else
+        mine->misses++;
+    return hit;
+}
+
+/*
+ * Caches the result of resolving a name, replacing whatever used the slot.
+ * Names too long for an entry are not cached.
+ * Input:
+ *  - parent: inumber of the directory
+ *  - parent_seq: sequence number the directory had when name was resolved
+ *  - name: name of the entry
+ *  - hash: dir_hash of name
+ *  - inumber: inumber the name resolves to, or FAIL if it does not exist
+ */
+void dcache_insert(int parent, unsigned int parent_seq, const char *name, unsigned int hash, int inumber) {
+    if (strlen(name) >= DCACHE_NAME_LEN)
+        return;
+
+    unsigned int slot = dcache_slot(parent, hash);
+    dentry *entry = &dcache_table[slot];
+
+    dcache_lock(slot);
+    __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    entry->parent = parent;
+    entry->parent_seq = parent_seq;
+    entry->hash = hash;
+    entry->inumber = inumber;
+    strcpy(entry->name, name);
+
+    __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELEASE);
+    dcache_unlock(slot);
+}
+
+/*
+ * Sums the hit and miss counters of every thread.
+ */
+void dcache_stats(unsigned long *hits, unsigned long *misses) {
+    int count = __atomic_load_n(&dcache_thread_count, __ATOMIC_RELAXED);
+
+    if (count > dcache_max_threads)
+        count = dcache_max_threads;
+
+    *hits = 0;
+    *misses = 0;
+    for (int i = 0; i < count; i++) {
+        *hits += __atomic_load_n(&dcache_thread_counters[i].hits, __ATOMIC_RELAXED);
+        *misses += __atomic_load_n(&dcache_thread_counters[i].misses, __ATOMIC_RELAXED);
+    }
+}
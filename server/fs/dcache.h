@@ -0,0 +1,24 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+/*
+ * Dentry cache: remembers which inumber a name resolves to inside a given
+ * directory (or that it does not exist), so path resolution can skip the
+ * directory tables. Each entry records the directory's sequence number
+ * when it was filled and only hits while that number is unchanged, so any
+ * change to the directory (create, delete, either side of a move)
+ * invalidates its entries. Lookups take no locks and write no shared
+ * memory.
+ */
+
+#define DCACHE_SIZE 4096
+#define DCACHE_STRIPES 64
+#define DCACHE_NAME_LEN 48
+
+void dcache_init(int threads);
+void dcache_destroy();
+int dcache_lookup(int parent, unsigned int parent_seq, const char *name, unsigned int hash, int *inumber);
+void dcache_insert(int parent, unsigned int parent_seq, const char *name, unsigned int hash, int inumber);
+void dcache_stats(unsigned long *hits, unsigned long *misses);
+
+#endif /* DCACHE_H */
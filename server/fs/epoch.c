@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "epoch.h"
+
+/*
+ * Memory waiting to be released, retired while the global epoch was
+ * `epoch`
+ */
+typedef struct limbo {
+    unsigned long epoch;
+    int count, size;
+    void **ptrs;
+    void (**releases)(void *);
+} limbo;
+
+/*
+ * Per-thread state. `announce` is 0 outside a read section, and
+ * (epoch << 1) | 1 inside one. Padded to its own cache line.
+ */
+typedef struct epoch_record {
+    unsigned long announce;
+    int retired;
+    limbo bags[3];
+} __attribute__((aligned(64))) epoch_record;
+
+unsigned long global_epoch = 0;
+epoch_record *epoch_records = NULL;
+int epoch_record_count = 0;
+int epoch_max_threads = 0;
+
+static __thread epoch_record *self = NULL;
+
+/*
+ * Returns the calling thread's record, registering it on first use.
+ */
+static epoch_record *epoch_self() {
+    if (self == NULL) {
+        int index = __atomic_fetch_add(&epoch_record_count, 1, __ATOMIC_ACQ_REL);
+
+        if (index >= epoch_max_threads) {
+            fprintf(stderr, "Error: too many threads for epoch reclamation\n");
+            exit(EXIT_FAILURE);
+        }
+        self = &epoch_records[index];
+    }
+    return self;
+}
+
+/*
+ * Releases everything in a bag.
+ */
+static void limbo_release(limbo *bag) {
+    for (int i = 0; i < bag->count; i++) {
+        bag->releases[i](bag->ptrs[i]);
+    }
+    bag->count = 0;
+}
+
+/*
+ * Releases the calling thread's bags retired at least two epochs ago.
+ */
+static void epoch_collect(epoch_record *record, unsigned long epoch) {
+    for (int i = 0; i < 3; i++) {
+        limbo *bag = &record->bags[i];
+
+        if (bag->count > 0 && bag->epoch + 2 <= epoch)
+            limbo_release(bag);
+    }
+}
+
+/*
+ * Advances the global epoch if every thread inside a read section has
+ * already observed the current one.
+ */
+static void epoch_try_advance() {
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    int count = __atomic_load_n(&epoch_record_count, __ATOMIC_ACQUIRE);
+
+    if (count > epoch_max_threads)
+        count = epoch_max_threads;
+
+    for (int i = 0; i < count; i++) {
+        unsigned long announce = __atomic_load_n(&epoch_records[i].announce, __ATOMIC_SEQ_CST);
+
+        if ((announce & 1) && (announce >> 1) != epoch)
+            return;
+    }
+
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0,
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Allocates one record per thread that may use the read path.
+ * Input:
+ *  - threads: number of threads that may ever register
+ */
+void epoch_init(int threads) {
+    if (posix_memalign((void **) &epoch_records, 64, sizeof(epoch_record) * threads)) {
+        fprintf(stderr, "Error: could not allocate epoch records\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(epoch_records, 0, sizeof(epoch_record) * threads);
+    epoch_max_threads = threads;
+}
+
+/*
+ * Starts a read section.
+ */
+void epoch_enter() {
+    epoch_record *record = epoch_self();
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+    /* announce, then make sure the epoch did not move before we were seen */
+    for (;;) {
+        __atomic_store_n(&record->announce, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+
+        unsigned long current = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+        if (current == epoch)
+            break;
+        epoch = current;
+    }
+}
+
+/*
+ * Ends a read section.
+ */
+void epoch_exit() {
+    __atomic_store_n(&epoch_self()->announce, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Defers releasing memory until no reader can reach it.
+ * Input:
+ *  - ptr: memory already unlinked from every shared structure
+ *  - release: function that frees it
+ */
+void epoch_retire(void *ptr, void (*release)(void *)) {
+    epoch_record *record = epoch_self();
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    limbo *bag = &record->bags[epoch % 3];
+
+    /* the bag last held memory from three epochs ago, which is now safe */
+    if (bag->epoch != epoch) {
+        limbo_release(bag);
+        bag->epoch = epoch;
+    }
+
+    if (bag->count == bag->size) {
+        bag->size = bag->size ? bag->size * 2 : EPOCH_RETIRE_BATCH;
+        bag->ptrs = realloc(bag->ptrs, sizeof(void *) * bag->size);
+        bag->releases = realloc(bag->releases, sizeof(void (*)(void *)) * bag->size);
+    }
+    bag->ptrs[bag->count] = ptr;
+    bag->releases[bag->count] = release;
+    bag->count++;
+
+    if (++record->retired % EPOCH_RETIRE_BATCH == 0) {
+        epoch_try_advance();
+        epoch_collect(record, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST));
+    }
+}
+
+/*
+ * Releases all retired memory. Only safe once no thread is reading.
+ */
+void epoch_destroy() {
+    int count = epoch_record_count < epoch_max_threads ? epoch_record_count : epoch_max_threads;
+
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < 3; j++) {
+            limbo *bag = &epoch_records[i].bags[j];
+
+            limbo_release(bag);
+            free(bag->ptrs);
+            free(bag->releases);
+            bag->ptrs = NULL;
+            bag->releases = NULL;
+            bag->size = 0;
+        }
+    }
+    free(epoch_records);
+    epoch_records = NULL;
+    epoch_record_count = 0;
+    epoch_max_threads = 0;
+}
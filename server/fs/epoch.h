@@ -0,0 +1,20 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based memory reclamation for the lock-free read path.
+ * Readers that dereference shared data without holding i-node locks do so
+ * between epoch_enter and epoch_exit; writers hand memory that such readers
+ * may still reach to epoch_retire instead of freeing it, and it is released
+ * once every reader that could have seen it has left its epoch.
+ */
+
+#define EPOCH_RETIRE_BATCH 64
+
+void epoch_init(int threads);
+void epoch_enter();
+void epoch_exit();
+void epoch_retire(void *ptr, void (*release)(void *));
+void epoch_destroy();
+
+#endif /* EPOCH_H */
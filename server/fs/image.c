@@ -0,0 +1,485 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "state.h"
+#include "blocks.h"
+#include "slab.h"
+
+/* The image the table was loaded from, mapped until image_unload */
+char *image_map = NULL;
+size_t image_size = 0;
+
+/* Checks that size bytes at offset lie within an image of image_bytes */
+#define IMAGE_RANGE(offset, size, image_bytes) \
+    ((offset) <= (image_bytes) && (size) <= (image_bytes) - (offset))
+
+/*
+ * Output of a flush: a file written front to back, its offset tracked
+ */
+typedef struct image_writer {
+    FILE *fp;
+    uint64_t offset;
+    int failed;
+} image_writer;
+
+static void image_write(image_writer *w, const void *bytes, size_t size) {
+    if (size > 0 && fwrite(bytes, 1, size, w->fp) != size)
+        w->failed = 1;
+    w->offset += size;
+}
+
+/*
+ * Writes zeros up to the next multiple of align (at most BLOCK_SIZE).
+ */
+static void image_pad(image_writer *w, uint64_t align) {
+    static const char zeros[BLOCK_SIZE];
+
+    image_write(w, zeros, (align - w->offset % align) % align);
+}
+
+/*
+ * Checks if memory lies in the loaded image, and so must not be freed.
+ */
+int image_contains(const void *ptr) {
+    return image_map != NULL && (const char *) ptr >= image_map &&
+        (const char *) ptr < image_map + image_size;
+}
+
+/*
+ * Writes the contents of a directory and fills in its record.
+ */
+static void image_write_dir(image_writer *w, DirTable *dir, image_inode *record) {
+    DirNames names = { dir->names->size, dir->names->size, dir->names->dead };
+
+    record->count = dir->count;
+    record->used = dir->used;
+
+    image_pad(w, IMAGE_ALIGN);
+    record->data = w->offset;
+    image_write(w, dir->slots, sizeof(DirSlots) + sizeof(DirEntry) * dir->slots->capacity);
+
+    /* the arena's free room is not kept: the first new name rebuilds it */
+    image_pad(w, IMAGE_ALIGN);
+    record->names = w->offset;
+    image_write(w, &names, sizeof(DirNames));
+    image_write(w, dir->names->bytes, names.size);
+}
+
+/*
+ * Writes the contents of a file and fills in its record. Every extent is
+ * written whole, so the file can grow into it once mapped.
+ */
+static void image_write_file(image_writer *w, FileData *file, image_inode *record) {
+    record->count = file->count;
+    record->size = file->size;
+
+    image_pad(w, IMAGE_ALIGN);
+    record->data = w->offset;
+
+    uint64_t block = w->offset + sizeof(image_extent) * file->count;
+    block += (BLOCK_SIZE - block % BLOCK_SIZE) % BLOCK_SIZE;
+
+    for (int i = 0; i < file->count; i++) {
+        image_extent extent = { file->extents[i].start, file->extents[i].blocks, block };
+
+        image_write(w, &extent, sizeof(extent));
+        block += (uint64_t) file->extents[i].blocks * BLOCK_SIZE;
+    }
+
+    for (int i = 0; i < file->count; i++) {
+        image_pad(w, BLOCK_SIZE);
+        image_write(w, file->extents[i].data, (size_t) file->extents[i].blocks * BLOCK_SIZE);
+    }
+}
+
+/*
+ * Writes the whole file system to an image, clean, replacing the one at
+ * path only once the new one is on disk. Only safe while no command runs.
+ * Input:
+ *  - path: the image
+ *  - lsn: last log record whose change the image includes
+ * Returns: SUCCESS or FAIL
+ */
+int image_flush(char *path, uint64_t lsn) {
+    char tmp[PATH_MAX];
+    int count = inode_table_capacity();
+    type nType;
+    union Data data;
+
+    /* records past the last i-node in use would all be empty */
+    for (nType = T_NONE; count > 0; count--) {
+        inode_peek(count - 1, &nType, &data);
+        if (nType != T_NONE)
+            break;
+    }
+
+    image_inode *records = calloc(count, sizeof(image_inode));
+    FILE *fp;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp) ||
+            records == NULL || (fp = fopen(tmp, "w")) == NULL) {
+        fprintf(stderr, "Error: could not create image: %s\n", path);
+        free(records);
+        return FAIL;
+    }
+
+    image_writer w = { fp, sizeof(image_header) + sizeof(image_inode) * count, 0 };
+
+    if (fseek(fp, w.offset, SEEK_SET))
+        w.failed = 1;
+
+    uint64_t version = inode_version_max();
+
+    for (int inumber = 0; inumber < count && !w.failed; inumber++) {
+        inode_peek(inumber, &nType, &data);
+        records[inumber].type = nType;
+
+        if (nType == T_NONE)
+            continue;
+
+        InodeStat st;
+
+        inode_stat(inumber, &st);
+        records[inumber].nlink = st.nlink;
+        records[inumber].version = st.version;
+        records[inumber].ctime = st.ctime;
+        records[inumber].mtime = st.mtime;
+
+        if (nType == T_DIRECTORY)
+            image_write_dir(&w, data.dir, &records[inumber]);
+        else if (nType == T_FILE)
+            image_write_file(&w, data.file, &records[inumber]);
+    }
+
+    image_header header = { IMAGE_MAGIC, IMAGE_VERSION, 1, count, w.offset, BLOCK_SIZE, lsn,
+        version };
+
+    rewind(fp);
+    image_write(&w, &header, sizeof(header));
+    image_write(&w, records, sizeof(image_inode) * count);
+    free(records);
+
+    if (fflush(fp) || fsync(fileno(fp)))
+        w.failed = 1;
+    if (fclose(fp) || w.failed || rename(tmp, path)) {
+        fprintf(stderr, "Error: could not write image: %s\n", path);
+        unlink(tmp);
+        return FAIL;
+    }
+
+    printf("Image: flushed %s, %d i-nodes, %lu bytes\n", path, count,
+            (unsigned long) header.size);
+    return SUCCESS;
+}
+
+/*
+ * Reports an inconsistency found by image_check.
+ * Returns: FAIL
+ */
+static int image_invalid(int inumber, const char *problem) {
+    fprintf(stderr, "Error: image check: i-node %d: %s\n", inumber, problem);
+    return FAIL;
+}
+
+/*
+ * Checks a directory's record: its slots and arena lie within the image,
+ * every name lies within the arena and matches its hash, every entry
+ * names an i-node in use, and the counts match.
+ * Input:
+ *  - refs: incremented for every entry's inumber
+ */
+static int image_check_dir(char *map, size_t size, image_inode *records, int count,
+        int inumber, int refs[]) {
+    image_inode *record = &records[inumber];
+
+    if (record->data % IMAGE_ALIGN || !IMAGE_RANGE(record->data, sizeof(DirSlots), size))
+        return image_invalid(inumber, "slots out of bounds");
+
+    DirSlots *slots = (DirSlots *) (map + record->data);
+    int capacity = slots->capacity;
+
+    if (capacity < 1 || (capacity & (capacity - 1)) ||
+            !IMAGE_RANGE(record->data, sizeof(DirSlots) + sizeof(DirEntry) * (size_t) capacity, size))
+        return image_invalid(inumber, "bad slot array");
+
+    if (record->names % IMAGE_ALIGN || !IMAGE_RANGE(record->names, sizeof(DirNames), size))
+        return image_invalid(inumber, "names out of bounds");
+
+    DirNames *names = (DirNames *) (map + record->names);
+
+    if (names->size < 0 || names->capacity != names->size || names->dead < 0 ||
+            names->dead > names->size ||
+            !IMAGE_RANGE(record->names, sizeof(DirNames) + (size_t) names->size, size))
+        return image_invalid(inumber, "bad name arena");
+
+    int live = 0, used = 0;
+
+    for (int i = 0; i < capacity; i++) {
+        DirEntry *entry = &slots->entries[i];
+        char name[DIR_MAX_NAME + 1];
+
+        if (entry->inumber == FREE_INODE)
+            continue;
+        used++;
+        if (entry->inumber == DELETED_ENTRY)
+            continue;
+        live++;
+
+        if (entry->inumber <= FS_ROOT || entry->inumber >= count ||
+                records[entry->inumber].type == T_NONE)
+            return image_invalid(inumber, "entry for an i-node not in use");
+        if (entry->name < 0 || entry->name >= names->size)
+            return image_invalid(inumber, "entry name out of bounds");
+
+        int len = (unsigned char) names->bytes[entry->name];
+
+        if (len == 0 || entry->name + 1 + len > names->size)
+            return image_invalid(inumber, "bad entry name");
+        memcpy(name, names->bytes + entry->name + 1, len);
+        name[len] = '\0';
+        if (strlen(name) != len || dir_hash(name) != entry->hash)
+            return image_invalid(inumber, "entry name does not match its hash");
+
+        refs[entry->inumber]++;
+    }
+
+    if (live != record->count || used != record->used)
+        return image_invalid(inumber, "entry counts do not match");
+    return SUCCESS;
+}
+
+/*
+ * Checks a file's record: its extents lie within the image, at block
+ * boundaries, and follow one another from the start of the file.
+ */
+static int image_check_file(char *map, size_t size, image_inode *record, int inumber) {
+    if (record->count < 0 || record->data % IMAGE_ALIGN ||
+            !IMAGE_RANGE(record->data, sizeof(image_extent) * (size_t) record->count, size))
+        return image_invalid(inumber, "extents out of bounds");
+
+    image_extent *extents = (image_extent *) (map + record->data);
+    uint64_t start = 0;
+
+    for (int i = 0; i < record->count; i++) {
+        if (extents[i].start != start || extents[i].blocks < 1 ||
+                extents[i].blocks > BLOCK_MAX_RUN || extents[i].data % BLOCK_SIZE ||
+                !IMAGE_RANGE(extents[i].data, extents[i].blocks * BLOCK_SIZE, size))
+            return image_invalid(inumber, "bad extent");
+        start += extents[i].blocks * BLOCK_SIZE;
+    }
+
+    if (record->size > start || record->size > FILE_MAX_SIZE)
+        return image_invalid(inumber, "size past its extents");
+    return SUCCESS;
+}
+
+/*
+ * Checks a whole image: every record, and then the tree, whose i-nodes
+ * must each be reachable from the root through exactly one entry.
+ * Returns: SUCCESS or FAIL
+ */
+static int image_check(char *map, size_t size) {
+    image_header *header = (image_header *) map;
+    image_inode *records = (image_inode *) (map + sizeof(image_header));
+    int count = header->inode_count;
+    int result = SUCCESS;
+
+    if (count < 1 || records[FS_ROOT].type != T_DIRECTORY)
+        return image_invalid(FS_ROOT, "root is not a directory");
+
+    int *refs = calloc(count, sizeof(int));
+    int *queue = malloc(sizeof(int) * count);
+
+    if (refs == NULL || queue == NULL) {
+        fprintf(stderr, "Error: could not allocate image check\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < count && result == SUCCESS; i++) {
+        switch (records[i].type) {
+            case T_NONE:
+                break;
+            case T_DIRECTORY:
+                result = image_check_dir(map, size, records, count, i, refs);
+                break;
+            case T_FILE:
+                result = image_check_file(map, size, &records[i], i);
+                break;
+            default:
+                result = image_invalid(i, "bad type");
+        }
+    }
+
+    for (int i = FS_ROOT + 1; i < count && result == SUCCESS; i++) {
+        if (records[i].type != T_NONE && refs[i] != 1)
+            result = image_invalid(i, refs[i] ? "in more than one directory" : "in no directory");
+    }
+
+    /* with one entry each, an i-node not reachable from the root is in a
+     * cycle of directories detached from the tree */
+    int head = 0, tail = 0, reached = 0;
+
+    queue[tail++] = FS_ROOT;
+    while (result == SUCCESS && head < tail) {
+        image_inode *record = &records[queue[head++]];
+
+        reached++;
+        if (record->type != T_DIRECTORY)
+            continue;
+
+        DirSlots *slots = (DirSlots *) (map + record->data);
+
+        for (int i = 0; i < slots->capacity; i++) {
+            if (slots->entries[i].inumber >= 0 && tail < count)
+                queue[tail++] = slots->entries[i].inumber;
+        }
+    }
+
+    for (int i = 0; i < count && result == SUCCESS; i++) {
+        if (records[i].type != T_NONE)
+            reached--;
+    }
+    if (result == SUCCESS && reached != 0)
+        result = image_invalid(FS_ROOT, "i-nodes not reachable from the root");
+
+    free(refs);
+    free(queue);
+    return result;
+}
+
+/*
+ * Installs the i-node of a record, pointing into the mapped image.
+ */
+static int image_restore(char *map, image_inode *record, int inumber) {
+    union Data data;
+
+    if (record->type == T_DIRECTORY) {
+        data.dir = slab_alloc(sizeof(DirTable));
+        data.dir->count = record->count;
+        data.dir->used = record->used;
+        data.dir->slots = (DirSlots *) (map + record->data);
+        data.dir->names = (DirNames *) (map + record->names);
+    }
+    else if (record->type == T_FILE) {
+        image_extent *extents = (image_extent *) (map + record->data);
+
+        data.file = slab_alloc(sizeof(FileData));
+        data.file->size = record->size;
+        data.file->count = record->count;
+        data.file->capacity = record->count;
+        data.file->extents = record->count ? slab_alloc(sizeof(Extent) * record->count) : NULL;
+
+        for (int i = 0; i < record->count; i++)
+            data.file->extents[i] = (Extent) { extents[i].start, extents[i].blocks,
+                map + extents[i].data };
+    }
+    else
+        return FAIL;
+
+    return inode_restore(inumber, record->type, data);
+}
+
+/*
+ * Maps an image and installs its i-nodes into an empty table. A dirty
+ * image is checked first; an invalid one stops the server rather than be
+ * overwritten by the next flush.
+ * Input:
+ *  - path: the image
+ *  - lsn: set to the last log record the image includes
+ * Returns: SUCCESS, or FAIL if there is no image at path
+ */
+int image_load(char *path, uint64_t *lsn) {
+    int fd = open(path, O_RDWR);
+    struct stat st;
+
+    if (fd < 0 && errno == ENOENT)
+        return FAIL;
+
+    if (fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "Error: could not open image: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (st.st_size < sizeof(image_header)) {
+        fprintf(stderr, "Error: not a valid image: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    image_header header;
+
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map image: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&header, map, sizeof(header));
+
+    if (header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION ||
+            header.size != st.st_size || header.block_size != BLOCK_SIZE ||
+            !IMAGE_RANGE(sizeof(image_header), sizeof(image_inode) * (uint64_t) header.inode_count,
+                header.size)) {
+        fprintf(stderr, "Error: not a valid image: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!header.clean) {
+        printf("Image: %s was not shut down cleanly, checking it\n", path);
+        if (image_check(map, st.st_size) == FAIL) {
+            fprintf(stderr, "Error: image is inconsistent: %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* dirty from now on, until the next flush replaces it */
+    header.clean = 0;
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fsync(fd)) {
+        fprintf(stderr, "Error: could not mark image in use: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    image_map = map;
+    image_size = st.st_size;
+
+    image_inode *records = (image_inode *) (map + sizeof(image_header));
+
+    for (int inumber = 0; inumber < header.inode_count; inumber++) {
+        image_inode *record = &records[inumber];
+
+        if (record->type == T_NONE)
+            continue;
+        if (image_restore(map, record, inumber) == FAIL) {
+            fprintf(stderr, "Error: could not restore i-node %d from image\n", inumber);
+            exit(EXIT_FAILURE);
+        }
+
+        InodeStat st = { record->type, record->nlink, 0, record->version, record->ctime,
+            record->mtime };
+
+        inode_restore_meta(inumber, &st);
+    }
+    inode_version_floor(header.inode_version);
+    inode_free_rebuild();
+    *lsn = header.lsn;
+
+    printf("Image: loaded %s, %u i-nodes\n", path, header.inode_count);
+    return SUCCESS;
+}
+
+/*
+ * Unmaps the loaded image, once nothing points into it.
+ */
+void image_unload() {
+    if (image_map != NULL && munmap(image_map, image_size)) {
+        fprintf(stderr, "Error: could not unmap image\n");
+    }
+    image_map = NULL;
+    image_size = 0;
+}
@@ -0,0 +1,74 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+/*
+ * Persistent image of the file system, written whole by image_flush and
+ * mapped (MAP_PRIVATE) by image_load, so nothing is read or copied when
+ * the server starts: slot arrays and name arenas are laid out exactly as
+ * in memory and directory tables point straight into the mapping, as do
+ * the extents of files, whose bytes sit at block-aligned offsets. A
+ * change to mapped data lands on private copy-on-write pages and the file
+ * itself only changes at the next flush, which writes a new image and
+ * renames it over the old one.
+ *
+ * Layout:
+ *  - header (image_header)
+ *  - one record per inumber (image_inode)
+ *  - for each directory: its DirSlots, then its DirNames
+ *  - for each file: its extents (image_extent), then their blocks
+ *
+ * The header's clean flag is cleared on disk as soon as an image is
+ * loaded and only set again in the image a flush writes, so a server that
+ * did not shut down cleanly leaves a dirty image, which is checked from
+ * top to bottom before it is used again. The changes made since the last
+ * flush are in the write-ahead log, from the header's LSN on.
+ *
+ * Loading still makes one pass over the i-node records, since the i-node
+ * table (with a lock per slot) lives outside the mapping and is built at
+ * startup, and the free stack is rebuilt from it. That pass is cheap next
+ * to reading the directory and file contents, which it does not touch,
+ * but startup is linear in the table's size rather than constant.
+ */
+
+#include <stdint.h>
+
+#define IMAGE_MAGIC 0x31534654 /* "TFS1" */
+#define IMAGE_VERSION 4 /* 4: i-node metadata (see inode_stat) */
+#define IMAGE_ALIGN 8
+
+typedef struct image_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t clean; /* 1 if written by a flush and not loaded since */
+    uint32_t inode_count; /* records */
+    uint64_t size; /* bytes in the image */
+    uint64_t block_size; /* BLOCK_SIZE when written */
+    uint64_t lsn; /* last log record included (see wal.h) */
+    uint64_t inode_version; /* highest i-node version, free slots included */
+} image_header;
+
+typedef struct image_inode {
+    int32_t type; /* T_NONE, T_FILE or T_DIRECTORY */
+    int32_t count; /* directories: entries in use; files: extents */
+    int32_t used; /* directories: entries in use or deleted */
+    int32_t nlink;
+    uint64_t size; /* files: size in bytes */
+    uint64_t data; /* offset of the DirSlots or of the image_extents */
+    uint64_t names; /* offset of the DirNames */
+    uint64_t version;
+    int64_t ctime;
+    int64_t mtime;
+} image_inode;
+
+typedef struct image_extent {
+    int64_t start;
+    int64_t blocks;
+    uint64_t data; /* offset of the first block */
+} image_extent;
+
+int image_load(char *path, uint64_t *lsn);
+int image_flush(char *path, uint64_t lsn);
+void image_unload();
+int image_contains(const void *ptr);
+
+#endif /* IMAGE_H */
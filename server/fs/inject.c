@@ -0,0 +1,155 @@
+#include "inject.h"
+
+#ifdef TECNICOFS_INJECT
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+typedef enum inject_dist { DIST_NONE, DIST_FIXED, DIST_UNIFORM, DIST_EXP } inject_dist;
+
+/*
+ * Injection settings of one site
+ */
+typedef struct inject_spec {
+    inject_dist dist;
+    double a, b; /* fixed: a; uniform: [a, b]; exp: mean a */
+    double fail; /* failure probability */
+} inject_spec;
+
+static const char *inject_names[INJECT_SITES] = {
+    "inode_create",
+    "inode_delete",
+    "inode_get",
+    "dir_reset_entry",
+    "dir_add_entry"
+};
+
+inject_spec inject_specs[INJECT_SITES];
+
+/* Per-thread xorshift state, seeded lazily from its own address */
+static __thread unsigned long long inject_seed = 0;
+
+/*
+ * Returns a uniformly distributed double in [0, 1).
+ */
+static double inject_random() {
+    if (inject_seed == 0)
+        inject_seed = (unsigned long long) (size_t) &inject_seed | 1;
+
+    inject_seed ^= inject_seed << 13;
+    inject_seed ^= inject_seed >> 7;
+    inject_seed ^= inject_seed << 17;
+    return (inject_seed >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Parses one "site=spec" item into inject_specs.
+ * Returns: 0 on success, -1 if the item is invalid
+ */
+static int inject_parse(char *item) {
+    char *value = strchr(item, '=');
+    if (value == NULL)
+        return -1;
+    *value++ = '\0';
+
+    int site;
+    for (site = 0; site < INJECT_SITES; site++) {
+        if (strcmp(item, inject_names[site]) == 0)
+            break;
+    }
+    if (site == INJECT_SITES)
+        return -1;
+
+    inject_spec spec = { DIST_NONE, 0, 0, 0 };
+
+    char *fail = strchr(value, '@');
+    if (fail != NULL) {
+        *fail++ = '\0';
+        spec.fail = atof(fail);
+    }
+
+    if (strncmp(value, "fixed:", 6) == 0) {
+        spec.dist = DIST_FIXED;
+        spec.a = atof(value + 6);
+    }
+    else if (strncmp(value, "uniform:", 8) == 0) {
+        spec.dist = DIST_UNIFORM;
+        if (sscanf(value + 8, "%lf:%lf", &spec.a, &spec.b) != 2 || spec.b < spec.a)
+            return -1;
+    }
+    else if (strncmp(value, "exp:", 4) == 0) {
+        spec.dist = DIST_EXP;
+        spec.a = atof(value + 4);
+    }
+    else if (strcmp(value, "none") != 0) {
+        return -1;
+    }
+
+    inject_specs[site] = spec;
+    return 0;
+}
+
+/*
+ * Loads the injection settings from the environment.
+ */
+void inject_init() {
+    for (int i = 0; i < INJECT_SITES; i++) {
+        inject_specs[i].dist = DIST_FIXED;
+        inject_specs[i].a = INJECT_DEFAULT_CYCLES;
+        inject_specs[i].fail = 0;
+    }
+
+    char *env = getenv("TECNICOFS_INJECT");
+    if (env == NULL)
+        return;
+
+    char *config = strdup(env);
+    char *saveptr;
+
+    for (char *item = strtok_r(config, ",", &saveptr); item != NULL;
+            item = strtok_r(NULL, ",", &saveptr)) {
+        if (inject_parse(item) == -1) {
+            fprintf(stderr, "Error: invalid injection setting: %s\n", item);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(config);
+}
+
+/*
+ * Busy-waits for a number of cycles drawn from the site's distribution.
+ */
+void inject_delay(inject_site site) {
+    inject_spec *spec = &inject_specs[site];
+    long cycles;
+
+    switch (spec->dist) {
+        case DIST_FIXED:
+            cycles = spec->a;
+            break;
+        case DIST_UNIFORM:
+            cycles = spec->a + (spec->b - spec->a) * inject_random();
+            break;
+        case DIST_EXP:
+            cycles = -spec->a * log(1.0 - inject_random());
+            break;
+        default:
+            return;
+    }
+
+    for (volatile long i = 0; i < cycles; i++) {}
+}
+
+/*
+ * Decides whether the operation at this site should fail.
+ * Returns: 1 to fail, 0 otherwise
+ */
+int inject_fault(inject_site site) {
+    double fail = inject_specs[site].fail;
+
+    return fail > 0 && inject_random() < fail;
+}
+
+#endif /* TECNICOFS_INJECT */
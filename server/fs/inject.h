@@ -0,0 +1,49 @@
+#ifndef INJECT_H
+#define INJECT_H
+
+/*
+ * Fault and latency injection, for synchronization testing.
+ * Compiled out unless TECNICOFS_INJECT is defined (make INJECT=1), in which
+ * case each site can be given a delay distribution and, where the caller
+ * copes with failure, a failure probability through the TECNICOFS_INJECT
+ * environment variable:
+ *
+ *   TECNICOFS_INJECT="site=spec,site=spec,..."
+ *   spec: fixed:N | uniform:MIN:MAX | exp:MEAN | none, optionally
+ *         followed by @P to fail with probability P (0..1)
+ *
+ * Delays are busy-wait loop iterations. Sites without a spec default to
+ * fixed:INJECT_DEFAULT_CYCLES, matching the former insert_delay(DELAY).
+ * Example: TECNICOFS_INJECT="inode_get=exp:2000,inode_create=fixed:0@0.01"
+ */
+
+#define INJECT_DEFAULT_CYCLES 5000
+
+typedef enum inject_site {
+    INJECT_INODE_CREATE,
+    INJECT_INODE_DELETE,
+    INJECT_INODE_GET,
+    INJECT_DIR_RESET_ENTRY,
+    INJECT_DIR_ADD_ENTRY,
+    INJECT_SITES
+} inject_site;
+
+#ifdef TECNICOFS_INJECT
+
+void inject_init();
+void inject_delay(inject_site site);
+int inject_fault(inject_site site);
+
+#define INJECT_INIT() inject_init()
+#define INJECT_DELAY(site) inject_delay(site)
+#define INJECT_FAULT(site) inject_fault(site)
+
+#else
+
+#define INJECT_INIT() ((void) 0)
+#define INJECT_DELAY(site) ((void) 0)
+#define INJECT_FAULT(site) 0
+
+#endif /* TECNICOFS_INJECT */
+
+#endif /* INJECT_H */
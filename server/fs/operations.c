@@ -1,8 +1,16 @@
 #include "operations.h"
+#include "blocks.h"
+#include "slab.h"
+#include "image.h"
+#include "wal.h"
+#include "walk.h"
+#include "dcache.h"
+#include "epoch.h"
+#include "inject.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <unistd.h>
+#include <limits.h>
 
 void initialize_vector(int vector[], int limit) {
 	for (int i = limit - 1; i >= 0; i--) {
@@ -57,46 +65,107 @@ void split_parent_child_from_path(char * path, char ** parent, char ** child) {
 }
 
 
+/* Image the file system is loaded from and flushed to, if any */
+static char *image_path = NULL;
+/* Its write-ahead log, "<image>.wal" */
+static char wal_path[PATH_MAX];
+
 /*
- * Initializes tecnicofs and creates root node.
+ * Initializes tecnicofs, from its image if there is one, and otherwise
+ * creates root node. With an image, the changes logged since it was
+ * flushed are replayed and logging starts.
+ * Input:
+ *  - image: path of the image, or NULL to keep nothing
+ *  - window: commit window of the log, in microseconds
+ *  - threads: number of worker threads that will serve requests
  */
-void init_fs() {
+void init_fs(char *image, long window, int threads) {
+	uint64_t lsn = 0;
+
+	INJECT_INIT();
 	inode_table_init();
+	epoch_init(threads + FS_FIXED_THREADS);
+	dcache_init(threads + FS_FIXED_THREADS);
+	walk_init();
+
+	image_path = image;
+	if (image == NULL || image_load(image, &lsn) == FAIL) {
+		/* create root inode */
+		int root = inode_create(T_DIRECTORY);
+
+		if (root != FS_ROOT) {
+			printf("failed to create node for tecnicofs root\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	/* create root inode */
-	int root = inode_create(T_DIRECTORY);
+	if (image == NULL)
+		return;
 
-	if (root != FS_ROOT) {
-		printf("failed to create node for tecnicofs root\n");
+	if (snprintf(wal_path, sizeof(wal_path), "%s.wal", image) >= sizeof(wal_path)) {
+		fprintf(stderr, "Error: image path too long: %s\n", image);
 		exit(EXIT_FAILURE);
 	}
+	lsn = wal_replay(wal_path, lsn);
+	wal_open(wal_path, lsn, window);
 }
 
 
 /*
- * Destroy tecnicofs and inode table.
+ * Flushes tecnicofs to its image, if it has one, and destroys it and the
+ * inode table. Only safe once no command runs.
  */
 void destroy_fs() {
+	if (image_path != NULL) {
+		uint64_t lsn = wal_stop();
+
+		/* the log is only emptied once the image holds all of it */
+		wal_close(image_flush(image_path, lsn) == SUCCESS);
+	}
+
+	dcache_destroy();
+	epoch_destroy();
 	inode_table_destroy();
+	image_unload();
+}
+
+
+/*
+ * Returns: nonzero if tecnicofs has an image and its log has grown past
+ * WAL_CHECKPOINT_SIZE, so checkpoint_fs has work to do
+ */
+int checkpoint_due() {
+	return image_path != NULL && wal_checkpoint_due();
+}
+
+
+/*
+ * Flushes tecnicofs to its image and empties the log, if a checkpoint is
+ * due. Only safe while no command runs.
+ */
+void checkpoint_fs() {
+	if (!checkpoint_due())
+		return;
+
+	uint64_t lsn = wal_drain();
+
+	/* the log is only emptied once the image holds all of it */
+	if (image_flush(image_path, lsn) == SUCCESS)
+		wal_truncate();
 }
 
 
 /*
  * Checks if content of directory is not empty.
  * Input:
- *  - entries: entries of directory
+ *  - dir: entries of directory
  * Returns: SUCCESS or FAIL
  */
 
-int is_dir_empty(DirEntry *dirEntries) {
-	if (dirEntries == NULL) {
+int is_dir_empty(DirTable *dir) {
+	if (dir == NULL || dir->count != 0) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (dirEntries[i].inumber != FREE_INODE) {
-			return FAIL;
-		}
-	}
 	return SUCCESS;
 }
 
@@ -105,21 +174,144 @@ int is_dir_empty(DirEntry *dirEntries) {
  * Looks for node in directory entry from name.
  * Input:
  *  - name: path of node
- *  - entries: entries of directory
+ *  - dir: entries of directory
  * Returns:
  *  - inumber: found node's inumber
  *  - FAIL: if not found
  */
-int lookup_sub_node(char *name, DirEntry *entries) {
-	if (entries == NULL) {
+int lookup_sub_node(char *name, DirTable *dir) {
+	if (dir == NULL) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (entries[i].inumber != FREE_INODE && strcmp(entries[i].name, name) == 0) {
-			return entries[i].inumber;
+	return dir_lookup(dir, name);
+}
+
+/*
+ * Copies a path into a buffer of MAX_FILE_NAME chars.
+ * Input:
+ *  - copy: the buffer
+ *  - name: the path
+ * Returns: SUCCESS, or FAIL if it does not fit
+ */
+static int copy_path(char *copy, char *name) {
+	size_t len = strlen(name);
+
+	if (len >= MAX_FILE_NAME)
+		return FAIL;
+	memcpy(copy, name, len + 1);
+	return SUCCESS;
+}
+
+/*
+ * Checks that a name can be added to a directory (see dir_add_entry).
+ * Input:
+ *  - name: the entry's name
+ * Returns: nonzero if it can
+ */
+static int valid_entry_name(char *name) {
+	size_t len = strlen(name);
+
+	return len > 0 && len <= DIR_MAX_NAME;
+}
+
+/*
+ * Counts the components of a path.
+ * Input:
+ *  - path: the path
+ * Returns: number of non-empty components
+ */
+int path_depth(char *path) {
+	int depth = 0;
+
+	for (int i = 0; path[i] != '\0'; i++) {
+		if (path[i] != '/' && (i == 0 || path[i - 1] == '/')) {
+			depth++;
 		}
 	}
-	return FAIL;
+	return depth;
+}
+
+
+/*
+ * Write-locks a set of i-nodes in ascending inumber order, the global lock
+ * order, locking repeated inumbers only once.
+ * Input:
+ *  - inumbers: the i-nodes to lock (reordered in place)
+ *  - n: number of i-nodes
+ *  - vector: vector where the locked inumbers are stored
+ *  - count: reference to the number of used positions of vector
+ */
+void lock_ordered(int inumbers[], int n, int vector[], int *count) {
+	/* insertion sort, n is tiny */
+	for (int i = 1; i < n; i++) {
+		int key = inumbers[i];
+		int j = i - 1;
+
+		while (j >= 0 && inumbers[j] > key) {
+			inumbers[j + 1] = inumbers[j];
+			j--;
+		}
+		inumbers[j + 1] = key;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (i > 0 && inumbers[i] == inumbers[i - 1]) {
+			continue;
+		}
+		inode_lock_enable(inumbers[i], 'w');
+		vector[(*count)++] = inumbers[i];
+	}
+}
+
+
+/*
+ * Resolves a path and locks the i-node it leads to.
+ * The path is resolved without locks and checked again once the lock is
+ * held, retrying if it changed in between.
+ * Input:
+ *  - name: the path
+ *  - mode: 'r' or 'w'
+ *  - vector: vector where the locked inumber is stored
+ *  - count: reference to the number of used positions of vector
+ * Returns:
+ *  inumber: the locked i-node, if found
+ *     FAIL: otherwise (nothing is locked)
+ */
+int lock_path(char *name, char mode, int vector[], int *count) {
+	path_step steps[LOCK_VECTOR_SIZE];
+	int steps_count;
+
+	for (;;) {
+		int inumber = lookup_optimistic(name, steps, &steps_count);
+
+		if (inumber == FAIL) {
+			return FAIL;
+		}
+
+		inode_lock_enable(inumber, mode);
+
+		if (path_validate(steps, steps_count)) {
+			vector[(*count)++] = inumber;
+			return inumber;
+		}
+
+		inode_lock_disable(inumber);
+	}
+}
+
+
+/*
+ * Resolves the parent directory of an operation and write-locks it.
+ * Input:
+ *  - parent_name: path of the parent
+ *  - vector: vector where the locked inumber is stored
+ *  - count: reference to the number of used positions of vector
+ * Returns:
+ *  inumber: the locked parent, if found
+ *     FAIL: otherwise (nothing is locked)
+ */
+int lock_parent(char *parent_name, int vector[], int *count) {
+	return lock_path(parent_name, 'w', vector, count);
 }
 
 void display_create(char * name, type nodeType){
@@ -140,7 +332,7 @@ void display_create(char * name, type nodeType){
  * Returns: SUCCESS or FAIL
  */
 int create(char *name, type nodeType){
-	int vector_inumber[INODE_TABLE_SIZE];
+	int vector_inumber[LOCK_VECTOR_SIZE];
 	int i = 0;
 
 	int parent_inumber, child_inumber;
@@ -149,23 +341,25 @@ int create(char *name, type nodeType){
 	type pType;
 	union Data pdata;
 
-	initialize_vector(vector_inumber, INODE_TABLE_SIZE);
+	initialize_vector(vector_inumber, LOCK_VECTOR_SIZE);
 
-	strcpy(name_copy, name);
+	if (copy_path(name_copy, name) == FAIL) {
+		display_create(name, nodeType);
+		printf("failed to create %s, path too long\n", name);
+		return FAIL;
+	}
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
 
-	parent_inumber = lookup(parent_name);
+	parent_inumber = lock_parent(parent_name, vector_inumber, &i);
 
 	if (parent_inumber == FAIL) {
 		display_create(name, nodeType);
 		printf("failed to create %s, invalid parent dir %s\n",
 				name, parent_name);
+
 		return FAIL;
 	}
 
-	inode_lock_enable(parent_inumber, 'w');
-	vector_inumber[i++] = parent_inumber;
-
 	inode_get(parent_inumber, &pType, &pdata);
 
 	if(pType != T_DIRECTORY) {
@@ -173,45 +367,63 @@ int create(char *name, type nodeType){
 		printf("failed to create %s, parent %s is not a dir\n",
 				name, parent_name);
 
-		disable_locks(vector_inumber, INODE_TABLE_SIZE);
+		disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
 		return FAIL;
 	}
 
-	if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL) {
+	if (lookup_sub_node(child_name, pdata.dir) != FAIL) {
 		display_create(name, nodeType);
 		printf("failed to create %s, already exists in dir %s\n",
 				child_name, parent_name);
 
-		disable_locks(vector_inumber, INODE_TABLE_SIZE);
+		disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
 		return FAIL;
 	}
 
-	/* create node and add entry to folder that contains new node */
-	child_inumber = inode_create(nodeType);
+	if (!valid_entry_name(child_name)) {
+		display_create(name, nodeType);
+		printf("failed to create %s, invalid name\n", name);
 
-	if (child_inumber == FAIL) {
+		disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
+		return FAIL;
+	}
+
+	/* nothing is logged that replay could not apply, so whatever would
+	 * keep the entry from being added is ruled out first */
+	if (dir_check_entry(parent_inumber, child_name) == FAIL) {
 		display_create(name, nodeType);
-		printf("failed to create %s in  %s, couldn't allocate inode\n",
+		printf("could not add entry %s in dir %s\n",
 				child_name, parent_name);
 
-		disable_locks(vector_inumber, INODE_TABLE_SIZE);
+		disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
 		return FAIL;
 	}
 
-	inode_lock_enable(child_inumber, 'w');
-	vector_inumber[i] = child_inumber;
+	/* create node and add entry to folder that contains new node */
+	child_inumber = inode_create(nodeType);
 
-	if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL) {
+	if (child_inumber == FAIL) {
 		display_create(name, nodeType);
-		printf("could not add entry %s in dir %s\n",
+		printf("failed to create %s in  %s, couldn't allocate inode\n",
 				child_name, parent_name);
 
-		disable_locks(vector_inumber, INODE_TABLE_SIZE);
+		disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
 		return FAIL;
 	}
 
-	disable_locks(vector_inumber, INODE_TABLE_SIZE);
+	/* The new node is not locked: a delete or move that resolved its
+	 * inumber before it was last freed may hold that lock and be waiting
+	 * for the parent's, out of inumber order. It is logged while still
+	 * unreachable instead, so whatever is done to it next is logged after
+	 * it. */
+	uint64_t lsn = wal_log_create(parent_inumber, child_name, child_inumber, nodeType);
+
+	/* cannot fail: the parent was checked under its lock */
+	dir_add_entry(parent_inumber, child_inumber, child_name);
+
+	disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
 	display_create(name, nodeType);
+	wal_wait(lsn);
 	return SUCCESS;
 }
 
@@ -220,289 +432,627 @@ int create(char *name, type nodeType){
  * Deletes a node given a path.
  * Input:
  *  - name: path of node
- * Returns: SUCCESS or FAIL
+ * Returns: SUCCESS, TECNICOFS_ERROR_FILE_IS_OPEN or FAIL
  */
 int delete(char *name){
-	int vector_inumber[INODE_TABLE_SIZE];
+	int vector_inumber[LOCK_VECTOR_SIZE];
 	int i = 0;
 
 	int parent_inumber, child_inumber;
 	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	path_step steps[LOCK_VECTOR_SIZE];
+	int steps_count;
 	/* use for copy */
 	type pType, cType;
 	union Data pdata, cdata;
 
-	initialize_vector(vector_inumber, INODE_TABLE_SIZE);
+	initialize_vector(vector_inumber, LOCK_VECTOR_SIZE);
 
-	strcpy(name_copy, name);
+	if (copy_path(name_copy, name) == FAIL) {
+		printf("Delete: %s\n", name);
+		printf("failed to delete %s, path too long\n", name);
+		return FAIL;
+	}
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
 
-	parent_inumber = lookup(parent_name);
+	/* number of steps needed to reach the parent */
+	int parent_depth = path_depth(parent_name) + 1;
 
-	if (parent_inumber == FAIL) {
-		printf("Delete: %s\n", name);
-		printf("failed to delete %s, invalid parent dir %s\n",
-				child_name, parent_name);	 	
+	for (;;) {
+		child_inumber = lookup_optimistic(name, steps, &steps_count);
 
-		return FAIL;
-	}
+		if (steps_count < parent_depth) {
+			printf("Delete: %s\n", name);
+			printf("failed to delete %s, invalid parent dir %s\n",
+					child_name, parent_name);
 
-	inode_lock_enable(parent_inumber, 'w');
-	vector_inumber[i++] = parent_inumber;
+			return FAIL;
+		}
 
-	inode_get(parent_inumber, &pType, &pdata);
+		if (child_inumber == FAIL || steps_count < 2) {
+			/* only used to pick the message */
+			inode_peek(steps[parent_depth - 1].inumber, &pType, &pdata);
 
-	if(pType != T_DIRECTORY) {
-		printf("Delete: %s\n", name);
-		printf("failed to delete %s, parent %s is not a dir\n",
-				child_name, parent_name);
+			printf("Delete: %s\n", name);
+			if (pType != T_DIRECTORY) {
+				printf("failed to delete %s, parent %s is not a dir\n",
+						child_name, parent_name);
+			}
+			else {
+				printf("could not delete %s, does not exist in dir %s\n",
+						name, parent_name);
+			}
 
-		disable_locks(vector_inumber, INODE_TABLE_SIZE);
-		return FAIL;
-	}
+			return FAIL;
+		}
 
-	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+		parent_inumber = steps[steps_count - 2].inumber;
 
-	if (child_inumber == FAIL) {
-		printf("Delete: %s\n", name);
-		printf("could not delete %s, does not exist in dir %s\n",
-				name, parent_name);
+		int targets[] = { parent_inumber, child_inumber };
+		lock_ordered(targets, 2, vector_inumber, &i);
 
-		disable_locks(vector_inumber, INODE_TABLE_SIZE);
-		return FAIL;
+		if (path_validate(steps, steps_count))
+			break;
+
+		/* the path changed before we got the locks */
+		disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
+		i = 0;
 	}
 
-	inode_lock_enable(child_inumber, 'w');
-	vector_inumber[i++] = child_inumber;
 	inode_get(child_inumber, &cType, &cdata);
 
-	if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL) {
+	if (cType == T_FILE && inode_open_count(child_inumber, 0) > 0) {
+		printf("Delete: %s\n", name);
+		printf("could not delete %s: file is open\n", name);
+
+		disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
+		return TECNICOFS_ERROR_FILE_IS_OPEN;
+	}
+
+	if (cType == T_DIRECTORY && is_dir_empty(cdata.dir) == FAIL) {
 		printf("Delete: %s\n", name);
 		printf("could not delete %s: is a directory and not empty\n",
 				name);
 
-		disable_locks(vector_inumber, INODE_TABLE_SIZE);
+		disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
 		return FAIL;
 	}
 
 	/* remove entry from folder that contained deleted node */
-	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
+	if (dir_reset_entry(parent_inumber, child_inumber, child_name) == FAIL) {
 		printf("Delete: %s\n", name);
 		printf("failed to delete %s from dir %s\n",
 				child_name, parent_name);
 
-		disable_locks(vector_inumber, INODE_TABLE_SIZE);
+		disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
 		return FAIL;
 	}
 
+	/* logged before the inumber can be handed out again */
+	uint64_t lsn = wal_log_delete(parent_inumber, child_name, child_inumber);
+
 	if (inode_delete(child_inumber) == FAIL) {
 		printf("Delete: %s\n", name);
 		printf("could not delete inode number %d from dir %s\n",
 				child_inumber, parent_name);
 
-		vector_inumber[child_inumber] = FREE_INODE;
-		disable_locks(vector_inumber, INODE_TABLE_SIZE);
+		disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
 		return FAIL;
 	}
 
-	disable_locks(vector_inumber, INODE_TABLE_SIZE);
+	disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
 	printf("Delete: %s\n", name);
+	wal_wait(lsn);
 	return SUCCESS;
 }
 
 
 /*
- * Lookup for a given path.
+ * Write-locks a node of a subtree being deleted, without waiting: a
+ * thread holding it may be waiting for a lock the delete already holds.
+ * Input:
+ *  - inumber: the node
+ *  - arg: where the inumber is stored if it is busy
+ * Returns: SUCCESS (locked), RETRY (busy) or TECNICOFS_ERROR_FILE_IS_OPEN
+ *  (nothing is locked)
+ */
+static int lock_subtree_node(int inumber, void *arg) {
+	type nType;
+
+	if (!inode_lock_try(inumber, 'w')) {
+		*(int *) arg = inumber;
+		return RETRY;
+	}
+
+	inode_get(inumber, &nType, NULL);
+	if (nType == T_FILE && inode_open_count(inumber, 0) > 0) {
+		inode_lock_disable(inumber);
+		return TECNICOFS_ERROR_FILE_IS_OPEN;
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Deletes a node and everything under it (rm -r). The parent and the node
+ * are locked as by delete, then every node below is write-locked, so the
+ * whole subtree is removed at once: it is unlinked, logged as one record
+ * and its i-nodes go back to the free stack together. If a node below is
+ * busy, all locks are dropped and the delete starts over once it is free.
  * Input:
  *  - name: path of node
- * Returns:
- *  inumber: identifier of the i-node, if found
- *     FAIL: otherwise
+ * Returns: number of nodes deleted, TECNICOFS_ERROR_FILE_IS_OPEN or FAIL
  */
-int lookup(char *name) {
-	int vector_inumber[INODE_TABLE_SIZE];
+int delete_recursive(char *name){
+	int vector_inumber[LOCK_VECTOR_SIZE];
 	int i = 0;
 
-	char full_path[MAX_FILE_NAME];
+	int parent_inumber, child_inumber, busy_inumber;
+	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	path_step steps[LOCK_VECTOR_SIZE];
+	int steps_count;
+	int *nodes, nodes_count, result;
+	uint64_t lsn = 0;
+	/* use for copy */
+	type cType;
+
+	initialize_vector(vector_inumber, LOCK_VECTOR_SIZE);
+
+	if (copy_path(name_copy, name) == FAIL) {
+		printf("Delete recursively: %s\n", name);
+		printf("could not delete %s, path too long\n", name);
+		return FAIL;
+	}
+	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+
+	for (;;) {
+		child_inumber = lookup_optimistic(name, steps, &steps_count);
+
+		if (child_inumber == FAIL || steps_count < 2) {
+			printf("Delete recursively: %s\n", name);
+			printf("could not delete %s, does not exist\n", name);
+
+			return FAIL;
+		}
+
+		parent_inumber = steps[steps_count - 2].inumber;
+
+		int targets[] = { parent_inumber, child_inumber };
+		lock_ordered(targets, 2, vector_inumber, &i);
+
+		if (!path_validate(steps, steps_count)) {
+			/* the path changed before we got the locks */
+			disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
+			i = 0;
+			continue;
+		}
+
+		inode_get(child_inumber, &cType, NULL);
+
+		if (cType == T_FILE && inode_open_count(child_inumber, 0) > 0) {
+			result = TECNICOFS_ERROR_FILE_IS_OPEN;
+			nodes = NULL;
+		}
+		else {
+			result = inode_subtree(child_inumber, lock_subtree_node,
+					&busy_inumber, &nodes, &nodes_count);
+		}
+
+		if (result == SUCCESS)
+			break;
+
+		/* the root is unlocked with the vector */
+		for (int j = 1; nodes != NULL && j < nodes_count; j++) {
+			inode_lock_disable(nodes[j]);
+		}
+		free(nodes);
+		disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
+		i = 0;
+
+		if (result != RETRY) {
+			printf("Delete recursively: %s\n", name);
+			if (result == TECNICOFS_ERROR_FILE_IS_OPEN)
+				printf("could not delete %s: a file under it is open\n", name);
+			else
+				printf("could not delete %s: out of memory\n", name);
+
+			return result;
+		}
+
+		/* wait for whoever holds the node before starting over */
+		inode_lock_enable(busy_inumber, 'r');
+		inode_lock_disable(busy_inumber);
+	}
+
+	/* remove entry from folder that contained deleted subtree */
+	if (dir_reset_entry(parent_inumber, child_inumber, child_name) == FAIL) {
+		printf("Delete recursively: %s\n", name);
+		printf("failed to delete %s from dir %s\n",
+				child_name, parent_name);
+
+		result = FAIL;
+	}
+	else {
+		/* logged before the inumbers can be handed out again */
+		lsn = wal_log_delete_tree(parent_inumber, child_name, child_inumber);
+
+		inode_delete_many(nodes, nodes_count);
+		result = nodes_count;
+		printf("Delete recursively: %s, %d nodes\n", name, nodes_count);
+	}
+
+	for (int j = 1; j < nodes_count; j++) {
+		inode_lock_disable(nodes[j]);
+	}
+	disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
+	free(nodes);
+	wal_wait(lsn);
+	return result;
+}
+
+
+/*
+ * Creates a directory and every missing directory above it (mkdir -p).
+ * The deepest existing ancestor is locked as by create and the missing
+ * directories are linked to it as one chain, so no path is resolved twice.
+ * Input:
+ *  - name: path of the directory
+ * Returns: number of directories created (0 if it already existed) or
+ *  FAIL
+ */
+int create_parents(char *name){
+	int parent_inumber, child_inumber;
+	path_step steps[LOCK_VECTOR_SIZE];
+	int steps_count;
+	char name_copy[MAX_FILE_NAME];
 	char delim[] = "/";
-	char *saveptr;
+	char *saveptr, *component;
+	/* the missing components, from the top down */
+	char *names[MAX_FILE_NAME / 2];
+	int nodes[MAX_FILE_NAME / 2];
+	int count = 0, created;
+	uint64_t lsn = 0;
+	/* use for copy */
+	type pType;
+
+	if (copy_path(name_copy, name) == FAIL) {
+		printf("Create directories: %s\n", name);
+		printf("failed to create %s, path too long\n", name);
+		return FAIL;
+	}
+
+	for (;;) {
+		child_inumber = lookup_optimistic(name, steps, &steps_count);
+
+		/* deepest node the walk reached, which exists */
+		parent_inumber = steps[steps_count - 1].inumber;
+
+		inode_lock_enable(parent_inumber, 'w');
+
+		if (path_validate(steps, steps_count))
+			break;
+
+		/* the path changed before we got the lock */
+		inode_lock_disable(parent_inumber);
+	}
+
+	inode_get(parent_inumber, &pType, NULL);
+
+	if (child_inumber != FAIL || pType != T_DIRECTORY) {
+		inode_lock_disable(parent_inumber);
+
+		if (pType == T_DIRECTORY) {
+			printf("Create directories: %s, 0 new\n", name);
+			return 0;
+		}
+
+		printf("Create directories: %s\n", name);
+		printf("failed to create %s, not a dir on the way\n", name);
+		return FAIL;
+	}
+
+	/* skip the components that exist */
+	component = strtok_r(name_copy, delim, &saveptr);
+	for (int j = 1; j < steps_count; j++) {
+		component = strtok_r(NULL, delim, &saveptr);
+	}
+
+	for (; component != NULL; component = strtok_r(NULL, delim, &saveptr)) {
+		if (!valid_entry_name(component)) {
+			inode_lock_disable(parent_inumber);
+			printf("Create directories: %s\n", name);
+			printf("failed to create %s, invalid name %s\n", name, component);
+			return FAIL;
+		}
+		names[count++] = component;
+	}
+
+	/* The new directories are linked to each other while unreachable, and
+	 * only then to the parent, so none of them is ever locked: locking one
+	 * under the parent's lock could deadlock with a delete or move that
+	 * resolved its inumber before it was last freed. Each is logged before
+	 * it can be reached, parents first. */
+	for (created = 0; created < count; created++) {
+		if ((nodes[created] = inode_create(T_DIRECTORY)) == FAIL) {
+			printf("failed to create %s in %s, couldn't allocate inode\n",
+					names[created], name);
+			inode_delete_many(nodes, created);
+			inode_lock_disable(parent_inumber);
+			return FAIL;
+		}
+	}
+
+	for (int j = 0; j < count; j++) {
+		lsn = wal_log_create(j ? nodes[j - 1] : parent_inumber, names[j],
+				nodes[j], T_DIRECTORY);
+	}
+	for (int j = count - 1; j > 0; j--) {
+		dir_add_entry(nodes[j - 1], nodes[j], names[j]);
+	}
+	dir_add_entry(parent_inumber, nodes[0], names[0]);
+
+	inode_lock_disable(parent_inumber);
+	printf("Create directories: %s, %d new\n", name, created);
+	wal_wait(lsn);
+	return created;
+}
 
-	initialize_vector(vector_inumber, INODE_TABLE_SIZE);
 
-	strcpy(full_path, name);
+/*
+ * Resolves a path once, without locks, recording the sequence number of
+ * every i-node along it. Must run inside an epoch read section.
+ * Input:
+ *  - name: path of node
+ *  - steps: where the (inumber, seq) pairs along the path are stored
+ *  - count: reference to the number of steps stored
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: if not found
+ *    RETRY: if a concurrent change was detected
+ */
+static int lookup_attempt(char *name, path_step steps[], int *count) {
+	char full_path[MAX_FILE_NAME];
+	char delim[] = "/";
+	char *saveptr;
 
 	/* start at root node */
 	int current_inumber = FS_ROOT;
+	unsigned int seq = inode_seq_begin(current_inumber);
 
 	/* use for copy */
 	type nType;
 	union Data data;
 
-	inode_lock_enable(current_inumber, 'r');
-	vector_inumber[i++] = current_inumber;
+	*count = 0;
+	steps[(*count)++] = (path_step) { current_inumber, seq };
 
-	/* get root inode data */
-	inode_get(current_inumber, &nType, &data);
+	if (copy_path(full_path, name) == FAIL)
+		return FAIL;
 
 	char *path = strtok_r(full_path, delim, &saveptr);
 
-	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
-		
-		inode_lock_enable(current_inumber, 'r');
-		vector_inumber[i++] = current_inumber;
+	/* search for all sub nodes, through the dentry cache */
+	while (path != NULL) {
+		int parent_inumber = current_inumber;
+		unsigned int hash = dir_hash(path);
 
-		inode_get(current_inumber, &nType, &data);
-		path = strtok_r(NULL, delim, &saveptr);
-	}
+		inode_peek(parent_inumber, &nType, &data);
+		if (!inode_seq_validate(parent_inumber, seq)) {
+			return RETRY;
+		}
 
-	disable_locks(vector_inumber, INODE_TABLE_SIZE);
-	return current_inumber;
-}
+		if (nType != T_DIRECTORY) {
+			return FAIL;
+		}
 
-void sort_vector(int vector[3], int a, int b, int c){
-	if (a < b){
-		if (a < c) {
-			if (c < b) {
-				vector[0] = a;
-				vector[1] = c;
-				vector[2] = b;
+		if (!dcache_lookup(parent_inumber, seq, path, hash, &current_inumber)) {
+			current_inumber = lookup_sub_node(path, data.dir);
+			if (!inode_seq_validate(parent_inumber, seq)) {
+				return RETRY;
 			}
+			dcache_insert(parent_inumber, seq, path, hash, current_inumber);
+		}
 
-			else{
-				vector[0] = a;
-				vector[1] = b;
-				vector[2] = c;
-			}
+		if (current_inumber == FAIL) {
+			return FAIL;
 		}
 
-		else{
-			vector[0] = c;
-			vector[1] = a;
-			vector[2] = b;
+		/* the child is only known to be the right one if the parent is
+		 * still unchanged after the child's seq was read */
+		unsigned int child_seq = inode_seq_begin(current_inumber);
+		if (!inode_seq_validate(parent_inumber, seq)) {
+			return RETRY;
 		}
+
+		seq = child_seq;
+		steps[(*count)++] = (path_step) { current_inumber, seq };
+		path = strtok_r(NULL, delim, &saveptr);
 	}
 
-	else{ /* b < a */
-		if(a < c){
-			vector[0] = b;
-			vector[1] = a;
-			vector[2] = c;
-		}
-		else{ /* c < a*/
-			if(c < b){
-				vector[0] = c;
-				vector[1] = b;
-				vector[2] = a;
-			}
+	return current_inumber;
+}
 
-			else{ /* b < c*/
-				vector[0] = b;
-				vector[1] = c;
-				vector[2] = a;
-			}
+
+/*
+ * Lookup for a given path without taking locks: directories are read
+ * optimistically and the walk restarts if any of them changes meanwhile.
+ * Input:
+ *  - name: path of node
+ *  - steps: where the (inumber, seq) pairs along the path are stored,
+ *    for a later path_validate
+ *  - count: reference to the number of steps stored
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
+ */
+int lookup_optimistic(char *name, path_step steps[], int *count) {
+	int inumber;
+
+	do {
+		epoch_enter();
+		inumber = lookup_attempt(name, steps, count);
+		epoch_exit();
+	} while (inumber == RETRY);
+
+	return inumber;
+}
+
+
+/*
+ * Checks that no i-node along a path resolved by lookup_optimistic has
+ * changed since, i.e. that the path still leads to the same node.
+ * Input:
+ *  - steps: (inumber, seq) pairs along the path
+ *  - count: number of steps
+ * Returns: 1 if the path is still valid, 0 otherwise
+ */
+int path_validate(path_step steps[], int count) {
+	for (int i = 0; i < count; i++) {
+		if (!inode_seq_validate(steps[i].inumber, steps[i].seq)) {
+			return 0;
 		}
 	}
+	return 1;
 }
 
 
+/*
+ * Lookup for a given path.
+ * Input:
+ *  - name: path of node
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
+ */
+int lookup(char *name) {
+	path_step steps[LOCK_VECTOR_SIZE];
+	int count;
+
+	return lookup_optimistic(name, steps, &count);
+}
+
+/*
+ * Moves (renames) a node.
+ * The three i-nodes involved (both parents and the node) are resolved
+ * without locks, write-locked in the global order and the paths that led
+ * to them are validated under the locks; if anything changed in between
+ * the locks are dropped and the move starts over.
+ * Input:
+ *  - current_pathname: current path of node
+ *  - new_pathname: new path of node
+ * Returns: SUCCESS or FAIL
+ */
 int move(char* current_pathname, char* new_pathname) {
 	int vector_inumber[3];
-	int count = 0, constant = 1, max, flag = 0;
+	int i = 0;
 
-	int current_parent_inumber, child_inumber, new_parent_inumber;	
+	int current_parent_inumber, child_inumber, new_parent_inumber;
 	char *current_parent_name, *current_child_name;
 	char *new_parent_name, *new_child_name;
 	char current_pathname_copy[MAX_FILE_NAME];
 	char new_pathname_copy[MAX_FILE_NAME];
+	path_step current_steps[LOCK_VECTOR_SIZE], new_steps[LOCK_VECTOR_SIZE];
+	int current_count, new_count;
+	/* use for copy */
+	type npType;
+	union Data npdata;
 
 	initialize_vector(vector_inumber, 3);
-	strcpy(new_pathname_copy, new_pathname);
-	strcpy(current_pathname_copy, current_pathname);
-	
-	child_inumber = lookup(current_pathname);
-
-	/* checks if there is a directory/file with the current pathname*/
-	if (child_inumber == FAIL) {
-		printf("Moving: %s to %s\n", current_pathname_copy, new_pathname_copy);
-		printf("failed to move %s to %s, %s doesn't exist\n",
-				current_pathname, new_pathname, current_pathname);
-		return FAIL;
-	}
-
-	/* checks if there isn't a directory/file with the new pathname*/
-	if (lookup(new_pathname) != FAIL) {
-		printf("Moving: %s to %s\n", current_pathname_copy, new_pathname_copy);
-		printf("failed to move %s to %s, there is already a %s\n",
-				current_pathname, new_pathname, new_pathname);
+	if (copy_path(new_pathname_copy, new_pathname) == FAIL ||
+			copy_path(current_pathname_copy, current_pathname) == FAIL) {
+		printf("Moving: %s to %s\n", current_pathname, new_pathname);
+		printf("failed to move %s to %s, path too long\n",
+				current_pathname, new_pathname);
 		return FAIL;
 	}
 
 	/* separates child from parent in the current pathname*/
-	split_parent_child_from_path(current_pathname, &current_parent_name,
+	split_parent_child_from_path(current_pathname_copy, &current_parent_name,
 			&current_child_name);
 
 	/* separates child from parent in the new pathname*/
-	split_parent_child_from_path(new_pathname, &new_parent_name, &new_child_name);
+	split_parent_child_from_path(new_pathname_copy, &new_parent_name, &new_child_name);
 
-	new_parent_inumber = lookup(new_parent_name);
-	current_parent_inumber = lookup(current_parent_name);
+	/* number of steps needed to reach the new parent */
+	int new_parent_depth = path_depth(new_parent_name) + 1;
 
-	/* checks if there is a directory/file with the current pathname*/
-	if (new_parent_inumber == FAIL) {
-		printf("Moving: %s to %s\n", current_pathname_copy, new_pathname_copy);
-		printf("failed to move %s to %s, %s doesn't exist\n",
-				current_pathname, new_pathname, new_parent_name);
-		return FAIL;
+	for (;;) {
+		child_inumber = lookup_optimistic(current_pathname, current_steps, &current_count);
+
+		/* checks if there is a directory/file with the current pathname*/
+		if (child_inumber == FAIL || current_count < 2) {
+			printf("Moving: %s to %s\n", current_pathname, new_pathname);
+			printf("failed to move %s to %s, %s doesn't exist\n",
+					current_pathname, new_pathname, current_pathname);
+			return FAIL;
+		}
+
+		current_parent_inumber = current_steps[current_count - 2].inumber;
+
+		/* checks if there isn't a directory/file with the new pathname*/
+		if (lookup_optimistic(new_pathname, new_steps, &new_count) != FAIL) {
+			printf("Moving: %s to %s\n", current_pathname, new_pathname);
+			printf("failed to move %s to %s, there is already a %s\n",
+					current_pathname, new_pathname, new_pathname);
+			return FAIL;
+		}
+
+		/* checks if the new parent exists (the walk got that far) */
+		if (new_count < new_parent_depth) {
+			printf("Moving: %s to %s\n", current_pathname, new_pathname);
+			printf("failed to move %s to %s, %s doesn't exist\n",
+					current_pathname, new_pathname, new_parent_name);
+			return FAIL;
+		}
+
+		new_parent_inumber = new_steps[new_parent_depth - 1].inumber;
+
+		/* Example: "m /a /a/a". The new parent can't be inside the node */
+		for (int j = 0; j < new_parent_depth; j++) {
+			if (new_steps[j].inumber == child_inumber) {
+				printf("Moving: %s to %s\n", current_pathname, new_pathname);
+				printf("failed to move %s to %s, loop would occur\n",
+						current_pathname, new_pathname);
+				return FAIL;
+			}
+		}
+
+		int targets[] = { current_parent_inumber, new_parent_inumber, child_inumber };
+		lock_ordered(targets, 3, vector_inumber, &i);
+
+		if (path_validate(current_steps, current_count) &&
+				path_validate(new_steps, new_parent_depth))
+			break;
+
+		/* a path changed before we got the locks */
+		disable_locks(vector_inumber, 3);
+		i = 0;
 	}
-	
-	/* Example: "m /a /a/a". Prevent loops */
-	if (new_parent_inumber != 0 && strstr(current_pathname_copy, new_parent_name) != NULL) {
-		printf("Moving: %s to %s\n", current_pathname_copy, new_pathname_copy);
-		printf("failed to move %s to %s, loop would occur\n",
-				current_pathname_copy, new_pathname_copy);
+
+	inode_get(new_parent_inumber, &npType, &npdata);
+
+	if (npType != T_DIRECTORY) {
+		printf("Moving: %s to %s\n", current_pathname, new_pathname);
+		printf("failed to move %s to %s, %s is not a dir\n",
+				current_pathname, new_pathname, new_parent_name);
 
 		disable_locks(vector_inumber, 3);
 		return FAIL;
 	}
 
-	/* Sorting the vector_inumber by ascending order*/
-	sort_vector(vector_inumber, new_parent_inumber, current_parent_inumber, child_inumber);
-
-	/* Locking the inodes by ascending order*/
-	while (!flag) {
-		max = constant * count;
-
-		if (inode_lock_try(vector_inumber[0], 'w')) {
-			if (inode_lock_try(vector_inumber[1], 'w')) {
-				if (inode_lock_try(vector_inumber[2], 'w'))
-					/* can lock all three inodes*/
-					flag = 1;
-				else {
-					count ++;
-					inode_lock_disable(vector_inumber[1]);
-					inode_lock_disable(vector_inumber[0]);
-					/* wait for a random number of seconds before trying to lock again*/
-					sleep((rand() % (max + 1)));
-				}
-			}
-			else {
-				count ++;
-				inode_lock_disable(vector_inumber[0]);
-				/* wait for a random number of seconds before trying to lock again*/
-				sleep((rand() % (max + 1)));
-			}
-		}
-		else {
-			count ++;
-			/* wait for a random number of seconds before trying to lock again*/
-			sleep((rand() % (max + 1)));
-		}
+	/* the new name may have been taken before we got the locks */
+	if (lookup_sub_node(new_child_name, npdata.dir) != FAIL) {
+		printf("Moving: %s to %s\n", current_pathname, new_pathname);
+		printf("failed to move %s to %s, there is already a %s\n",
+				current_pathname, new_pathname, new_pathname);
+
+		disable_locks(vector_inumber, 3);
+		return FAIL;
 	}
 
 	/* removes the current child from the parent in the current pathname*/
-	if (dir_reset_entry(current_parent_inumber, child_inumber) == FAIL) {
-		printf("Moving: %s to %s\n", current_pathname_copy, new_pathname_copy);
+	if (dir_reset_entry(current_parent_inumber, child_inumber, current_child_name) == FAIL) {
+		printf("Moving: %s to %s\n", current_pathname, new_pathname);
 		printf("failed to delete %s from dir %s\n",
 				current_child_name, current_parent_name);
 
@@ -512,20 +1062,224 @@ int move(char* current_pathname, char* new_pathname) {
 
 	/* adds the current child to the parent in the new pathname with the new name*/
 	if (dir_add_entry(new_parent_inumber, child_inumber, new_child_name) == FAIL) {
-		printf("Moving: %s to %s\n", current_pathname_copy, new_pathname_copy);
+		printf("Moving: %s to %s\n", current_pathname, new_pathname);
 		printf("could not add entry %s in dir %s\n",
 				current_child_name, new_parent_name);
 
+		/* put the node back where it was */
+		dir_add_entry(current_parent_inumber, child_inumber, current_child_name);
 		disable_locks(vector_inumber, 3);
 		return FAIL;
 	}
 
-	printf("Moving: %s to %s\n", current_pathname_copy, new_pathname_copy);
+	uint64_t lsn = wal_log_move(current_parent_inumber, current_child_name,
+			new_parent_inumber, new_child_name, child_inumber);
+
+	printf("Moving: %s to %s\n", current_pathname, new_pathname);
 	disable_locks(vector_inumber, 3);
+	wal_wait(lsn);
 	return SUCCESS;
 }
 
 
+/*
+ * Lists a page of a directory's entries (see dir_list). The directory is
+ * read-locked for the page only, so a listing in many pages lets the
+ * directory change in between.
+ * Input:
+ *  - name: path of the directory
+ *  - cursor: where the page starts, 0 at first; set to where the next
+ *    one does, or DIR_LIST_END after the last
+ *  - entries: where the entries are stored, max of them
+ *  - max: most entries in the page
+ *  - names: where the names are copied
+ *  - size: bytes in names
+ * Returns: number of entries listed, TECNICOFS_ERROR_FILE_NOT_FOUND or
+ *  FAIL
+ */
+int read_dir(char *name, uint64_t *cursor, DirListing entries[], int max,
+		char *names, int size) {
+	int vector_inumber[LOCK_VECTOR_SIZE];
+	int i = 0;
+	type nType;
+
+	initialize_vector(vector_inumber, LOCK_VECTOR_SIZE);
+
+	int inumber = lock_path(name, 'r', vector_inumber, &i);
+
+	if (inumber == FAIL) {
+		printf("List directory: %s\n", name);
+		printf("failed to list %s, does not exist\n", name);
+		return TECNICOFS_ERROR_FILE_NOT_FOUND;
+	}
+
+	inode_get(inumber, &nType, NULL);
+
+	int count = nType == T_DIRECTORY ?
+		dir_list(inumber, cursor, entries, max, names, size) : FAIL;
+
+	disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
+	printf("List directory: %s\n", name);
+	if (count == FAIL) {
+		printf("failed to list %s, not a dir\n", name);
+	}
+	return count;
+}
+
+
+/*
+ * Reads the metadata of a node (see inode_stat), read-locked so that it
+ * is taken at one point in time.
+ * Input:
+ *  - name: path of node
+ *  - st: where the metadata is stored
+ * Returns: inumber of the node, or TECNICOFS_ERROR_FILE_NOT_FOUND
+ */
+int stat_node(char *name, InodeStat *st) {
+	int vector_inumber[LOCK_VECTOR_SIZE];
+	int i = 0;
+
+	initialize_vector(vector_inumber, LOCK_VECTOR_SIZE);
+
+	int inumber = lock_path(name, 'r', vector_inumber, &i);
+
+	if (inumber == FAIL)
+		return TECNICOFS_ERROR_FILE_NOT_FOUND;
+
+	inode_stat(inumber, st);
+	disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
+	return inumber;
+}
+
+
+/*
+ * Resolves a path to a file and locks it.
+ * Input:
+ *  - name: path of the file
+ *  - mode: 'r' or 'w'
+ *  - vector: vector where the locked inumber is stored
+ *  - count: reference to the number of used positions of vector
+ * Returns:
+ *  inumber: the locked file, if found
+ *  TECNICOFS_ERROR_FILE_NOT_FOUND: if the path does not lead to a file
+ *  (nothing is locked)
+ */
+static int lock_file(char *name, char mode, int vector[], int *count) {
+	type nType;
+	int inumber = lock_path(name, mode, vector, count);
+
+	if (inumber == FAIL) {
+		return TECNICOFS_ERROR_FILE_NOT_FOUND;
+	}
+
+	inode_get(inumber, &nType, NULL);
+
+	if (nType != T_FILE) {
+		disable_locks(vector, LOCK_VECTOR_SIZE);
+		*count = 0;
+		return TECNICOFS_ERROR_FILE_NOT_FOUND;
+	}
+	return inumber;
+}
+
+
+/*
+ * Opens a file: checks that the path leads to a file and counts the new
+ * handle, which keeps the file from being deleted until close_file.
+ * Input:
+ *  - name: path of the file
+ * Returns:
+ *  inumber: identifier of the file, if found
+ *  TECNICOFS_ERROR_FILE_NOT_FOUND: otherwise
+ */
+int open_file(char *name) {
+	int vector_inumber[LOCK_VECTOR_SIZE];
+	int i = 0;
+
+	initialize_vector(vector_inumber, LOCK_VECTOR_SIZE);
+
+	int inumber = lock_file(name, 'r', vector_inumber, &i);
+
+	printf("Open: %s\n", name);
+	if (inumber < 0) {
+		printf("failed to open %s, not a file\n", name);
+		return inumber;
+	}
+
+	inode_open_count(inumber, 1);
+	disable_locks(vector_inumber, LOCK_VECTOR_SIZE);
+	return inumber;
+}
+
+
+/*
+ * Drops a handle counted by open_file.
+ * Input:
+ *  - inumber: identifier of the file
+ */
+void close_file(int inumber) {
+	inode_open_count(inumber, -1);
+}
+
+
+/*
+ * Reads bytes from an open file. Its inumber stays valid while it is
+ * open, so no path is resolved.
+ * Input:
+ *  - inumber: identifier of the file
+ *  - offset: first byte to read
+ *  - buffer: where the bytes are stored
+ *  - len: most bytes to read
+ * Returns:
+ *  number of bytes read, if successful (0 at or past the end)
+ *  TECNICOFS_ERROR_OTHER: otherwise
+ */
+int read_file(int inumber, long offset, char *buffer, int len) {
+	inode_lock_enable(inumber, 'r');
+	int result = inode_read_file(inumber, buffer, offset, len);
+	inode_lock_disable(inumber);
+
+	return result == FAIL ? TECNICOFS_ERROR_OTHER : result;
+}
+
+
+/*
+ * Writes bytes to an open file.
+ * Input:
+ *  - inumber: identifier of the file
+ *  - offset: where the bytes go
+ *  - buffer: the bytes
+ *  - len: number of bytes
+ * Returns:
+ *  number of bytes written, if successful
+ *  TECNICOFS_ERROR_OTHER: otherwise
+ */
+int write_file(int inumber, long offset, char *buffer, int len) {
+	inode_lock_enable(inumber, 'w');
+	int result = inode_write_file(inumber, buffer, offset, len);
+	inode_lock_disable(inumber);
+
+	return result == FAIL ? TECNICOFS_ERROR_OTHER : result;
+}
+
+
+/*
+ * Sets the size of an open file, dropping its bytes past the new end or
+ * padding it with zeros.
+ * Input:
+ *  - inumber: identifier of the file
+ *  - size: new size
+ * Returns: SUCCESS or TECNICOFS_ERROR_OTHER
+ */
+int truncate_file(int inumber, long size) {
+	inode_lock_enable(inumber, 'w');
+	int result = inode_truncate_file(inumber, size);
+	inode_lock_disable(inumber);
+
+	return result == FAIL ? TECNICOFS_ERROR_OTHER : SUCCESS;
+}
+
+
 /* File opening with NULL checker */
 FILE* openFile(char* name, char* mode) {
     FILE* fp = fopen(name, mode);
@@ -539,20 +1293,83 @@ FILE* openFile(char* name, char* mode) {
 }
 
 /*
- * Prints tecnicofs tree.
+ * Reserves the next snapshot of tecnicofs, waiting for the active one, if
+ * any, to be released.
+ */
+void snapshot_reserve() {
+	inode_snapshot_reserve();
+}
+
+/*
+ * Takes the reserved snapshot. Only safe while no command runs; commands
+ * may run again as soon as it returns.
+ */
+void snapshot_take() {
+	inode_snapshot_take();
+}
+
+/*
+ * Releases the snapshot.
+ */
+void snapshot_release() {
+	inode_snapshot_release();
+}
+
+/*
+ * Writes the path of a node on a line of its own.
+ */
+static int print_node(walk_node *node, walk_out *out, void *arg) {
+	(void) arg;
+	walk_write(out, node->path, node->path_len);
+	walk_write(out, "\n", 1);
+	return WALK_DESCEND;
+}
+
+/*
+ * Prints tecnicofs tree as of the snapshot taken.
  * Input:
  *  - fp: pointer to output file
  */
 void print_tecnicofs_tree(FILE *fp){
-	inode_print_tree(fp, FS_ROOT, "");
+	walk_visitor visitor = { print_node, NULL, NULL };
+
+	walk_tree(FS_ROOT, "", &visitor, fp, NULL);
 }
 
+/*
+ * Prints tecnicofs tree, as of the snapshot taken, to a file, and the
+ * file system's statistics.
+ * Input:
+ *  - name: path of the file
+ */
 int print(char *name){
     FILE *output = openFile(name, "w");
 
+    setvbuf(output, NULL, _IOFBF, PRINT_BUFFER);
+
     print_tecnicofs_tree(output);
     printf("Print tree to: %s\n", name);
 
+    unsigned long hits, misses;
+    dcache_stats(&hits, &misses);
+    printf("Dentry cache: %lu hits, %lu misses\n", hits, misses);
+
+    unsigned long chunks, free_blocks;
+    block_pool_stats(&chunks, &free_blocks);
+    printf("Blocks: %lu chunks, %lu blocks free\n", chunks, free_blocks);
+
+    slab_stats slabs;
+    slab_get_stats(&slabs);
+    printf("Slabs: %lu slabs, %ld bytes in use, %.1f%% cache hits\n", slabs.slabs,
+            slabs.bytes_in_use, slabs.allocs ? 100.0 * slabs.hits / slabs.allocs : 0.0);
+
+    unsigned long records, commits;
+    double latency;
+    wal_stats(&records, &commits, &latency);
+    if (commits > 0)
+        printf("WAL: %lu records in %lu commits, %.1f us average commit latency\n",
+                records, commits, latency);
+
     fclose(output);
 
     return 0;
@@ -2,16 +2,60 @@
 #define FS_H
 #include "state.h"
 
+/* Locks held by an operation: the root, one per path component
+ * (a path of MAX_FILE_NAME chars has at most MAX_FILE_NAME/2 of them)
+ * and a newly created child */
+#define LOCK_VECTOR_SIZE (MAX_FILE_NAME / 2 + 2)
+
+/* Bytes of output print buffers before writing to its file */
+#define PRINT_BUFFER (1 << 16)
+
+/* Threads besides the workers that may reach the file system: the main
+ * thread (image load and log replay), the front end and the log writer */
+#define FS_FIXED_THREADS 3
+
+/* lookup_attempt result when a concurrent change was detected */
+#define RETRY -2
+
+/*
+ * An i-node met while resolving a path, with the sequence number it had
+ */
+typedef struct path_step {
+	int inumber;
+	unsigned int seq;
+} path_step;
+
 void disable_locks(int vector[], int limit);
 void initialize_vector(int vector[], int limit);
-void init_fs();
+void init_fs(char *image, long window, int threads);
 void destroy_fs();
-int is_dir_empty(DirEntry *dirEntries);
+int checkpoint_due();
+void checkpoint_fs();
+int is_dir_empty(DirTable *dir);
 int create(char *name, type nodeType);
 int delete(char *name);
+int delete_recursive(char *name);
+int create_parents(char *name);
+int lookup_optimistic(char *name, path_step steps[], int *count);
+int path_validate(path_step steps[], int count);
+int path_depth(char *path);
+void lock_ordered(int inumbers[], int n, int vector[], int *count);
+int lock_path(char *name, char mode, int vector[], int *count);
+int lock_parent(char *parent_name, int vector[], int *count);
 int lookup(char *name);
 int move(char* current_pathname, char* new_pathname);
+int read_dir(char *name, uint64_t *cursor, DirListing entries[], int max,
+		char *names, int size);
+int stat_node(char *name, InodeStat *st);
+int open_file(char *name);
+void close_file(int inumber);
+int read_file(int inumber, long offset, char *buffer, int len);
+int write_file(int inumber, long offset, char *buffer, int len);
+int truncate_file(int inumber, long size);
 FILE* openFile(char* name, char* mode);
+void snapshot_reserve();
+void snapshot_take();
+void snapshot_release();
 void print_tecnicofs_tree(FILE *fp);
 int print(char *name);
 
@@ -0,0 +1,378 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "slab.h"
+
+/* A free object, linked through its first bytes */
+typedef struct slab_object {
+    struct slab_object *next;
+} slab_object;
+
+/* A slab taken from malloc, remembered until slab_destroy */
+typedef struct slab_chunk {
+    struct slab_chunk *next;
+    char *objects;
+} slab_chunk;
+
+/* Free objects of one class shared by every thread */
+typedef struct slab_depot {
+    pthread_mutex_t lock;
+    slab_object *free;
+    int count;
+} slab_depot;
+
+/*
+ * Free objects of every class kept by one thread, and its share of the
+ * statistics. Only the owner changes it; counters are stored atomically
+ * so slab_get_stats can read them while it runs.
+ */
+typedef struct slab_cache {
+    struct slab_cache *next; /* in slab_caches */
+    slab_object *free[SLAB_CLASSES];
+    int count[SLAB_CLASSES];
+    long bytes_in_use; /* may go negative: objects are freed by any thread */
+    unsigned long allocs;
+    unsigned long hits;
+} slab_cache;
+
+slab_depot slab_depots[SLAB_CLASSES];
+
+slab_chunk *slab_chunks = NULL;
+unsigned long slab_count = 0;
+pthread_mutex_t slab_chunk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Caches of live threads, and the counters of threads that are gone */
+slab_cache *slab_caches = NULL;
+slab_cache slab_retired;
+pthread_mutex_t slab_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread slab_cache *slab_local = NULL;
+pthread_key_t slab_key;
+pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+
+int slab_enabled = 1;
+
+#define SLAB_COUNT(field, delta) \
+    __atomic_store_n(&(field), (field) + (delta), __ATOMIC_RELAXED)
+
+static void slab_mutex_lock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_lock(mutex)) {
+        fprintf(stderr, "Error: could not lock slab mutex\n");
+    }
+}
+
+static void slab_mutex_unlock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_unlock(mutex)) {
+        fprintf(stderr, "Error: could not unlock slab mutex\n");
+    }
+}
+
+/*
+ * Returns the class of an object size, the smallest c with
+ * SLAB_MIN_SIZE << c >= size.
+ */
+static inline int slab_class(size_t size) {
+    if (size <= SLAB_MIN_SIZE)
+        return 0;
+    return (int) (sizeof(unsigned long) * 8) - __builtin_clzl(size - 1) - SLAB_MIN_SHIFT;
+}
+
+static inline size_t slab_class_size(int c) {
+    return (size_t) SLAB_MIN_SIZE << c;
+}
+
+/*
+ * Gives the first count objects of a list back to the depot of a class.
+ * Returns: the rest of the list
+ */
+static slab_object *slab_depot_put(int c, slab_object *list, int count) {
+    slab_object *last = list;
+
+    for (int i = 1; i < count; i++)
+        last = last->next;
+
+    slab_object *rest = last->next;
+    slab_depot *depot = &slab_depots[c];
+
+    slab_mutex_lock(&depot->lock);
+    last->next = depot->free;
+    depot->free = list;
+    depot->count += count;
+    slab_mutex_unlock(&depot->lock);
+    return rest;
+}
+
+/*
+ * Carves a new slab into free objects of a class. Caller holds the
+ * depot's lock.
+ * Returns: 0, or -1 if memory is exhausted
+ */
+static int slab_depot_grow(int c) {
+    slab_chunk *chunk = malloc(sizeof(slab_chunk));
+
+    if (chunk == NULL || (chunk->objects = malloc(SLAB_SIZE)) == NULL) {
+        fprintf(stderr, "Error: could not allocate slab\n");
+        free(chunk);
+        return -1;
+    }
+
+    slab_mutex_lock(&slab_chunk_mutex);
+    chunk->next = slab_chunks;
+    slab_chunks = chunk;
+    __atomic_store_n(&slab_count, slab_count + 1, __ATOMIC_RELAXED);
+    slab_mutex_unlock(&slab_chunk_mutex);
+
+    slab_depot *depot = &slab_depots[c];
+    size_t size = slab_class_size(c);
+
+    for (size_t offset = SLAB_SIZE; offset >= size; offset -= size) {
+        slab_object *object = (slab_object *) (chunk->objects + offset - size);
+
+        object->next = depot->free;
+        depot->free = object;
+        depot->count++;
+    }
+    return 0;
+}
+
+/*
+ * Moves up to SLAB_BATCH objects of a class from the depot into an empty
+ * thread cache, growing the depot if it has none.
+ */
+static void slab_cache_fill(slab_cache *cache, int c) {
+    slab_depot *depot = &slab_depots[c];
+
+    slab_mutex_lock(&depot->lock);
+    if (depot->count > 0 || slab_depot_grow(c) == 0) {
+        int count = depot->count < SLAB_BATCH ? depot->count : SLAB_BATCH;
+        slab_object *last = depot->free;
+
+        for (int i = 1; i < count; i++)
+            last = last->next;
+
+        cache->free[c] = depot->free;
+        cache->count[c] = count;
+        depot->free = last->next;
+        depot->count -= count;
+        last->next = NULL;
+    }
+    slab_mutex_unlock(&depot->lock);
+}
+
+/*
+ * Flushes a thread's cache into the depots and keeps its counters, when
+ * the thread exits.
+ */
+static void slab_cache_release(void *ptr) {
+    slab_cache *cache = ptr;
+
+    for (int c = 0; c < SLAB_CLASSES; c++) {
+        if (cache->count[c] > 0)
+            slab_depot_put(c, cache->free[c], cache->count[c]);
+    }
+
+    slab_mutex_lock(&slab_cache_mutex);
+    for (slab_cache **p = &slab_caches; *p != NULL; p = &(*p)->next) {
+        if (*p == cache) {
+            *p = cache->next;
+            break;
+        }
+    }
+    slab_retired.bytes_in_use += cache->bytes_in_use;
+    slab_retired.allocs += cache->allocs;
+    slab_retired.hits += cache->hits;
+    slab_mutex_unlock(&slab_cache_mutex);
+    free(cache);
+}
+
+static void slab_key_create() {
+    if (pthread_key_create(&slab_key, slab_cache_release)) {
+        fprintf(stderr, "Error: could not create slab cache key\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Returns the calling thread's cache, creating it on first use.
+ */
+static slab_cache *slab_self() {
+    if (slab_local != NULL)
+        return slab_local;
+
+    slab_cache *cache = calloc(1, sizeof(slab_cache));
+    if (cache == NULL) {
+        fprintf(stderr, "Error: could not allocate slab cache\n");
+        exit(EXIT_FAILURE);
+    }
+
+    slab_mutex_lock(&slab_cache_mutex);
+    cache->next = slab_caches;
+    slab_caches = cache;
+    slab_mutex_unlock(&slab_cache_mutex);
+
+    pthread_setspecific(slab_key, cache);
+    slab_local = cache;
+    return cache;
+}
+
+/*
+ * Initializes the allocator, reading TECNICOFS_SLAB from the environment.
+ */
+void slab_init() {
+    char *env = getenv("TECNICOFS_SLAB");
+
+    pthread_once(&slab_key_once, slab_key_create);
+    slab_enabled = env == NULL || strcmp(env, "off") != 0;
+
+    for (int c = 0; c < SLAB_CLASSES; c++) {
+        if (pthread_mutex_init(&slab_depots[c].lock, NULL)) {
+            fprintf(stderr, "Error: could not initialize slab mutex\n");
+            exit(EXIT_FAILURE);
+        }
+        slab_depots[c].free = NULL;
+        slab_depots[c].count = 0;
+    }
+}
+
+/*
+ * Releases every slab, whether its objects are free or not, and empties
+ * the thread caches. Only safe once no other thread is allocating.
+ */
+void slab_destroy() {
+    while (slab_chunks != NULL) {
+        slab_chunk *chunk = slab_chunks;
+
+        slab_chunks = chunk->next;
+        free(chunk->objects);
+        free(chunk);
+    }
+    slab_count = 0;
+
+    slab_mutex_lock(&slab_cache_mutex);
+    for (slab_cache *cache = slab_caches; cache != NULL; cache = cache->next) {
+        for (int c = 0; c < SLAB_CLASSES; c++) {
+            cache->free[c] = NULL;
+            cache->count[c] = 0;
+        }
+    }
+    slab_mutex_unlock(&slab_cache_mutex);
+
+    for (int c = 0; c < SLAB_CLASSES; c++) {
+        pthread_mutex_destroy(&slab_depots[c].lock);
+        slab_depots[c].free = NULL;
+        slab_depots[c].count = 0;
+    }
+}
+
+/*
+ * Allocates an object.
+ * Input:
+ *  - size: its size, in bytes
+ * Returns: the object, or NULL if memory is exhausted
+ */
+void *slab_alloc(size_t size) {
+    slab_cache *cache = slab_self();
+
+    if (!slab_enabled || size > SLAB_MAX_SIZE) {
+        void *ptr = malloc(size);
+
+        if (ptr != NULL)
+            SLAB_COUNT(cache->bytes_in_use, (long) size);
+        return ptr;
+    }
+
+    int c = slab_class(size);
+
+    SLAB_COUNT(cache->allocs, 1);
+    if (cache->count[c] > 0)
+        SLAB_COUNT(cache->hits, 1);
+    else {
+        slab_cache_fill(cache, c);
+        if (cache->count[c] == 0)
+            return NULL;
+    }
+
+    slab_object *object = cache->free[c];
+
+    cache->free[c] = object->next;
+    cache->count[c]--;
+    SLAB_COUNT(cache->bytes_in_use, (long) slab_class_size(c));
+    return object;
+}
+
+/*
+ * Resizes an object, moving it if its class changes.
+ * Input:
+ *  - ptr: the object, or NULL
+ *  - old_size: the size it was allocated with
+ *  - size: its new size
+ * Returns: the object, or NULL (leaving ptr as is) if memory is exhausted
+ */
+void *slab_realloc(void *ptr, size_t old_size, size_t size) {
+    if (ptr == NULL)
+        return slab_alloc(size);
+
+    if (slab_enabled && old_size <= SLAB_MAX_SIZE && size <= SLAB_MAX_SIZE &&
+            slab_class(old_size) == slab_class(size))
+        return ptr;
+
+    void *moved = slab_alloc(size);
+
+    if (moved != NULL) {
+        memcpy(moved, ptr, old_size < size ? old_size : size);
+        slab_free(ptr, old_size);
+    }
+    return moved;
+}
+
+/*
+ * Frees an object into the calling thread's cache, which need not be the
+ * one that allocated it.
+ * Input:
+ *  - ptr: the object, or NULL
+ *  - size: the size it was allocated with
+ */
+void slab_free(void *ptr, size_t size) {
+    if (ptr == NULL)
+        return;
+
+    slab_cache *cache = slab_self();
+
+    if (!slab_enabled || size > SLAB_MAX_SIZE) {
+        SLAB_COUNT(cache->bytes_in_use, -(long) size);
+        free(ptr);
+        return;
+    }
+
+    int c = slab_class(size);
+    slab_object *object = ptr;
+
+    object->next = cache->free[c];
+    cache->free[c] = object;
+    cache->count[c]++;
+    SLAB_COUNT(cache->bytes_in_use, -(long) slab_class_size(c));
+
+    if (cache->count[c] == SLAB_CACHE_LIMIT) {
+        cache->free[c] = slab_depot_put(c, cache->free[c], SLAB_BATCH);
+        cache->count[c] -= SLAB_BATCH;
+    }
+}
+
+/*
+ * Reads the allocator's statistics, summed over every thread.
+ */
+void slab_get_stats(slab_stats *stats) {
+    slab_mutex_lock(&slab_cache_mutex);
+    stats->slabs = __atomic_load_n(&slab_count, __ATOMIC_RELAXED);
+    stats->bytes_in_use = slab_retired.bytes_in_use;
+    stats->allocs = slab_retired.allocs;
+    stats->hits = slab_retired.hits;
+
+    for (slab_cache *cache = slab_caches; cache != NULL; cache = cache->next) {
+        stats->bytes_in_use += __atomic_load_n(&cache->bytes_in_use, __ATOMIC_RELAXED);
+        stats->allocs += __atomic_load_n(&cache->allocs, __ATOMIC_RELAXED);
+        stats->hits += __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+    }
+    slab_mutex_unlock(&slab_cache_mutex);
+}
@@ -0,0 +1,43 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+/*
+ * Slab allocator for the small objects of the file system: directory
+ * tables, slot arrays and name arenas, file headers and extent arrays.
+ * Objects come in SLAB_CLASSES power-of-two sizes, from SLAB_MIN_SIZE to
+ * SLAB_MAX_SIZE, carved out of SLAB_SIZE-byte slabs. Every thread keeps a
+ * cache of free objects of each class and only goes to the shared depot
+ * of the class, in batches of SLAB_BATCH, when its cache runs empty or
+ * full, so most allocations and frees take no lock at all.
+ *
+ * Like block runs, objects are freed with their size, and a slab is only
+ * given back by slab_destroy. Larger objects go to malloc. Setting
+ * TECNICOFS_SLAB=off in the environment sends everything to malloc, as a
+ * baseline.
+ */
+
+#include <stddef.h>
+
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_MIN_SHIFT 4
+#define SLAB_MIN_SIZE (1 << SLAB_MIN_SHIFT)
+#define SLAB_CLASSES 9
+#define SLAB_MAX_SIZE (SLAB_MIN_SIZE << (SLAB_CLASSES - 1))
+#define SLAB_BATCH 32
+#define SLAB_CACHE_LIMIT (2 * SLAB_BATCH)
+
+typedef struct slab_stats {
+    unsigned long slabs; /* slabs taken from malloc */
+    long bytes_in_use; /* bytes of live objects, rounded up to their class */
+    unsigned long allocs; /* allocations served by the slabs */
+    unsigned long hits; /* of which served from a thread cache */
+} slab_stats;
+
+void slab_init();
+void slab_destroy();
+void *slab_alloc(size_t size);
+void *slab_realloc(void *ptr, size_t old_size, size_t size);
+void slab_free(void *ptr, size_t size);
+void slab_get_stats(slab_stats *stats);
+
+#endif /* SLAB_H */
@@ -3,91 +3,1049 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include "state.h"
+#include "blocks.h"
+#include "slab.h"
+#include "image.h"
+#include "epoch.h"
+#include "inject.h"
 #include "../../tecnicofs-api-constants.h"
 
-inode_t inode_table[INODE_TABLE_SIZE];
+/*
+ * The i-node table is a fixed directory of segments, each holding
+ * INODE_SEGMENT_SIZE i-nodes. Segments are allocated on demand and never
+ * moved or released while the table is alive, so an inumber always maps to
+ * the same inode_t address even while the table grows.
+ */
+inode_t *inode_segments[INODE_MAX_SEGMENTS];
+int inode_segment_count = 0;
+
+/* Serializes table growth */
+pthread_mutex_t inode_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Version new slots start at: above any version handed out before the
+ * last restart (see inode_version_floor) */
+uint64_t inode_version_base = 0;
+
+/*
+ * Lock-free stack of free inumbers, linked through inode_t.next_free.
+ * The low 32 bits hold the top inumber and the high 32 bits a tag that is
+ * bumped on every update, so a pop racing with a pop-and-push of the same
+ * inumber (ABA) fails its compare-and-swap.
+ */
+unsigned long long inode_free_head;
+
+#define FREE_HEAD(inumber, tag) \
+    (((unsigned long long) (tag) << 32) | (unsigned int) (inumber))
+#define FREE_HEAD_INUMBER(head) ((int) (unsigned int) (head))
+#define FREE_HEAD_TAG(head) ((unsigned int) ((head) >> 32))
+
+/*
+ * Snapshots are copy-on-write: while one is active, the first change to an
+ * i-node (an entry added or removed, or the i-node deleted) saves what it
+ * held when the snapshot was taken, and a walk of the snapshot reads the
+ * saved copy where there is one and the live i-node, which has not changed
+ * since, where there is not. Only one snapshot is active at a time.
+ */
+/* Version of the active snapshot, or 0 */
+unsigned long snapshot_version = 0;
+unsigned long snapshot_last = 0;
+/* Copies saved for the active snapshot */
+SnapCopy *snapshot_copies = NULL;
+/* Protects the three above */
+pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Held from inode_snapshot_reserve to inode_snapshot_release */
+pthread_mutex_t snapshot_owner = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Returns the i-node with the given inumber, which must be below the
+ * current table capacity.
+ */
+static inline inode_t *inode_ref(int inumber) {
+    return &inode_segments[inumber >> INODE_SEGMENT_SHIFT][inumber & INODE_SEGMENT_MASK];
+}
+
+/*
+ * Checks if inumber identifies an allocated i-node.
+ */
+static int inode_exists(int inumber) {
+    int capacity = __atomic_load_n(&inode_segment_count, __ATOMIC_ACQUIRE) * INODE_SEGMENT_SIZE;
+
+    return inumber >= 0 && inumber < capacity && inode_ref(inumber)->nodeType != T_NONE;
+}
+
+/*
+ * Marks the start of a change to an i-node (type, data or directory
+ * entries), making its sequence number odd. Caller holds the i-node's
+ * write lock, or owns it exclusively (inode_create).
+ */
+static void inode_write_begin(int inumber) {
+    inode_t *inode = inode_ref(inumber);
+
+    __atomic_store_n(&inode->seq, inode->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * Marks the end of a change to an i-node, making its sequence number
+ * even again.
+ */
+static void inode_write_end(int inumber) {
+    inode_t *inode = inode_ref(inumber);
+
+    __atomic_store_n(&inode->seq, inode->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies the type and, for a directory, the entries of an i-node. Caller
+ * holds its lock.
+ * Returns: the copy, whose next is unset
+ */
+static SnapCopy *snap_copy_create(inode_t *inode) {
+    DirTable *dir = inode->nodeType == T_DIRECTORY ? inode->data.dir : NULL;
+    int count = dir ? dir->count : 0;
+    int names = dir ? dir->names->size : 0;
+    SnapCopy *copy = malloc(sizeof(SnapCopy) + sizeof(int) * count + names);
+
+    if (copy == NULL) {
+        fprintf(stderr, "Error: could not allocate snapshot copy\n");
+        exit(EXIT_FAILURE);
+    }
+    copy->nodeType = inode->nodeType;
+    copy->count = 0;
+    copy->inumbers = (int *) (copy + 1);
+    copy->names = (char *) (copy->inumbers + count);
+
+    char *name = copy->names;
+
+    for (int i = 0; dir && i < dir->slots->capacity && copy->count < count; i++) {
+        DirEntry *entry = &dir->slots->entries[i];
+
+        if (entry->inumber >= 0) {
+            char *entry_name = dir->names->bytes + entry->name;
+
+            copy->inumbers[copy->count++] = entry->inumber;
+            memcpy(name, entry_name, 1 + (unsigned char) *entry_name);
+            name += 1 + (unsigned char) *entry_name;
+        }
+    }
+    return copy;
+}
+
+/*
+ * Saves an i-node for the active snapshot, if there is one and it was not
+ * saved yet, before it is changed. Caller holds its write lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+static void inode_preserve(int inumber) {
+    inode_t *inode = inode_ref(inumber);
+    unsigned long version = __atomic_load_n(&snapshot_version, __ATOMIC_ACQUIRE);
+
+    if (version == 0 || inode->snap_version == version)
+        return;
+
+    if (pthread_mutex_lock(&snapshot_mutex)) {
+        fprintf(stderr, "Error: could not lock mutex: snapshot_mutex\n");
+    }
+    /* the snapshot may have been released meanwhile */
+    if (snapshot_version != 0 && inode->snap_version != snapshot_version) {
+        SnapCopy *copy = snap_copy_create(inode);
+
+        copy->next = snapshot_copies;
+        snapshot_copies = copy;
+        inode->snap_copy = copy;
+        inode->snap_version = snapshot_version;
+    }
+    if (pthread_mutex_unlock(&snapshot_mutex)) {
+        fprintf(stderr, "Error: could not unlock mutex: snapshot_mutex\n");
+    }
+}
+
+/*
+ * Pushes the chain first..last (already linked through next_free) onto the
+ * free stack.
+ */
+static void inode_free_push(int first, int last) {
+    unsigned long long head = __atomic_load_n(&inode_free_head, __ATOMIC_ACQUIRE);
+    unsigned long long new_head;
+
+    do {
+        inode_ref(last)->next_free = FREE_HEAD_INUMBER(head);
+        new_head = FREE_HEAD(first, FREE_HEAD_TAG(head) + 1);
+    } while (!__atomic_compare_exchange_n(&inode_free_head, &head, new_head,
+                1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Pops a free inumber from the stack.
+ * Returns:
+ *  inumber: a free inumber, now owned by the caller
+ *     FAIL: if the stack is empty
+ */
+static int inode_free_pop() {
+    unsigned long long head = __atomic_load_n(&inode_free_head, __ATOMIC_ACQUIRE);
+    unsigned long long new_head;
+    int inumber;
+
+    do {
+        inumber = FREE_HEAD_INUMBER(head);
+        if (inumber == FREE_INODE)
+            return FAIL;
+        /* may read a stale link if inumber was taken meanwhile, in which
+         * case the tag has changed and the exchange below fails */
+        new_head = FREE_HEAD(inode_ref(inumber)->next_free, FREE_HEAD_TAG(head) + 1);
+    } while (!__atomic_compare_exchange_n(&inode_free_head, &head, new_head,
+                1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return inumber;
+}
+
+/*
+ * Adds a new segment to the table and makes its i-nodes available.
+ * Returns: SUCCESS or FAIL (table is at its maximum size)
+ */
+static int inode_table_grow() {
+    int result = SUCCESS;
+
+    if (pthread_mutex_lock(&inode_table_mutex)) {
+        fprintf(stderr, "Error: could not lock mutex: inode_table_mutex\n");
+    }
+
+    /* another thread may have grown the table while we waited */
+    if (FREE_HEAD_INUMBER(__atomic_load_n(&inode_free_head, __ATOMIC_ACQUIRE)) != FREE_INODE) {
+        /* nothing to do */
+    }
+    else if (inode_segment_count == INODE_MAX_SEGMENTS) {
+        result = FAIL;
+    }
+    else {
+        int segment = inode_segment_count;
+        inode_t *inodes;
+
+        if (posix_memalign((void **) &inodes, 64, sizeof(inode_t) * INODE_SEGMENT_SIZE)) {
+            fprintf(stderr, "Error: could not allocate i-node segment\n");
+            result = FAIL;
+        }
+        else {
+            int first = segment << INODE_SEGMENT_SHIFT;
+
+            for (int i = 0; i < INODE_SEGMENT_SIZE; i++) {
+                inodes[i].nodeType = T_NONE;
+                inodes[i].data.dir = NULL;
+                inodes[i].seq = 0;
+                inodes[i].version = inode_version_base;
+                inodes[i].ctime = 0;
+                inodes[i].mtime = 0;
+                inodes[i].nlink = 0;
+                inodes[i].open_count = 0;
+                inodes[i].next_free = first + i + 1;
+                inodes[i].snap_version = 0;
+                inodes[i].snap_copy = NULL;
+                if (pthread_rwlock_init(&inodes[i].rwlock, NULL)) {
+                    fprintf(stderr, "Error: could not initialize rwlock\n");
+                }
+            }
+
+            inode_segments[segment] = inodes;
+            __atomic_store_n(&inode_segment_count, segment + 1, __ATOMIC_RELEASE);
+
+            inode_free_push(first, first + INODE_SEGMENT_SIZE - 1);
+        }
+    }
+
+    if (pthread_mutex_unlock(&inode_table_mutex)) {
+        fprintf(stderr, "Error: could not unlock mutex: inode_table_mutex\n");
+    }
+    return result;
+}
 
 void inode_lock_enable(int inumber, char mode) {
     switch (mode) {
         case 'r':
-            if (pthread_rwlock_rdlock(&inode_table[inumber].rwlock)) {
+            if (pthread_rwlock_rdlock(&inode_ref(inumber)->rwlock)) {
                 fprintf(stderr, "Error: (try) could not lock rwlock (read-only)\n");
             }
             break;  
 
-        case 'w':
-            if (pthread_rwlock_wrlock(&inode_table[inumber].rwlock)) {
-                fprintf(stderr, "Error: (try) could not lock rwlock (write)\n");
-            }
-            break;  
+        case 'w':
+            if (pthread_rwlock_wrlock(&inode_ref(inumber)->rwlock)) {
+                fprintf(stderr, "Error: (try) could not lock rwlock (write)\n");
+            }
+            break;  
+
+        default: break; 
+    }
+}
+
+void inode_lock_disable(int inumber) {
+    if (pthread_rwlock_unlock(&inode_ref(inumber)->rwlock)) {
+        fprintf(stderr, "Error: could not unlock rwlock\n");
+    }
+}
+
+int inode_lock_try(int inumber, char mode) {
+    switch (mode) {
+        case 'r':
+            if (pthread_rwlock_tryrdlock(&inode_ref(inumber)->rwlock)) {
+                return 0;
+            }
+            return 1;
+
+        case 'w':
+            if (pthread_rwlock_trywrlock(&inode_ref(inumber)->rwlock)) {
+                return 0;
+            }
+            return 1;
+
+        default: return 0;
+    }
+}
+
+
+/*
+ * Starts an optimistic read of an i-node, waiting out a change in progress.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: the sequence number to validate the read against
+ */
+unsigned int inode_seq_begin(int inumber) {
+    inode_t *inode = inode_ref(inumber);
+    unsigned int seq;
+    int spins = 0;
+
+    while ((seq = __atomic_load_n(&inode->seq, __ATOMIC_ACQUIRE)) & 1) {
+        if (++spins % 64 == 0)
+            sched_yield();
+    }
+    return seq;
+}
+
+/*
+ * Checks that an i-node did not change since inode_seq_begin.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - seq: value returned by inode_seq_begin
+ * Returns: 1 if everything read in between is consistent, 0 otherwise
+ */
+int inode_seq_validate(int inumber, unsigned int seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&inode_ref(inumber)->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/*
+ * Reads an i-node's type and data without locking it. The values are only
+ * meaningful if a later inode_seq_validate succeeds, and data may only be
+ * dereferenced inside an epoch read section.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - nType: pointer to type
+ *  - data: pointer to data
+ */
+void inode_peek(int inumber, type *nType, union Data *data) {
+    inode_t *inode = inode_ref(inumber);
+
+    *nType = __atomic_load_n(&inode->nodeType, __ATOMIC_RELAXED);
+    data->dir = __atomic_load_n(&inode->data.dir, __ATOMIC_RELAXED);
+}
+
+/*
+ * Hashes an entry name (32-bit FNV-1a).
+ */
+unsigned int dir_hash(const char *name) {
+    unsigned int hash = 2166136261u;
+
+    for (; *name; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Home slot of a hash in a table of the given capacity: the hash's top
+ * bits, so slots are in hash order but for the runs linear probing makes,
+ * and dir_list can resume a listing at any hash.
+ */
+static unsigned int dir_home(unsigned int hash, int capacity) {
+    return (unsigned int) (((uint64_t) hash * capacity) >> 32);
+}
+
+#define DIR_SLOTS_SIZE(capacity) (sizeof(DirSlots) + sizeof(DirEntry) * (capacity))
+#define DIR_NAMES_SIZE(capacity) (sizeof(DirNames) + (capacity))
+
+/*
+ * Allocates an array of free slots. capacity must be a power of two.
+ */
+static DirSlots *dir_slots_create(int capacity) {
+    DirSlots *slots = slab_alloc(DIR_SLOTS_SIZE(capacity));
+    slots->capacity = capacity;
+
+    for (int i = 0; i < capacity; i++) {
+        slots->entries[i].hash = 0;
+        slots->entries[i].inumber = FREE_INODE;
+        slots->entries[i].name = 0;
+    }
+    return slots;
+}
+
+/*
+ * Releases an array of slots.
+ * Takes a void pointer so it can be handed to epoch_retire.
+ */
+static void dir_slots_destroy(void *ptr) {
+    DirSlots *slots = ptr;
+
+    if (!image_contains(slots))
+        slab_free(slots, DIR_SLOTS_SIZE(slots->capacity));
+}
+
+/*
+ * Allocates an empty name arena.
+ */
+static DirNames *dir_names_create(int capacity) {
+    DirNames *names = slab_alloc(DIR_NAMES_SIZE(capacity));
+    names->size = 0;
+    names->capacity = capacity;
+    names->dead = 0;
+    return names;
+}
+
+/*
+ * Releases a name arena.
+ * Takes a void pointer so it can be handed to epoch_retire.
+ */
+static void dir_names_destroy(void *ptr) {
+    DirNames *names = ptr;
+
+    if (!image_contains(names))
+        slab_free(names, DIR_NAMES_SIZE(names->capacity));
+}
+
+/*
+ * Appends a name to an arena with room for it.
+ * Returns: the name's offset
+ */
+static int dir_names_append(DirNames *names, const char *name, int len) {
+    int offset = names->size;
+
+    names->bytes[offset] = (unsigned char) len;
+    memcpy(names->bytes + offset + 1, name, len);
+    names->size += 1 + len;
+    return offset;
+}
+
+/*
+ * Allocates an empty directory table.
+ */
+static DirTable *dir_table_create(int capacity) {
+    DirTable *dir = slab_alloc(sizeof(DirTable));
+    dir->count = 0;
+    dir->used = 0;
+    dir->slots = dir_slots_create(capacity);
+    dir->names = dir_names_create(DIR_NAMES_INITIAL_CAPACITY);
+    return dir;
+}
+
+/*
+ * Releases a directory table.
+ * Takes a void pointer so it can be handed to epoch_retire.
+ */
+static void dir_table_destroy(void *ptr) {
+    DirTable *dir = ptr;
+
+    dir_slots_destroy(dir->slots);
+    dir_names_destroy(dir->names);
+    slab_free(dir, sizeof(DirTable));
+}
+
+/*
+ * Checks if the name at an offset of an arena is the given one. The
+ * offset may be stale, so it is bounds-checked against the arena first.
+ */
+static int dir_name_equals(DirNames *names, int offset, const char *name, int len) {
+    if (offset < 0 || offset + 1 + len > names->capacity)
+        return 0;
+    return (unsigned char) names->bytes[offset] == len &&
+        memcmp(names->bytes + offset + 1, name, len) == 0;
+}
+
+/*
+ * Finds the slot holding name, probing linearly from its hash. A slot is
+ * only compared byte by byte if its hash and then its length match.
+ * May run concurrently with a writer: every field is read once, the arena
+ * is loaded after the entry it names, and the probe is bounded, so the
+ * worst outcome is a wrong answer that the caller's seq check rejects.
+ * Returns:
+ *  index: slot of the entry, if found
+ *   FAIL: otherwise
+ */
+static int dir_find_slot(DirTable *dir, DirSlots *slots, const char *name, int len,
+        unsigned int hash) {
+    unsigned int mask = slots->capacity - 1;
+    unsigned int i = dir_home(hash, slots->capacity);
+
+    for (int probes = 0; probes < slots->capacity; probes++, i = (i + 1) & mask) {
+        DirEntry *entry = &slots->entries[i];
+        int inumber = __atomic_load_n(&entry->inumber, __ATOMIC_ACQUIRE);
+
+        if (inumber == FREE_INODE)
+            return FAIL;
+        if (inumber >= 0 && __atomic_load_n(&entry->hash, __ATOMIC_RELAXED) == hash) {
+            DirNames *names = __atomic_load_n(&dir->names, __ATOMIC_ACQUIRE);
+
+            if (dir_name_equals(names, __atomic_load_n(&entry->name, __ATOMIC_RELAXED),
+                        name, len))
+                return i;
+        }
+    }
+    return FAIL;
+}
+
+/*
+ * Inserts an entry known to be absent into a table with a free slot.
+ * The inumber is published last, so concurrent readers never see a live
+ * slot without its name.
+ */
+static void dir_insert_slot(DirTable *dir, int name, unsigned int hash, int inumber) {
+    DirSlots *slots = dir->slots;
+    unsigned int mask = slots->capacity - 1;
+    unsigned int i = dir_home(hash, slots->capacity);
+
+    while (slots->entries[i].inumber >= 0)
+        i = (i + 1) & mask;
+
+    if (slots->entries[i].inumber == FREE_INODE)
+        dir->used++;
+    slots->entries[i].hash = hash;
+    __atomic_store_n(&slots->entries[i].name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&slots->entries[i].inumber, inumber, __ATOMIC_RELEASE);
+    dir->count++;
+}
+
+/*
+ * Rebuilds a directory table, dropping deleted entries and their names,
+ * doubling its capacity if it is more than half full and leaving room in
+ * the arena for extra more name bytes. The new slots and arena are filled
+ * before being published and the old ones are retired, since lock-free
+ * readers may still be probing them.
+ */
+static void dir_table_rehash(DirTable *dir, int extra) {
+    DirSlots *old_slots = dir->slots;
+    DirNames *old_names = dir->names;
+    int capacity = old_slots->capacity;
+    int names_capacity = DIR_NAMES_INITIAL_CAPACITY;
+
+    if (dir->count * 2 >= capacity)
+        capacity *= 2;
+    while (names_capacity < (old_names->size - old_names->dead + extra) * 2)
+        names_capacity *= 2;
+
+    DirTable rebuilt = { 0, 0, dir_slots_create(capacity), dir_names_create(names_capacity) };
+
+    for (int i = 0; i < old_slots->capacity; i++) {
+        DirEntry *entry = &old_slots->entries[i];
+
+        if (entry->inumber >= 0) {
+            char *name = old_names->bytes + entry->name;
+            int offset = dir_names_append(rebuilt.names, name + 1, (unsigned char) *name);
+
+            dir_insert_slot(&rebuilt, offset, entry->hash, entry->inumber);
+        }
+    }
+
+    dir->count = rebuilt.count;
+    dir->used = rebuilt.used;
+    __atomic_store_n(&dir->names, rebuilt.names, __ATOMIC_RELEASE);
+    __atomic_store_n(&dir->slots, rebuilt.slots, __ATOMIC_RELEASE);
+    epoch_retire(old_slots, dir_slots_destroy);
+    epoch_retire(old_names, dir_names_destroy);
+}
+
+/*
+ * Looks for an entry in a directory table. Safe to call without the
+ * directory's lock from inside an epoch read section, in which case the
+ * result must be validated with inode_seq_validate.
+ * Input:
+ *  - dir: directory table
+ *  - name: name of the entry
+ * Returns:
+ *  inumber: the entry's inumber, if found
+ *     FAIL: otherwise
+ */
+int dir_lookup(DirTable *dir, const char *name) {
+    DirSlots *slots = __atomic_load_n(&dir->slots, __ATOMIC_ACQUIRE);
+    int slot = dir_find_slot(dir, slots, name, strlen(name), dir_hash(name));
+
+    return slot == FAIL ? FAIL : __atomic_load_n(&slots->entries[slot].inumber, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Drops the entries sharing the last hash of a listing.
+ * Returns: the new number of entries
+ */
+static int dir_list_drop_last(DirListing entries[], int count) {
+    unsigned int hash = entries[count - 1].hash;
+
+    while (count > 0 && entries[count - 1].hash == hash)
+        count--;
+    return count;
+}
+
+/*
+ * Lists a page of a directory's entries: the first ones, in hash order,
+ * whose hash is at least the cursor. Entries with the same hash go in the
+ * same page, so the cursor can be the next hash to list, and a listing
+ * resumed from it neither repeats nor skips an entry that stayed in the
+ * directory meanwhile, however the table was changed or rebuilt in
+ * between. Since home slots follow hash order, the scan starts at the
+ * cursor's and stops at the first free slot past the page, beyond which
+ * every entry hashes higher. Caller holds the directory's lock.
+ * Input:
+ *  - inumber: identifier of the directory
+ *  - cursor: next hash to list, 0 at first; set to where the next page
+ *    starts, or DIR_LIST_END after the last one
+ *  - entries: where the entries are stored, max of them
+ *  - max: most entries in the page
+ *  - names: where the entries' names are copied, '\0'-terminated
+ *  - size: bytes in names; the page ends early rather than overflow it
+ * Returns: number of entries listed, or FAIL (not a directory, or a group
+ *  of names with the same hash that does not fit in a page)
+ */
+int dir_list(int inumber, uint64_t *cursor, DirListing entries[], int max,
+        char *names, int size) {
+    if (!inode_exists(inumber) || inode_ref(inumber)->nodeType != T_DIRECTORY || max < 1) {
+        printf("dir_list: invalid directory\n");
+        return FAIL;
+    }
+    if (*cursor > UINT32_MAX)
+        return 0;
+
+    DirTable *dir = inode_ref(inumber)->data.dir;
+    DirSlots *slots = dir->slots;
+    unsigned int capacity = slots->capacity, mask = capacity - 1;
+    unsigned int from = *cursor;
+    unsigned int start = dir_home(from, capacity);
+    int count = 0, more = 0, complete = 1;
+
+    for (unsigned int u = start; u < start + capacity; u++) {
+        DirEntry *entry = &slots->entries[u & mask];
+
+        if (entry->inumber == FREE_INODE) {
+            /* entries past here have their home past u */
+            uint64_t bound = (((uint64_t) u + 1) << 32) / capacity;
+
+            if (bound > UINT32_MAX)
+                break;
+            if (count == max && entries[count - 1].hash < bound) {
+                complete = 0;
+                break;
+            }
+            continue;
+        }
+        if (entry->inumber < 0 || entry->hash < from)
+            continue;
+
+        /* a full page keeps the lowest hashes, in whole groups */
+        if (count == max) {
+            if (entry->hash > entries[count - 1].hash) {
+                more = 1;
+                continue;
+            }
+            count = dir_list_drop_last(entries, count);
+            more = 1;
+            if (count == 0) {
+                printf("dir_list: too many names with the same hash\n");
+                return FAIL;
+            }
+        }
+
+        int i = count++;
+        while (i > 0 && entries[i - 1].hash > entry->hash) {
+            entries[i] = entries[i - 1];
+            i--;
+        }
+        entries[i].hash = entry->hash;
+        entries[i].inumber = entry->inumber;
+        entries[i].nodeType = inode_ref(entry->inumber)->nodeType;
+        entries[i].name = dir->names->bytes + entry->name;
+    }
+
+    /* copy the names, ending the page at a group that does not fit */
+    int used = 0, copied = 0;
+
+    while (copied < count) {
+        int group = copied, bytes = 0;
+
+        while (group < count && entries[group].hash == entries[copied].hash) {
+            bytes += 1 + (unsigned char) entries[group].name[0];
+            group++;
+        }
+        if (used + bytes > size)
+            break;
+
+        for (; copied < group; copied++) {
+            int len = (unsigned char) entries[copied].name[0];
+
+            memcpy(names + used, entries[copied].name + 1, len);
+            names[used + len] = '\0';
+            entries[copied].name = names + used;
+            used += len + 1;
+        }
+    }
+
+    if (copied == 0 && count > 0) {
+        printf("dir_list: names do not fit in the page\n");
+        return FAIL;
+    }
+
+    if (copied < count || more || !complete)
+        *cursor = (uint64_t) entries[copied - 1].hash + 1;
+    else
+        *cursor = DIR_LIST_END;
+    return copied;
+}
+
+/*
+ * Allocates empty file contents.
+ */
+static FileData *file_data_create() {
+    FileData *file = slab_alloc(sizeof(FileData));
+    file->size = 0;
+    file->count = 0;
+    file->capacity = 0;
+    file->extents = NULL;
+    return file;
+}
+
+/*
+ * Gives an extent's run back to the block pool, unless it lies in the
+ * image the table was loaded from.
+ */
+static void extent_release(Extent *extent) {
+    if (!image_contains(extent->data))
+        block_run_free(extent->data, extent->blocks);
+}
+
+/*
+ * Releases file contents, giving their extents back to the block pool.
+ * Takes a void pointer so it can be handed to epoch_retire.
+ */
+static void file_data_destroy(void *ptr) {
+    FileData *file = ptr;
+
+    for (int i = 0; i < file->count; i++)
+        extent_release(&file->extents[i]);
+    slab_free(file->extents, sizeof(Extent) * file->capacity);
+    slab_free(file, sizeof(FileData));
+}
+
+/*
+ * Returns how many bytes the extents of a file have room for.
+ */
+static long file_allocated(FileData *file) {
+    if (file->count == 0)
+        return 0;
+
+    Extent *last = &file->extents[file->count - 1];
+    return last->start + (long) last->blocks * BLOCK_SIZE;
+}
+
+/*
+ * Appends extents until a file has room for its first end bytes. Each new
+ * extent doubles the room, so only the extent array is ever reallocated,
+ * never the bytes.
+ * Returns: SUCCESS or FAIL (out of memory)
+ */
+static int file_reserve(FileData *file, long end) {
+    long allocated = file_allocated(file);
+
+    while (allocated < end) {
+        long blocks = allocated / BLOCK_SIZE;
+
+        if (blocks < 1)
+            blocks = 1;
+        if (blocks > BLOCK_MAX_RUN)
+            blocks = BLOCK_MAX_RUN;
+
+        if (file->count == file->capacity) {
+            int capacity = file->capacity ? file->capacity * 2 : 4;
+            Extent *extents = slab_realloc(file->extents,
+                    sizeof(Extent) * file->capacity, sizeof(Extent) * capacity);
+
+            if (extents == NULL)
+                return FAIL;
+            file->extents = extents;
+            file->capacity = capacity;
+        }
+
+        char *data = block_run_alloc(blocks);
+        if (data == NULL)
+            return FAIL;
+
+        file->extents[file->count++] = (Extent) { allocated, blocks, data };
+        allocated += blocks * BLOCK_SIZE;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Copies bytes between a buffer and a file, or zeroes them in the file.
+ * The bytes must lie within the file's extents.
+ * Input:
+ *  - file: the file
+ *  - buffer: where the bytes come from ('w') or go to ('r'); unused for 'z'
+ *  - offset: first byte in the file
+ *  - len: number of bytes
+ *  - mode: 'r' (read), 'w' (write) or 'z' (zero)
+ */
+static void file_copy(FileData *file, char *buffer, long offset, long len, char mode) {
+    int low = 0, high = file->count - 1;
+
+    /* last extent starting at or before offset */
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+
+        if (file->extents[middle].start <= offset)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+
+    for (int i = low; len > 0; i++) {
+        Extent *extent = &file->extents[i];
+        long at = offset - extent->start;
+        long n = (long) extent->blocks * BLOCK_SIZE - at;
+
+        if (n > len)
+            n = len;
+
+        switch (mode) {
+            case 'r':
+                memcpy(buffer, extent->data + at, n);
+                break;
+            case 'w':
+                memcpy(extent->data + at, buffer, n);
+                break;
+            default:
+                memset(extent->data + at, 0, n);
+        }
+
+        buffer += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+/*
+ * Returns the contents of an i-node if it is a file, NULL otherwise.
+ */
+static FileData *file_of(int inumber) {
+    if (!inode_exists(inumber) || inode_ref(inumber)->nodeType != T_FILE)
+        return NULL;
+    return inode_ref(inumber)->data.file;
+}
+
+/*
+ * Initializes the i-nodes table.
+ */
+void inode_table_init() {
+    slab_init();
+    block_pool_init();
+    inode_segment_count = 0;
+    inode_free_head = FREE_HEAD(FREE_INODE, 0);
+
+    if (inode_table_grow() == FAIL) {
+        fprintf(stderr, "Error: could not initialize i-node table\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Releases the allocated memory for the i-nodes tables.
+ */
+
+void inode_table_destroy() {
+    for (int s = 0; s < inode_segment_count; s++) {
+        for (int i = 0; i < INODE_SEGMENT_SIZE; i++) {
+            inode_t *inode = &inode_segments[s][i];
+
+            if (inode->nodeType == T_DIRECTORY)
+                dir_table_destroy(inode->data.dir);
+            else if (inode->nodeType == T_FILE)
+                file_data_destroy(inode->data.file);
+            if (pthread_rwlock_destroy(&inode->rwlock)) {
+                fprintf(stderr, "Error: could not destroy rwlock\n");
+            }
+        }
+        free(inode_segments[s]);
+        inode_segments[s] = NULL;
+    }
+    inode_segment_count = 0;
+    block_pool_destroy();
+    slab_destroy();
+}
+
+/*
+ * Returns how many inumbers the table has room for; every i-node below
+ * it can be peeked at.
+ */
+int inode_table_capacity() {
+    return __atomic_load_n(&inode_segment_count, __ATOMIC_ACQUIRE) * INODE_SEGMENT_SIZE;
+}
+
+/*
+ * Returns: the time of day in nanoseconds since the epoch
+ */
+static int64_t inode_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-        default: break; 
-    }
+/*
+ * Records a change to an i-node: bumps its version and sets its change
+ * time, and its modification time too if the contents changed. Caller
+ * holds its write lock, or the i-node is unreachable.
+ * Input:
+ *  - inode: the i-node
+ *  - contents: nonzero if its contents changed
+ */
+static void inode_touch(inode_t *inode, int contents) {
+    int64_t now = inode_now();
+
+    inode->version++;
+    inode->ctime = now;
+    if (contents)
+        inode->mtime = now;
 }
 
-void inode_lock_disable(int inumber) {
-    if (pthread_rwlock_unlock(&inode_table[inumber].rwlock)) {
-        fprintf(stderr, "Error: could not unlock rwlock\n");
+/*
+ * Installs an i-node with a given inumber, growing the table to hold it.
+ * Only used while loading an image, before the table is shared; the free
+ * stack is out of date until inode_free_rebuild is called.
+ * Input:
+ *  - inumber: identifier of the i-node, which must be free
+ *  - nType: its type
+ *  - data: its contents
+ * Returns: SUCCESS or FAIL
+ */
+int inode_restore(int inumber, type nType, union Data data) {
+    while (inumber >= inode_table_capacity()) {
+        /* inode_table_grow only grows a table with no free i-nodes */
+        inode_free_head = FREE_HEAD(FREE_INODE, 0);
+        if (inode_table_grow() == FAIL)
+            return FAIL;
     }
+
+    inode_t *inode = inode_ref(inumber);
+
+    if (inode->nodeType != T_NONE)
+        return FAIL;
+    inode->nodeType = nType;
+    inode->data = data;
+    return SUCCESS;
 }
 
-int inode_lock_try(int inumber, char mode) {
-    switch (mode) {
-        case 'r':
-            if (pthread_rwlock_tryrdlock(&inode_table[inumber].rwlock)) {
-                return 0;
-            }
-            return 1;
+/*
+ * Sets the metadata of an i-node installed by inode_restore.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - st: its metadata, as inode_stat returned it
+ */
+void inode_restore_meta(int inumber, InodeStat *st) {
+    inode_t *inode = inode_ref(inumber);
 
-        case 'w':
-            if (pthread_rwlock_trywrlock(&inode_table[inumber].rwlock)) {
-                return 0;
-            }
-            return 1;
+    inode->version = st->version;
+    inode->ctime = st->ctime;
+    inode->mtime = st->mtime;
+    inode->nlink = st->nlink;
+}
 
-        default: return 0;
+/*
+ * Returns: the highest version of any slot, in use or free, and so
+ * above every version handed out so far
+ */
+uint64_t inode_version_max() {
+    uint64_t max = inode_version_base;
+
+    for (int inumber = 0; inumber < inode_table_capacity(); inumber++) {
+        if (inode_ref(inumber)->version > max)
+            max = inode_ref(inumber)->version;
     }
+    return max;
 }
 
 /*
- * Sleeps for synchronization testing.
+ * Sets the version every slot starts from when it is next used, so an
+ * inumber reused after a restart does not hand out a version it had
+ * before. Free slots are raised to it as they are taken rather than all
+ * at once, to keep it out of loading. Only used while loading an image.
+ * Input:
+ *  - floor: highest version in use before the restart
  */
-void insert_delay(int cycles) {
-    for (int i = 0; i < cycles; i++) {}
+void inode_version_floor(uint64_t floor) {
+    inode_version_base = floor;
 }
 
+/*
+ * Raises the version of a slot being taken to the floor set by
+ * inode_version_floor.
+ */
+static void inode_version_raise(inode_t *inode) {
+    if (inode->version < inode_version_base)
+        inode->version = inode_version_base;
+}
 
 /*
- * Initializes the i-nodes table.
+ * Creates an empty i-node with a given inumber, as inode_restore does.
+ * Used while replaying the log, which names i-nodes by inumber.
+ * Input:
+ *  - inumber: identifier of the i-node, which must be free
+ *  - nType: the type of the node (file or directory)
+ * Returns: SUCCESS or FAIL
  */
-void inode_table_init() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        inode_table[i].nodeType = T_NONE;
-        inode_table[i].data.dirEntries = NULL;
-        inode_table[i].data.fileContents = NULL;
-        if (pthread_rwlock_init(&inode_table[i].rwlock, NULL)) {
-            fprintf(stderr, "Error: could not initialize mutex: call_vector\n");
-        }
+int inode_create_at(int inumber, type nType) {
+    union Data data;
+
+    if (nType == T_DIRECTORY)
+        data.dir = dir_table_create(DIR_INITIAL_CAPACITY);
+    else if (nType == T_FILE)
+        data.file = file_data_create();
+    else
+        return FAIL;
+
+    if (inode_restore(inumber, nType, data) == FAIL) {
+        if (nType == T_DIRECTORY)
+            dir_table_destroy(data.dir);
+        else
+            file_data_destroy(data.file);
+        return FAIL;
     }
+    inode_version_raise(inode_ref(inumber));
+    inode_touch(inode_ref(inumber), 1);
+    inode_ref(inumber)->nlink = nType == T_DIRECTORY ? 2 : 1;
+    return SUCCESS;
 }
 
 /*
- * Releases the allocated memory for the i-nodes tables.
+ * Rebuilds the free stack from the i-nodes not in use, lowest inumber on
+ * top, after i-nodes were installed by inode_restore.
  */
+void inode_free_rebuild() {
+    int head = FREE_INODE;
 
-void inode_table_destroy() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        if (inode_table[i].nodeType != T_NONE) {
-            /* as data is an union, the same pointer is used for both dirEntries and fileContents */
-            /* just release one of them */
-            if (inode_table[i].data.dirEntries)
-                free(inode_table[i].data.dirEntries);
-            if (pthread_rwlock_destroy(&inode_table[i].rwlock)) {
-                fprintf(stderr, "Error: could not destroy rwlock\n");
-            }
+    for (int inumber = inode_table_capacity() - 1; inumber >= 0; inumber--) {
+        if (inode_ref(inumber)->nodeType == T_NONE) {
+            inode_ref(inumber)->next_free = head;
+            head = inumber;
         }
     }
+    inode_free_head = FREE_HEAD(head, 0);
 }
 
 /*
@@ -100,27 +1058,60 @@ void inode_table_destroy() {
  */
 int inode_create(type nType) {
     /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
+    INJECT_DELAY(INJECT_INODE_CREATE);
 
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if (inode_table[inumber].nodeType == T_NONE) {
-            inode_table[inumber].nodeType = nType;
+    if (INJECT_FAULT(INJECT_INODE_CREATE))
+        return FAIL;
 
-            if (nType == T_DIRECTORY) {
-                /* Initializes entry table */
-                inode_table[inumber].data.dirEntries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
+    int inumber;
 
-                for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-                }
-            }
-            else {
-                inode_table[inumber].data.fileContents = NULL;
-            }
-            return inumber;
-        }
+    while ((inumber = inode_free_pop()) == FAIL) {
+        if (inode_table_grow() == FAIL)
+            return FAIL;
     }
-    return FAIL;
+
+    inode_t *inode = inode_ref(inumber);
+
+    inode_write_begin(inumber);
+    if (nType == T_DIRECTORY) {
+        /* Initializes entry table */
+        inode->data.dir = dir_table_create(DIR_INITIAL_CAPACITY);
+    }
+    else {
+        inode->data.file = file_data_create();
+    }
+
+    inode->nodeType = nType;
+    inode->nlink = nType == T_DIRECTORY ? 2 : 1;
+    inode_version_raise(inode);
+    inode_touch(inode, 1);
+    inode_write_end(inumber);
+    return inumber;
+}
+
+/*
+ * Empties an i-node, leaving its slot out of the free stack. Caller holds
+ * its write lock, or the i-node is unreachable.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+static void inode_release(int inumber) {
+    inode_t *inode = inode_ref(inumber);
+
+    inode_preserve(inumber);
+
+    /* lock-free readers may still be looking at the old contents */
+    inode_write_begin(inumber);
+    if (inode->nodeType == T_DIRECTORY)
+        epoch_retire(inode->data.dir, dir_table_destroy);
+    else if (inode->data.file)
+        epoch_retire(inode->data.file, file_data_destroy);
+
+    inode->nodeType = T_NONE;
+    inode->data.dir = NULL;
+    inode->nlink = 0;
+    inode_touch(inode, 1);
+    inode_write_end(inumber);
 }
 
 /*
@@ -131,20 +1122,115 @@ int inode_create(type nType) {
  */
 int inode_delete(int inumber) {
     /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
+    INJECT_DELAY(INJECT_INODE_DELETE);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (!inode_exists(inumber)) {
         printf("inode_delete: invalid inumber\n");
         return FAIL;
     } 
 
-    inode_table[inumber].nodeType = T_NONE;
-    /* see inode_table_destroy function */
-    if (inode_table[inumber].data.dirEntries)
-        free(inode_table[inumber].data.dirEntries);
+    inode_release(inumber);
+
+    /* the slot may only be handed out again once its data is released */
+    inode_free_push(inumber, inumber);
+    return SUCCESS;
+}
+
+/*
+ * Deletes a set of i-nodes, e.g. a subtree listed by inode_subtree, and
+ * gives their slots back to the free stack in a single push. Directory
+ * entries between them are not removed one by one: the tables go whole.
+ * Caller holds their write locks, or they are unreachable.
+ * Input:
+ *  - inumbers: identifiers of the i-nodes
+ *  - count: number of i-nodes
+ * Returns: SUCCESS or FAIL (nothing deleted)
+ */
+int inode_delete_many(int inumbers[], int count) {
+    for (int i = 0; i < count; i++) {
+        if (!inode_exists(inumbers[i])) {
+            printf("inode_delete_many: invalid inumber\n");
+            return FAIL;
+        }
+    }
+    if (count == 0)
+        return SUCCESS;
+
+    for (int i = 0; i < count; i++) {
+        inode_release(inumbers[i]);
+        if (i > 0)
+            inode_ref(inumbers[i - 1])->next_free = inumbers[i];
+    }
+
+    inode_free_push(inumbers[0], inumbers[count - 1]);
     return SUCCESS;
 }
 
+/*
+ * Lists the i-nodes of a subtree, the root first and each directory
+ * before its entries. Entries are read without locks, so the caller keeps
+ * the subtree from changing: the visit callback sees every node but the
+ * root before its entries are read.
+ * Input:
+ *  - inumber: root of the subtree
+ *  - visit: called on each node but the root, may be NULL; a result
+ *    other than SUCCESS ends the listing, the node left out
+ *  - arg: passed to visit
+ *  - inumbers: where the listed inumbers are stored, an array the caller
+ *    frees
+ *  - count: where the number of listed i-nodes is stored
+ * Returns: SUCCESS, FAIL (out of memory) or what visit returned
+ */
+int inode_subtree(int inumber, int (*visit)(int inumber, void *arg), void *arg,
+        int **inumbers, int *count) {
+    int capacity = INODE_SUBTREE_MIN;
+    int *nodes = malloc(sizeof(int) * capacity);
+    int n = 0, result = SUCCESS;
+
+    if (nodes == NULL) {
+        fprintf(stderr, "Error: could not allocate subtree list\n");
+        *inumbers = NULL;
+        *count = 0;
+        return FAIL;
+    }
+    nodes[n++] = inumber;
+
+    /* nodes doubles as the queue of directories still to be read */
+    for (int i = 0; i < n && result == SUCCESS; i++) {
+        inode_t *inode = inode_ref(nodes[i]);
+
+        if (inode->nodeType != T_DIRECTORY)
+            continue;
+
+        DirSlots *slots = inode->data.dir->slots;
+
+        for (int j = 0; j < slots->capacity; j++) {
+            int entry = slots->entries[j].inumber;
+
+            if (entry < 0)
+                continue;
+            if (n == capacity) {
+                int *grown = realloc(nodes, sizeof(int) * capacity * 2);
+
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: could not allocate subtree list\n");
+                    result = FAIL;
+                    break;
+                }
+                nodes = grown;
+                capacity *= 2;
+            }
+            if (visit && (result = visit(entry, arg)) != SUCCESS)
+                break;
+            nodes[n++] = entry;
+        }
+    }
+
+    *inumbers = nodes;
+    *count = n;
+    return result;
+}
+
 /*
  * Copies the contents of the i-node into the arguments.
  * Only the fields referenced by non-null arguments are copied.
@@ -156,19 +1242,167 @@ int inode_delete(int inumber) {
  */
 int inode_get(int inumber, type *nType, union Data *data) {
     /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
+    INJECT_DELAY(INJECT_INODE_GET);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (!inode_exists(inumber)) {
         printf("inode_get: invalid inumber %d\n", inumber);
         return FAIL;
     }
 
     if (nType)
-        *nType = inode_table[inumber].nodeType;
+        *nType = inode_ref(inumber)->nodeType;
 
     if (data)
-        *data = inode_table[inumber].data;
+        *data = inode_ref(inumber)->data;
+
+    return SUCCESS;
+}
+
+
+/*
+ * Copies the metadata of an i-node. Caller holds its lock. A client that
+ * saw the same version before knows the i-node has not changed since.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - st: where the metadata is stored
+ * Returns: SUCCESS or FAIL
+ */
+int inode_stat(int inumber, InodeStat *st) {
+    if (!inode_exists(inumber)) {
+        printf("inode_stat: invalid inumber %d\n", inumber);
+        return FAIL;
+    }
+
+    inode_t *inode = inode_ref(inumber);
+
+    st->nodeType = inode->nodeType;
+    st->nlink = inode->nlink;
+    st->size = inode->nodeType == T_DIRECTORY ? inode->data.dir->count : inode->data.file->size;
+    st->version = inode->version;
+    st->ctime = inode->ctime;
+    st->mtime = inode->mtime;
+    return SUCCESS;
+}
 
+
+/*
+ * Counts the handles open on a file. An open holds the i-node's lock (in
+ * either mode), so a delete holding its write lock sees no new handle
+ * appear; a close needs no lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - delta: 1 on open, -1 on close, 0 to read the count
+ * Returns: the new count
+ */
+int inode_open_count(int inumber, int delta) {
+    return __atomic_add_fetch(&inode_ref(inumber)->open_count, delta, __ATOMIC_RELAXED);
+}
+
+/*
+ * Reads bytes from a file. Caller holds the i-node's lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - buffer: where the bytes are stored
+ *  - offset: first byte to read
+ *  - len: most bytes to read
+ * Returns: number of bytes read (0 at or past the end), or FAIL
+ */
+int inode_read_file(int inumber, char *buffer, long offset, int len) {
+    FileData *file = file_of(inumber);
+
+    if (file == NULL || offset < 0 || len < 0) {
+        printf("inode_read_file: invalid file or range\n");
+        return FAIL;
+    }
+
+    if (offset >= file->size)
+        return 0;
+    if (len > file->size - offset)
+        len = file->size - offset;
+
+    file_copy(file, buffer, offset, len, 'r');
+    return len;
+}
+
+/*
+ * Writes bytes to a file, growing it if they go past its end; a gap
+ * between the old end and offset reads as zeros. Caller holds the
+ * i-node's write lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - buffer: the bytes
+ *  - offset: where they go
+ *  - len: number of bytes
+ * Returns: number of bytes written, or FAIL
+ */
+int inode_write_file(int inumber, char *buffer, long offset, int len) {
+    FileData *file = file_of(inumber);
+
+    if (file == NULL || offset < 0 || len < 0 || offset + len > FILE_MAX_SIZE) {
+        printf("inode_write_file: invalid file or range\n");
+        return FAIL;
+    }
+
+    if (file_reserve(file, offset + len) == FAIL) {
+        printf("inode_write_file: out of blocks\n");
+        return FAIL;
+    }
+
+    if (offset > file->size)
+        file_copy(file, NULL, file->size, offset - file->size, 'z');
+    file_copy(file, buffer, offset, len, 'w');
+
+    if (offset + len > file->size)
+        file->size = offset + len;
+    inode_touch(inode_ref(inumber), 1);
+    return len;
+}
+
+/*
+ * Sets the size of a file: extents past the new end go back to the block
+ * pool, and new bytes read as zeros. Caller holds the i-node's write lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - size: new size
+ * Returns: SUCCESS or FAIL
+ */
+int inode_truncate_file(int inumber, long size) {
+    FileData *file = file_of(inumber);
+
+    if (file == NULL || size < 0 || size > FILE_MAX_SIZE) {
+        printf("inode_truncate_file: invalid file or size\n");
+        return FAIL;
+    }
+
+    if (size > file->size) {
+        if (file_reserve(file, size) == FAIL) {
+            printf("inode_truncate_file: out of blocks\n");
+            return FAIL;
+        }
+        file_copy(file, NULL, file->size, size - file->size, 'z');
+    }
+
+    while (file->count > 0 && file->extents[file->count - 1].start >= size) {
+        extent_release(&file->extents[--file->count]);
+    }
+
+    file->size = size;
+    inode_touch(inode_ref(inumber), 1);
+    return SUCCESS;
+}
+
+/*
+ * Replaces the contents of a file. Caller holds the i-node's write lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - fileContents: the new contents
+ *  - len: their size
+ * Returns: SUCCESS or FAIL
+ */
+int inode_set_file(int inumber, char *fileContents, int len) {
+    if (inode_truncate_file(inumber, 0) == FAIL ||
+            inode_write_file(inumber, fileContents, 0, len) == FAIL)
+        return FAIL;
     return SUCCESS;
 }
 
@@ -178,105 +1412,216 @@ int inode_get(int inumber, type *nType, union Data *data) {
  * Input:
  *  - inumber: identifier of the i-node
  *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry
  * Returns: SUCCESS or FAIL
  */
-int dir_reset_entry(int inumber, int sub_inumber) {
+int dir_reset_entry(int inumber, int sub_inumber, char *sub_name) {
     /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
+    INJECT_DELAY(INJECT_DIR_RESET_ENTRY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (!inode_exists(inumber)) {
         printf("inode_reset_entry: invalid inumber\n");
         return FAIL;
     }
 
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
+    if (inode_ref(inumber)->nodeType != T_DIRECTORY) {
         printf("inode_reset_entry: can only reset entry to directories\n");
         return FAIL;
     }
 
-    if ((sub_inumber < FREE_INODE) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
+    if (!inode_exists(sub_inumber)) {
         printf("inode_reset_entry: invalid entry inumber\n");
         return FAIL;
     }
 
+    DirTable *dir = inode_ref(inumber)->data.dir;
+    int len = strlen(sub_name);
+    int slot = dir_find_slot(dir, dir->slots, sub_name, len, dir_hash(sub_name));
 
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber) {
-            inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-            inode_table[inumber].data.dirEntries[i].name[0] = '\0';
-            return SUCCESS;
-        }
-    }
-    return FAIL;
+    if (slot == FAIL || dir->slots->entries[slot].inumber != sub_inumber)
+        return FAIL;
+
+    DirEntry *entry = &dir->slots->entries[slot];
+
+    inode_preserve(inumber);
+
+    /* the slot stays in use as a deleted marker so probe chains are kept;
+     * the name's bytes are dropped by the next rehash */
+    inode_write_begin(inumber);
+    __atomic_store_n(&entry->inumber, DELETED_ENTRY, __ATOMIC_RELEASE);
+    dir->names->dead += 1 + len;
+    dir->count--;
+    if (inode_ref(sub_inumber)->nodeType == T_DIRECTORY)
+        inode_ref(inumber)->nlink--;
+    inode_touch(inode_ref(inumber), 1);
+    inode_write_end(inumber);
+    return SUCCESS;
 }
 
 
 /*
- * Adds an entry to the i-node directory data.
+ * Checks that an entry can be added to a directory: that it is one, and
+ * that the name is valid and not taken. Caller holds the directory's lock,
+ * so the answer holds until it is released.
  * Input:
  *  - inumber: identifier of the i-node
- *  - sub_inumber: identifier of the sub i-node entry
- *  - sub_name: name of the sub i-node entry 
+ *  - sub_name: name of the sub i-node entry
  * Returns: SUCCESS or FAIL
  */
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
-
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+int dir_check_entry(int inumber, char *sub_name) {
+    if (!inode_exists(inumber)) {
         printf("inode_add_entry: invalid inumber\n");
         return FAIL;
     }
 
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
+    if (inode_ref(inumber)->nodeType != T_DIRECTORY) {
         printf("inode_add_entry: can only add entry to directories\n");
         return FAIL;
     }
 
-    if ((sub_inumber < 0) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
-        printf("inode_add_entry: invalid entry inumber\n");
-        return FAIL;
-    }
+    int len = strlen(sub_name);
 
-    if (strlen(sub_name) == 0 ) {
+    if (len == 0 ) {
         printf("inode_add_entry: \
                 entry name must be non-empty\n");
         return FAIL;
     }
 
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == FREE_INODE) {
-            inode_table[inumber].data.dirEntries[i].inumber = sub_inumber;
-            strcpy(inode_table[inumber].data.dirEntries[i].name, sub_name);
-            return SUCCESS;
-        }
+    if (len > DIR_MAX_NAME) {
+        printf("inode_add_entry: entry name is too long\n");
+        return FAIL;
     }
-    return FAIL;
+
+    DirTable *dir = inode_ref(inumber)->data.dir;
+    unsigned int hash = dir_hash(sub_name);
+
+    if (dir_find_slot(dir, dir->slots, sub_name, len, hash) != FAIL) {
+        printf("inode_add_entry: entry %s already exists\n", sub_name);
+        return FAIL;
+    }
+    return SUCCESS;
 }
 
 
 /*
- * Prints the i-nodes table.
+ * Adds an entry to the i-node directory data.
  * Input:
  *  - inumber: identifier of the i-node
- *  - name: pointer to the name of current file/dir
+ *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry 
+ * Returns: SUCCESS or FAIL
  */
-void inode_print_tree(FILE *fp, int inumber, char *name) {
-    if (inode_table[inumber].nodeType == T_FILE) {
-        fprintf(fp, "%s\n", name);
-        return;
+int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
+    /* Used for testing synchronization speedup */
+    INJECT_DELAY(INJECT_DIR_ADD_ENTRY);
+
+    if (dir_check_entry(inumber, sub_name) == FAIL)
+        return FAIL;
+
+    if (!inode_exists(sub_inumber)) {
+        printf("inode_add_entry: invalid entry inumber\n");
+        return FAIL;
     }
 
-    if (inode_table[inumber].nodeType == T_DIRECTORY) {
-        fprintf(fp, "%s\n", name);
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-            if (inode_table[inumber].data.dirEntries[i].inumber != FREE_INODE) {
-                char path[MAX_FILE_NAME];
-                if (snprintf(path, sizeof(path), "%s/%s", name, inode_table[inumber].data.dirEntries[i].name) > sizeof(path)) {
-                    fprintf(stderr, "truncation when building full path\n");
-                }
-                inode_print_tree(fp, inode_table[inumber].data.dirEntries[i].inumber, path);
-            }
-        }
+    int len = strlen(sub_name);
+    DirTable *dir = inode_ref(inumber)->data.dir;
+    unsigned int hash = dir_hash(sub_name);
+
+    inode_preserve(inumber);
+    inode_write_begin(inumber);
+
+    /* keep at most 3/4 of the slots in use (live or deleted), and rebuild
+     * the arena rather than growing it in place, so its size follows the
+     * live names */
+    if ((dir->used + 1) * 4 > dir->slots->capacity * 3 ||
+            dir->names->size + 1 + len > dir->names->capacity)
+        dir_table_rehash(dir, 1 + len);
+
+    dir_insert_slot(dir, dir_names_append(dir->names, sub_name, len), hash, sub_inumber);
+    if (inode_ref(sub_inumber)->nodeType == T_DIRECTORY)
+        inode_ref(inumber)->nlink++;
+    inode_touch(inode_ref(inumber), 1);
+    inode_write_end(inumber);
+    return SUCCESS;
+}
+
+
+/*
+ * Waits for the active snapshot, if any, to be released, and reserves the
+ * next one for the caller.
+ */
+void inode_snapshot_reserve() {
+    if (pthread_mutex_lock(&snapshot_owner)) {
+        fprintf(stderr, "Error: could not lock mutex: snapshot_owner\n");
+    }
+}
+
+/*
+ * Takes the reserved snapshot: from now on, changes save what they
+ * overwrite. Only called while no change is under way, so each one is
+ * either wholly in the snapshot or wholly out of it.
+ */
+void inode_snapshot_take() {
+    if (pthread_mutex_lock(&snapshot_mutex)) {
+        fprintf(stderr, "Error: could not lock mutex: snapshot_mutex\n");
+    }
+    __atomic_store_n(&snapshot_version, ++snapshot_last, __ATOMIC_RELEASE);
+    if (pthread_mutex_unlock(&snapshot_mutex)) {
+        fprintf(stderr, "Error: could not unlock mutex: snapshot_mutex\n");
+    }
+}
+
+/*
+ * Ends the snapshot, releasing the copies saved for it.
+ */
+void inode_snapshot_release() {
+    if (pthread_mutex_lock(&snapshot_mutex)) {
+        fprintf(stderr, "Error: could not lock mutex: snapshot_mutex\n");
+    }
+    __atomic_store_n(&snapshot_version, 0, __ATOMIC_RELEASE);
+    while (snapshot_copies != NULL) {
+        SnapCopy *copy = snapshot_copies;
+
+        snapshot_copies = copy->next;
+        free(copy);
+    }
+    if (pthread_mutex_unlock(&snapshot_mutex)) {
+        fprintf(stderr, "Error: could not unlock mutex: snapshot_mutex\n");
+    }
+    if (pthread_mutex_unlock(&snapshot_owner)) {
+        fprintf(stderr, "Error: could not unlock mutex: snapshot_owner\n");
+    }
+}
+
+/*
+ * Reads an i-node as of the active snapshot or, with none, as it is now.
+ * Input:
+ *  - inumber: identifier of the i-node, which was in use when the
+ *    snapshot was taken
+ *  - copy: set, for a directory, to its entries, which the caller releases
+ *    with free if owned is set
+ *  - owned: set if copy was made for the caller
+ * Returns: the type of the i-node
+ */
+type inode_snapshot_read(int inumber, SnapCopy **copy, int *owned) {
+    inode_t *inode = inode_ref(inumber);
+    unsigned long version = __atomic_load_n(&snapshot_version, __ATOMIC_ACQUIRE);
+    type nType;
+
+    inode_lock_enable(inumber, 'r');
+    if (version != 0 && inode->snap_version == version) {
+        *copy = inode->snap_copy;
+        *owned = 0;
+    }
+    else if (inode->nodeType == T_DIRECTORY) {
+        *copy = snap_copy_create(inode);
+        *owned = 1;
+    }
+    else {
+        *copy = NULL;
+        *owned = 0;
     }
+    nType = *copy ? (*copy)->nodeType : inode->nodeType;
+    inode_lock_disable(inumber);
+    return nType;
 }
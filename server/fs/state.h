@@ -3,59 +3,198 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "../../tecnicofs-api-constants.h"
 
 /* FS root inode number */
 #define FS_ROOT 0
 
 #define FREE_INODE -1
-#define INODE_TABLE_SIZE 50
-#define MAX_DIR_ENTRIES 20
+#define INODE_SEGMENT_SHIFT 10
+#define INODE_SEGMENT_SIZE (1 << INODE_SEGMENT_SHIFT)
+#define INODE_SEGMENT_MASK (INODE_SEGMENT_SIZE - 1)
+#define INODE_MAX_SEGMENTS 4096
+#define DELETED_ENTRY -2
+#define DIR_INITIAL_CAPACITY 8
+#define DIR_NAMES_INITIAL_CAPACITY 32
+#define DIR_MAX_NAME 255
+#define FILE_MAX_SIZE (1L << 30)
+#define INODE_SUBTREE_MIN 64
+#define DIR_LIST_END ((uint64_t) 1 << 32) /* cursor past the last entry */
 
 #define SUCCESS 0
 #define FAIL -1
 
-#define DELAY 5000
-
 
 /*
- * Contains the name of the entry and respective i-number
+ * Contains the hash of the entry's name, where the name is in the
+ * directory's arena and the respective i-number.
+ * A slot is free (FREE_INODE), deleted (DELETED_ENTRY) or in use.
+ * Kept at 12 bytes so a probe sequence stays within few cache lines.
  */
 typedef struct dirEntry {
-	char name[MAX_FILE_NAME];
+	unsigned int hash;
 	int inumber;
+	int name; /* offset in DirNames.bytes */
 } DirEntry;
 
 /*
- * Data is either text (file) or entries (DirEntry)
+ * Slot array of a directory; the capacity (a power of two) travels with the
+ * entries so lock-free readers always see a matching pair
+ */
+typedef struct dirSlots {
+	int capacity;
+	DirEntry entries[];
+} DirSlots;
+
+/*
+ * Name arena of a directory: names are appended one after the other, each
+ * as a length byte followed by the name's bytes (no terminator). Deleted
+ * names stay until the table is rehashed, which copies only live ones, so
+ * an arena holds at most about twice the bytes of the names in use.
+ */
+typedef struct dirNames {
+	int size; /* bytes appended */
+	int capacity;
+	int dead; /* bytes of deleted names */
+	char bytes[];
+} DirNames;
+
+/*
+ * Directory contents: an open-addressing hash table of entries, whose
+ * names live in an arena
+ */
+typedef struct dirTable {
+	int count; /* entries in use */
+	int used; /* entries in use or deleted */
+	DirSlots *slots;
+	DirNames *names;
+} DirTable;
+
+/*
+ * A run of contiguous blocks (see blocks.h) holding the bytes of a file
+ * from start on
+ */
+typedef struct extent {
+	long start;
+	int blocks;
+	char *data;
+} Extent;
+
+/*
+ * File contents: extents in file order, each as long as all the ones
+ * before it together (up to BLOCK_MAX_RUN blocks), so a file grows
+ * without its bytes being copied and is read in few long runs. Bytes past
+ * size are undefined.
+ */
+typedef struct fileData {
+	long size;
+	int count; /* extents in use */
+	int capacity; /* extents the array has room for */
+	Extent *extents;
+} FileData;
+
+/*
+ * An entry listed by dir_list
+ */
+typedef struct dirListing {
+	unsigned int hash;
+	int inumber;
+	type nodeType;
+	const char *name;
+} DirListing;
+
+/*
+ * Data is either contents (FileData) or entries (DirTable)
  */
 union Data {
-	char *fileContents; /* for files */
-	DirEntry *dirEntries; /* for directories */
+	FileData *file; /* for files */
+	DirTable *dir; /* for directories */
 };
 
 /*
- * I-node definition
+ * Contents of an i-node as of a snapshot (see inode_snapshot_take): its
+ * type and, for a directory, its entries
  */
-typedef struct inode_t {    
+typedef struct snapCopy {
+	struct snapCopy *next; /* in the snapshot's list */
 	type nodeType;
-	union Data data;
+	int count; /* directories: entries */
+	int *inumbers; /* of the entries, in slot order */
+	char *names; /* of the entries, each a length byte and its bytes */
+} SnapCopy;
+
+/*
+ * Metadata of an i-node, as returned by inode_stat
+ */
+typedef struct inodeStat {
+	type nodeType;
+	int nlink; /* directory entries naming it, plus "." and ".." for directories */
+	long size; /* files: bytes; directories: entries */
+	uint64_t version; /* bumped by every change, never goes back */
+	int64_t ctime; /* last change to anything, in ns since the epoch */
+	int64_t mtime; /* last change to the contents */
+} InodeStat;
+
+/*
+ * I-node definition. Two cache lines: the lock shares the first with the
+ * version, which is only written under the write lock, so a writer bumps
+ * it on a line it already owns; lock-free readers only touch the second,
+ * which writers change inside the seqlock anyway.
+ */
+typedef struct inode_t {
     pthread_rwlock_t rwlock;
-} inode_t;
+    uint64_t version; /* bumped on every change, see inode_stat */
+    unsigned int seq; /* odd while the i-node is being changed */
+	type nodeType;
+	union Data data;
+    int64_t ctime;
+    int64_t mtime;
+    int nlink;
+    int open_count; /* handles open on the file, which can't be deleted */
+    int next_free; /* next free inumber, while in the free stack */
+    unsigned long snap_version; /* snapshot snap_copy was saved for */
+    SnapCopy *snap_copy;
+} __attribute__((aligned(64))) inode_t;
 
 void inode_lock_enable(int inumber, char mode);
 void inode_lock_disable(int inumber);
 int inode_lock_try(int inumber, char mode);
-void insert_delay(int cycles);
+unsigned int inode_seq_begin(int inumber);
+int inode_seq_validate(int inumber, unsigned int seq);
+void inode_peek(int inumber, type *nType, union Data *data);
 void inode_table_init();
 void inode_table_destroy();
+int inode_table_capacity();
+int inode_restore(int inumber, type nType, union Data data);
+void inode_restore_meta(int inumber, InodeStat *st);
+uint64_t inode_version_max();
+void inode_version_floor(uint64_t floor);
+int inode_create_at(int inumber, type nType);
+void inode_free_rebuild();
 int inode_create(type nType);
 int inode_delete(int inumber);
+int inode_delete_many(int inumbers[], int count);
+int inode_subtree(int inumber, int (*visit)(int inumber, void *arg), void *arg,
+        int **inumbers, int *count);
 int inode_get(int inumber, type *nType, union Data *data);
+int inode_stat(int inumber, InodeStat *st);
+int inode_open_count(int inumber, int delta);
 int inode_set_file(int inumber, char *fileContents, int len);
-int dir_reset_entry(int inumber, int sub_inumber);
+int inode_read_file(int inumber, char *buffer, long offset, int len);
+int inode_write_file(int inumber, char *buffer, long offset, int len);
+int inode_truncate_file(int inumber, long size);
+unsigned int dir_hash(const char *name);
+int dir_lookup(DirTable *dir, const char *name);
+int dir_reset_entry(int inumber, int sub_inumber, char *sub_name);
+int dir_check_entry(int inumber, char *sub_name);
 int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
-void inode_print_tree(FILE *fp, int inumber, char *name);
+int dir_list(int inumber, uint64_t *cursor, DirListing entries[], int max,
+        char *names, int size);
+void inode_snapshot_reserve();
+void inode_snapshot_take();
+void inode_snapshot_release();
+type inode_snapshot_read(int inumber, SnapCopy **copy, int *owned);
 
 
 #endif /* INODES_H */
@@ -0,0 +1,519 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include "wal.h"
+#include "state.h"
+
+/* Records waiting for a commit, or being committed */
+typedef struct wal_buffer {
+    char *bytes;
+    size_t used;
+    size_t capacity;
+} wal_buffer;
+
+int wal_fd = -1;
+int wal_enabled = 0;
+long wal_window = 0; /* microseconds a group stays open */
+
+/* Everything below is protected by wal_mutex */
+pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wal_work = PTHREAD_COND_INITIALIZER; /* records to commit, or stop */
+pthread_cond_t wal_durable = PTHREAD_COND_INITIALIZER; /* durable LSN advanced */
+pthread_t wal_writer_thread;
+int wal_stopping = 0;
+
+wal_buffer wal_pending = { NULL, 0, 0 };
+uint64_t wal_last_lsn = 0; /* last appended */
+uint64_t wal_durable_lsn = 0; /* last committed */
+size_t wal_size = 0; /* bytes committed to the log since it was emptied */
+unsigned long wal_pending_count = 0;
+double wal_pending_time = 0; /* sum of the append times of pending records */
+
+/* Statistics */
+unsigned long wal_records = 0, wal_commits = 0;
+double wal_latency_total = 0; /* microseconds from append to commit */
+
+static void wal_lock() {
+    if (pthread_mutex_lock(&wal_mutex)) {
+        fprintf(stderr, "Error: could not lock mutex: wal_mutex\n");
+    }
+}
+
+static void wal_unlock() {
+    if (pthread_mutex_unlock(&wal_mutex)) {
+        fprintf(stderr, "Error: could not unlock mutex: wal_mutex\n");
+    }
+}
+
+/*
+ * Returns the monotonic time, in microseconds.
+ */
+static double wal_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * Checksums the part of a record after its checksum field (32-bit FNV-1a).
+ */
+static uint32_t wal_checksum(const char *record, size_t size) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = offsetof(wal_record, lsn); i < size; i++) {
+        hash ^= (unsigned char) record[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Applies a replayed record to the i-node table.
+ * Returns: SUCCESS or FAIL
+ */
+static int wal_apply(wal_record *record, const char *names) {
+    char name[2][DIR_MAX_NAME + 1];
+
+    memcpy(name[0], names, record->name_len[0]);
+    name[0][record->name_len[0]] = '\0';
+    memcpy(name[1], names + record->name_len[0], record->name_len[1]);
+    name[1][record->name_len[1]] = '\0';
+
+    switch (record->op) {
+        case WAL_CREATE:
+            if (inode_create_at(record->inumber, record->node_type) == FAIL)
+                return FAIL;
+            return dir_add_entry(record->parent[0], record->inumber, name[0]);
+        case WAL_DELETE:
+            if (dir_reset_entry(record->parent[0], record->inumber, name[0]) == FAIL)
+                return FAIL;
+            return inode_delete(record->inumber);
+        case WAL_DELETE_TREE: {
+            /* the subtree is as it was when the record was logged */
+            int *nodes, count, result = FAIL;
+
+            if (dir_reset_entry(record->parent[0], record->inumber, name[0]) == FAIL)
+                return FAIL;
+            if (inode_subtree(record->inumber, NULL, NULL, &nodes, &count) == SUCCESS)
+                result = inode_delete_many(nodes, count);
+            free(nodes);
+            return result;
+        }
+        case WAL_MOVE:
+            if (dir_reset_entry(record->parent[0], record->inumber, name[0]) == FAIL)
+                return FAIL;
+            return dir_add_entry(record->parent[1], record->inumber, name[1]);
+        default:
+            return FAIL;
+    }
+}
+
+/*
+ * Replays the log over the i-node table, before the server starts. The log
+ * ends at its first incomplete or corrupt record, which a crash may have
+ * left half written; it is cut off there. A record that does not apply
+ * means the log does not belong to the image, and stops the server.
+ * Input:
+ *  - path: the log
+ *  - lsn: last LSN already in the image; earlier records are skipped
+ * Returns: the last LSN in the table
+ */
+uint64_t wal_replay(char *path, uint64_t lsn) {
+    int fd = open(path, O_RDWR);
+    struct stat st;
+
+    if (fd < 0 && errno == ENOENT)
+        return lsn;
+
+    char *log = NULL;
+    if (fd < 0 || fstat(fd, &st) || (log = malloc(st.st_size + 1)) == NULL ||
+            read(fd, log, st.st_size) != st.st_size) {
+        fprintf(stderr, "Error: could not read log: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t offset = 0, size = st.st_size;
+    int applied = 0;
+
+    while (size - offset >= sizeof(wal_record)) {
+        wal_record record;
+
+        memcpy(&record, log + offset, sizeof(record));
+        if (record.size < sizeof(wal_record) || record.size > size - offset ||
+                record.size != sizeof(wal_record) + record.name_len[0] + record.name_len[1] ||
+                record.checksum != wal_checksum(log + offset, record.size))
+            break;
+
+        if (record.lsn > lsn) {
+            if (wal_apply(&record, log + offset + sizeof(wal_record)) == FAIL) {
+                fprintf(stderr, "Error: log record %lu does not apply: %s\n",
+                        (unsigned long) record.lsn, path);
+                exit(EXIT_FAILURE);
+            }
+            lsn = record.lsn;
+            applied++;
+        }
+        offset += record.size;
+    }
+
+    if (offset < size) {
+        printf("WAL: dropping %lu bytes of torn records from %s\n",
+                (unsigned long) (size - offset), path);
+        if (ftruncate(fd, offset) || fsync(fd)) {
+            fprintf(stderr, "Error: could not truncate log: %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    close(fd);
+    free(log);
+    if (applied > 0)
+        inode_free_rebuild();
+
+    printf("WAL: replayed %d records from %s\n", applied, path);
+    return lsn;
+}
+
+/*
+ * Commits pending records in groups until the log is stopped: waits for a
+ * first record, lets the group grow for the commit window, then writes
+ * and syncs it while the next group gathers.
+ */
+static void *wal_writer() {
+    wal_buffer writing = { NULL, 0, 0 };
+
+    wal_lock();
+    for (;;) {
+        while (wal_pending.used == 0 && !wal_stopping)
+            pthread_cond_wait(&wal_work, &wal_mutex);
+        if (wal_pending.used == 0)
+            break;
+
+        if (wal_window > 0 && !wal_stopping) {
+            struct timespec window = { wal_window / 1000000, wal_window % 1000000 * 1000 };
+
+            wal_unlock();
+            nanosleep(&window, NULL);
+            wal_lock();
+        }
+
+        wal_buffer group = wal_pending;
+        uint64_t last = wal_last_lsn;
+        unsigned long count = wal_pending_count;
+        double appended = wal_pending_time;
+
+        writing.used = 0;
+        wal_pending = writing;
+        wal_pending_count = 0;
+        wal_pending_time = 0;
+        wal_unlock();
+
+        for (size_t done = 0; done < group.used; ) {
+            ssize_t n = write(wal_fd, group.bytes + done, group.used - done);
+
+            if (n < 0 && errno != EINTR) {
+                fprintf(stderr, "Error: could not write log\n");
+                exit(EXIT_FAILURE);
+            }
+            done += n > 0 ? n : 0;
+        }
+        if (fdatasync(wal_fd)) {
+            fprintf(stderr, "Error: could not sync log\n");
+            exit(EXIT_FAILURE);
+        }
+
+        double committed = wal_now();
+
+        wal_lock();
+        writing = group;
+        wal_size += group.used;
+        wal_records += count;
+        wal_commits++;
+        wal_latency_total += committed * count - appended;
+        wal_durable_lsn = last;
+        pthread_cond_broadcast(&wal_durable);
+    }
+    wal_unlock();
+
+    free(writing.bytes);
+    return NULL;
+}
+
+/*
+ * Opens the log for appending and starts its writer.
+ * Input:
+ *  - path: the log, created if missing
+ *  - lsn: last LSN in the table (see wal_replay)
+ *  - window: microseconds a group waits for more records before being
+ *    committed; 0 commits as soon as the previous group is synced
+ */
+void wal_open(char *path, uint64_t lsn, long window) {
+    char dir[PATH_MAX];
+    char *slash = strrchr(path, '/');
+    int created = access(path, F_OK) != 0;
+    struct stat st;
+
+    if ((wal_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0 || fstat(wal_fd, &st)) {
+        fprintf(stderr, "Error: could not open log: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    wal_size = st.st_size;
+
+    /* a new log must still be found after a crash */
+    if (created) {
+        int dirfd;
+
+        snprintf(dir, sizeof(dir), "%.*s", slash ? (int) (slash - path) + 1 : 1,
+                slash ? path : ".");
+        if ((dirfd = open(dir, O_RDONLY)) >= 0) {
+            fsync(dirfd);
+            close(dirfd);
+        }
+    }
+
+    wal_window = window;
+    wal_last_lsn = wal_durable_lsn = lsn;
+    wal_stopping = 0;
+    wal_enabled = 1;
+
+    /* the writer inherits a mask blocking every signal, so the server's
+       own signal handling never runs on it */
+    sigset_t all, old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&wal_writer_thread, NULL, wal_writer, NULL)) {
+        fprintf(stderr, "Error: could not create threads\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Appends a record to the pending group.
+ * Input:
+ *  - record: the record, but for its size, checksum and LSN
+ *  - names: the names, one after the other
+ * Returns: the record's LSN, or 0 if there is no log
+ */
+static uint64_t wal_append(wal_record *record, const char *name0, const char *name1) {
+    size_t size = sizeof(wal_record) + record->name_len[0] + record->name_len[1];
+    double now = wal_now();
+
+    wal_lock();
+    if (!wal_enabled) {
+        wal_unlock();
+        return 0;
+    }
+
+    if (wal_pending.used + size > wal_pending.capacity) {
+        size_t capacity = wal_pending.capacity ? wal_pending.capacity : WAL_INITIAL_BUFFER;
+
+        while (wal_pending.used + size > capacity)
+            capacity *= 2;
+        if ((wal_pending.bytes = realloc(wal_pending.bytes, capacity)) == NULL) {
+            fprintf(stderr, "Error: could not allocate log buffer\n");
+            exit(EXIT_FAILURE);
+        }
+        wal_pending.capacity = capacity;
+    }
+
+    char *bytes = wal_pending.bytes + wal_pending.used;
+
+    record->size = size;
+    record->lsn = ++wal_last_lsn;
+    memcpy(bytes, record, sizeof(wal_record));
+    memcpy(bytes + sizeof(wal_record), name0, record->name_len[0]);
+    memcpy(bytes + sizeof(wal_record) + record->name_len[0], name1, record->name_len[1]);
+    ((wal_record *) bytes)->checksum = wal_checksum(bytes, size);
+
+    wal_pending.used += size;
+    wal_pending_count++;
+    wal_pending_time += now;
+    if (wal_pending_count == 1)
+        pthread_cond_signal(&wal_work);
+
+    uint64_t lsn = wal_last_lsn;
+    wal_unlock();
+    return lsn;
+}
+
+/*
+ * Logs the creation of an i-node, after it is allocated and before its
+ * entry is added, so nothing done to it can be logged ahead of this.
+ * Caller holds the parent's lock and has checked with dir_check_entry
+ * that the entry can be added. The new i-node is not locked.
+ * Returns: the record's LSN, for wal_wait
+ */
+uint64_t wal_log_create(int parent, char *name, int inumber, type nType) {
+    wal_record record = { 0, 0, 0, WAL_CREATE, nType, { strlen(name), 0 },
+        { parent, FREE_INODE }, inumber };
+
+    return wal_append(&record, name, "");
+}
+
+/*
+ * Logs the deletion of an i-node, after its entry is removed and before
+ * its inumber is freed. Caller holds the locks of the parent and the
+ * i-node.
+ * Returns: the record's LSN, for wal_wait
+ */
+uint64_t wal_log_delete(int parent, char *name, int inumber) {
+    wal_record record = { 0, 0, 0, WAL_DELETE, T_NONE, { strlen(name), 0 },
+        { parent, FREE_INODE }, inumber };
+
+    return wal_append(&record, name, "");
+}
+
+/*
+ * Logs the deletion of an i-node with everything under it, after its entry
+ * is removed and before the inumbers are freed. Caller holds the locks of
+ * the parent and of the whole subtree.
+ * Returns: the record's LSN, for wal_wait
+ */
+uint64_t wal_log_delete_tree(int parent, char *name, int inumber) {
+    wal_record record = { 0, 0, 0, WAL_DELETE_TREE, T_NONE, { strlen(name), 0 },
+        { parent, FREE_INODE }, inumber };
+
+    return wal_append(&record, name, "");
+}
+
+/*
+ * Logs a move. Caller holds the locks of both parents and the i-node.
+ * Returns: the record's LSN, for wal_wait
+ */
+uint64_t wal_log_move(int old_parent, char *old_name, int new_parent, char *new_name,
+        int inumber) {
+    wal_record record = { 0, 0, 0, WAL_MOVE, T_NONE, { strlen(old_name), strlen(new_name) },
+        { old_parent, new_parent }, inumber };
+
+    return wal_append(&record, old_name, new_name);
+}
+
+/*
+ * Waits for a record, and every record before it, to be durable.
+ * Input:
+ *  - lsn: the record's LSN; 0 (no log) returns at once
+ */
+void wal_wait(uint64_t lsn) {
+    if (lsn == 0)
+        return;
+
+    wal_lock();
+    while (wal_durable_lsn < lsn)
+        pthread_cond_wait(&wal_durable, &wal_mutex);
+    wal_unlock();
+}
+
+/*
+ * Returns: nonzero once the log has grown past WAL_CHECKPOINT_SIZE
+ */
+int wal_checkpoint_due() {
+    return wal_enabled && __atomic_load_n(&wal_size, __ATOMIC_RELAXED) >= WAL_CHECKPOINT_SIZE;
+}
+
+/*
+ * Waits for every record appended so far to be durable, leaving the
+ * writer idle. Caller keeps any record from being appended until it is
+ * done with the log (see wal_truncate).
+ * Returns: the last LSN, which an image flushed now includes
+ */
+uint64_t wal_drain() {
+    wal_lock();
+    uint64_t lsn = wal_last_lsn;
+
+    while (wal_durable_lsn < lsn)
+        pthread_cond_wait(&wal_durable, &wal_mutex);
+    wal_unlock();
+    return lsn;
+}
+
+/*
+ * Empties the drained log, once an image holding all its records is
+ * durable. Records appended later start it again.
+ */
+void wal_truncate() {
+    wal_lock();
+    if (ftruncate(wal_fd, 0) || fsync(wal_fd)) {
+        fprintf(stderr, "Error: could not truncate log\n");
+    }
+    else {
+        wal_size = 0;
+    }
+    wal_unlock();
+}
+
+/*
+ * Commits every pending record and stops the writer; later changes are
+ * not logged.
+ * Returns: the last LSN, which the next image includes
+ */
+uint64_t wal_stop() {
+    wal_lock();
+    if (!wal_enabled) {
+        wal_unlock();
+        return 0;
+    }
+    wal_enabled = 0;
+    wal_stopping = 1;
+    pthread_cond_signal(&wal_work);
+    wal_unlock();
+
+    if (pthread_join(wal_writer_thread, NULL)) {
+        fprintf(stderr, "Error: could not join thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long records, commits;
+    double latency;
+
+    wal_stats(&records, &commits, &latency);
+    printf("WAL: %lu records in %lu commits, %.1f us average commit latency\n",
+            records, commits, latency);
+    return wal_last_lsn;
+}
+
+/*
+ * Closes the stopped log.
+ * Input:
+ *  - truncate: empty it, once an image holding all its records is
+ *    durable
+ */
+void wal_close(int truncate) {
+    if (wal_fd < 0)
+        return;
+
+    if (truncate && (ftruncate(wal_fd, 0) || fsync(wal_fd))) {
+        fprintf(stderr, "Error: could not truncate log\n");
+    }
+    close(wal_fd);
+    wal_fd = -1;
+
+    free(wal_pending.bytes);
+    wal_pending = (wal_buffer) { NULL, 0, 0 };
+}
+
+/*
+ * Reads the log's statistics.
+ * Input:
+ *  - records: set to the number of records committed
+ *  - commits: set to the number of groups they were committed in
+ *  - latency: set to the average time from append to commit, in us
+ */
+void wal_stats(unsigned long *records, unsigned long *commits, double *latency) {
+    wal_lock();
+    *records = wal_records;
+    *commits = wal_commits;
+    *latency = wal_records ? wal_latency_total / wal_records : 0;
+    wal_unlock();
+}
@@ -0,0 +1,61 @@
+#ifndef WAL_H
+#define WAL_H
+
+/*
+ * Write-ahead log of the metadata changes made since the image was last
+ * flushed (creates, deletes and moves), so they survive a crash. Records
+ * name i-nodes by inumber, which the image keeps, and are appended while
+ * the operation still holds its i-node locks, so changes to the same
+ * i-nodes are logged in the order they took effect.
+ *
+ * Appending only copies the record into a buffer. A writer thread commits
+ * the buffer in groups, one write and one fdatasync for every record that
+ * arrived while the previous group was being synced or during the commit
+ * window, and an operation answers only once its record is durable
+ * (wal_wait). At startup the records past the image's LSN are replayed;
+ * a torn record at the end of the log is dropped. Once the log passes
+ * WAL_CHECKPOINT_SIZE, the server flushes the image between commands and
+ * empties it, so neither the log nor the next replay grows without bound.
+ */
+
+#include <stdint.h>
+#include "../../tecnicofs-api-constants.h"
+
+#define WAL_CREATE 1
+#define WAL_DELETE 2
+#define WAL_MOVE 3
+#define WAL_DELETE_TREE 4 /* the node and its whole subtree */
+
+#define WAL_INITIAL_BUFFER 4096
+
+/* Bytes of committed records past which the image is flushed and the log
+ * emptied (see checkpoint_fs) */
+#define WAL_CHECKPOINT_SIZE (4 << 20)
+
+typedef struct wal_record {
+    uint32_t size; /* bytes of the record, names included */
+    uint32_t checksum; /* of the bytes after this field */
+    uint64_t lsn;
+    uint8_t op; /* WAL_CREATE, WAL_DELETE, WAL_MOVE or WAL_DELETE_TREE */
+    uint8_t node_type; /* create: T_FILE or T_DIRECTORY */
+    uint8_t name_len[2]; /* the names follow, unterminated */
+    int32_t parent[2]; /* the parent; for a move, the old and new parents */
+    int32_t inumber; /* the node */
+} wal_record;
+
+uint64_t wal_replay(char *path, uint64_t lsn);
+void wal_open(char *path, uint64_t lsn, long window);
+uint64_t wal_log_create(int parent, char *name, int inumber, type nType);
+uint64_t wal_log_delete(int parent, char *name, int inumber);
+uint64_t wal_log_delete_tree(int parent, char *name, int inumber);
+uint64_t wal_log_move(int old_parent, char *old_name, int new_parent, char *new_name,
+        int inumber);
+void wal_wait(uint64_t lsn);
+int wal_checkpoint_due();
+uint64_t wal_drain();
+void wal_truncate();
+uint64_t wal_stop();
+void wal_close(int truncate);
+void wal_stats(unsigned long *records, unsigned long *commits, double *latency);
+
+#endif /* WAL_H */
@@ -0,0 +1,612 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "walk.h"
+
+/*
+ * A run of output, or the place where a subdirectory's output goes
+ */
+typedef struct walk_segment {
+    struct walk_segment *next;
+    struct walk_task *child; /* set for a placeholder */
+    char *bytes;
+    size_t used, capacity;
+} walk_segment;
+
+struct walk_out {
+    walk_segment *head, *tail;
+};
+
+/*
+ * A directory whose entries are to be visited
+ */
+typedef struct walk_task {
+    struct walk_task *parent;
+    int inumber;
+    type nodeType;
+    int depth;
+    char *path;
+    int path_len;
+    SnapCopy *copy;
+    int owned;
+    int pending; /* this task's own visit, plus unfinished subdirectories */
+    long total;
+    walk_out out;
+} walk_task;
+
+/*
+ * Tasks of one thread: it pushes and pops at the back, thieves take from
+ * the front. Padded to its own cache line.
+ */
+typedef struct walk_deque {
+    pthread_mutex_t mutex;
+    int head, count, capacity;
+    walk_task **tasks;
+} __attribute__((aligned(64))) walk_deque;
+
+typedef struct walk_state {
+    walk_visitor *visitor;
+    int max_threads;
+    int threads; /* started so far, the caller included */
+    pthread_t helpers[WALK_MAX_THREADS];
+    pthread_mutex_t spawn_mutex;
+    walk_deque deques[WALK_MAX_THREADS];
+    int outstanding; /* tasks queued or being visited */
+    int idle; /* threads looking for a task */
+    int stopped; /* a visitor returned FAIL */
+    long total; /* the root's value */
+} walk_state;
+
+/*
+ * A directory being visited by a thread, inside the task it took. It only
+ * gets a task of its own once a subdirectory below it is handed over to
+ * another thread (see walk_promote).
+ */
+typedef struct walk_frame {
+    walk_task *task; /* or NULL */
+    walk_out *out; /* where its subtree's output goes */
+    SnapCopy *copy;
+    int owned;
+    int next; /* entry */
+    char *name; /* of the entry */
+    int inumber;
+    int depth;
+    int path_len; /* of the directory */
+    long total;
+} walk_frame;
+
+/* A thread of a walk */
+typedef struct walk_worker {
+    walk_state *w;
+    int index;
+    char *path; /* of the directory or entry being visited */
+    size_t path_capacity;
+    walk_frame *frames;
+    int frame_capacity;
+} walk_worker;
+
+/* Threads a walk may use (TECNICOFS_WALK_THREADS, or one per CPU) */
+int walk_threads = 1;
+
+/*
+ * Initializes the engine, reading TECNICOFS_WALK_THREADS from the
+ * environment.
+ */
+void walk_init() {
+    char *env = getenv("TECNICOFS_WALK_THREADS");
+
+    walk_threads = env ? atoi(env) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (walk_threads < 1)
+        walk_threads = 1;
+    if (walk_threads > WALK_MAX_THREADS)
+        walk_threads = WALK_MAX_THREADS;
+}
+
+static void *walk_alloc(size_t size) {
+    void *ptr = malloc(size);
+
+    if (ptr == NULL) {
+        fprintf(stderr, "Error: could not allocate walk memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+/*
+ * Appends a new segment to an output.
+ */
+static walk_segment *walk_segment_add(walk_out *out, walk_task *child, size_t capacity) {
+    walk_segment *segment = walk_alloc(sizeof(walk_segment));
+
+    segment->next = NULL;
+    segment->child = child;
+    segment->bytes = capacity ? walk_alloc(capacity) : NULL;
+    segment->used = 0;
+    segment->capacity = capacity;
+
+    if (out->tail)
+        out->tail->next = segment;
+    else
+        out->head = segment;
+    out->tail = segment;
+    return segment;
+}
+
+/*
+ * Writes to the output of the node being visited.
+ * Input:
+ *  - out: the output passed to the visitor
+ *  - bytes: what to write
+ *  - len: how many bytes
+ */
+void walk_write(walk_out *out, const char *bytes, size_t len) {
+    walk_segment *segment = out->tail;
+
+    if (segment == NULL || segment->child != NULL) {
+        segment = walk_segment_add(out, NULL, len > WALK_SEGMENT_MIN ? len : WALK_SEGMENT_MIN);
+    }
+    else if (segment->used + len > segment->capacity) {
+        /* runs grow up to WALK_SEGMENT_MAX and then start anew */
+        if (segment->capacity >= WALK_SEGMENT_MAX) {
+            segment = walk_segment_add(out, NULL, len > WALK_SEGMENT_MAX ? len : WALK_SEGMENT_MAX);
+        }
+        else {
+            while (segment->used + len > segment->capacity)
+                segment->capacity *= 2;
+            if ((segment->bytes = realloc(segment->bytes, segment->capacity)) == NULL) {
+                fprintf(stderr, "Error: could not allocate walk memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    memcpy(segment->bytes + segment->used, bytes, len);
+    segment->used += len;
+}
+
+/*
+ * Creates the task of a directory, counted as outstanding.
+ */
+static walk_task *walk_task_create(walk_state *w, walk_task *parent, int inumber,
+        type nType, int depth, const char *path, int path_len, SnapCopy *copy, int owned) {
+    walk_task *task = walk_alloc(sizeof(walk_task) + path_len + 1);
+
+    task->parent = parent;
+    task->inumber = inumber;
+    task->nodeType = nType;
+    task->depth = depth;
+    task->path = (char *) (task + 1);
+    memcpy(task->path, path, path_len);
+    task->path[path_len] = '\0';
+    task->path_len = path_len;
+    task->copy = copy;
+    task->owned = owned;
+    task->pending = 1;
+    task->total = 0;
+    task->out.head = task->out.tail = NULL;
+
+    __atomic_fetch_add(&w->outstanding, 1, __ATOMIC_RELAXED);
+    return task;
+}
+
+static void walk_deque_push(walk_deque *d, walk_task *task) {
+    pthread_mutex_lock(&d->mutex);
+
+    if (d->count == d->capacity) {
+        int capacity = d->capacity ? d->capacity * 2 : 64;
+        walk_task **tasks = walk_alloc(sizeof(walk_task *) * capacity);
+
+        for (int i = 0; i < d->count; i++)
+            tasks[i] = d->tasks[(d->head + i) % d->capacity];
+        free(d->tasks);
+        d->tasks = tasks;
+        d->head = 0;
+        d->capacity = capacity;
+    }
+
+    d->tasks[(d->head + d->count) % d->capacity] = task;
+    __atomic_store_n(&d->count, d->count + 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&d->mutex);
+}
+
+/*
+ * Takes the newest task (owner) or the oldest one (thief) of a deque.
+ * Returns: the task, or NULL if the deque is empty
+ */
+static walk_task *walk_deque_take(walk_deque *d, int steal) {
+    walk_task *task = NULL;
+
+    if (__atomic_load_n(&d->count, __ATOMIC_RELAXED) == 0)
+        return NULL;
+
+    pthread_mutex_lock(&d->mutex);
+    if (d->count > 0) {
+        if (steal) {
+            task = d->tasks[d->head];
+            d->head = (d->head + 1) % d->capacity;
+        }
+        else {
+            task = d->tasks[(d->head + d->count - 1) % d->capacity];
+        }
+        __atomic_store_n(&d->count, d->count - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&d->mutex);
+
+    return task;
+}
+
+static void *walk_helper(void *arg);
+
+/*
+ * Starts another thread, if the walk has room for one.
+ */
+static void walk_spawn(walk_state *w) {
+    pthread_mutex_lock(&w->spawn_mutex);
+
+    int index = w->threads;
+
+    if (index < w->max_threads) {
+        walk_worker *worker = walk_alloc(sizeof(walk_worker));
+
+        *worker = (walk_worker) { w, index, NULL, 0, NULL, 0 };
+        if (pthread_create(&w->helpers[index], NULL, walk_helper, worker)) {
+            fprintf(stderr, "Error: could not create threads\n");
+            exit(EXIT_FAILURE);
+        }
+        __atomic_store_n(&w->threads, index + 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&w->spawn_mutex);
+}
+
+/*
+ * Runs leave for a task whose subtree is done, and for every ancestor it
+ * was the last to wait for.
+ */
+static void walk_finish(walk_state *w, walk_task *task) {
+    while (task != NULL) {
+        long value = 0;
+
+        if (w->visitor->leave && !__atomic_load_n(&w->stopped, __ATOMIC_RELAXED)) {
+            walk_node node = { task->inumber, task->nodeType, task->path, task->path_len,
+                task->depth, task->total };
+
+            value = w->visitor->leave(&node, &task->out, w->visitor->arg);
+        }
+        if (task->owned)
+            free(task->copy);
+        task->copy = NULL;
+
+        walk_task *parent = task->parent;
+
+        if (parent == NULL) {
+            w->total = value;
+            return;
+        }
+        __atomic_fetch_add(&parent->total, value, __ATOMIC_RELAXED);
+        if (__atomic_sub_fetch(&parent->pending, 1, __ATOMIC_ACQ_REL) != 0)
+            return;
+        task = parent;
+    }
+}
+
+/*
+ * Makes room for a path of len bytes and its terminator in a thread's
+ * buffer.
+ */
+static void walk_path_reserve(walk_worker *worker, size_t len) {
+    if (len + 1 <= worker->path_capacity)
+        return;
+
+    worker->path_capacity = len + 1 > 128 ? 2 * (len + 1) : 256;
+    if ((worker->path = realloc(worker->path, worker->path_capacity)) == NULL) {
+        fprintf(stderr, "Error: could not allocate walk memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Pushes a directory on a thread's frames.
+ */
+static void walk_frame_push(walk_worker *worker, int *depth, walk_task *task, walk_out *out,
+        SnapCopy *copy, int owned, int inumber, int node_depth, int path_len) {
+    if (*depth == worker->frame_capacity) {
+        worker->frame_capacity = worker->frame_capacity ? 2 * worker->frame_capacity : 16;
+        worker->frames = realloc(worker->frames, sizeof(walk_frame) * worker->frame_capacity);
+        if (worker->frames == NULL) {
+            fprintf(stderr, "Error: could not allocate walk memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    worker->frames[(*depth)++] = (walk_frame) { task, out, copy, owned, 0,
+        copy ? copy->names : NULL, inumber, node_depth, path_len, 0 };
+}
+
+/*
+ * Gives every frame on a thread's stack a task, so that each waits for
+ * the subtrees handed over below it before it is left, and sends the rest
+ * of its output to the task's.
+ */
+static void walk_promote(walk_worker *worker, int depth) {
+    walk_state *w = worker->w;
+
+    for (int i = 1; i < depth; i++) {
+        walk_frame *frame = &worker->frames[i];
+        walk_task *parent = worker->frames[i - 1].task;
+
+        if (frame->task != NULL)
+            continue;
+
+        /* the path in the buffer extends the frame's */
+        frame->task = walk_task_create(w, parent, frame->inumber, T_DIRECTORY, frame->depth,
+                worker->path, frame->path_len, frame->copy, frame->owned);
+        frame->owned = 0;
+        __atomic_fetch_add(&parent->pending, 1, __ATOMIC_RELAXED);
+        walk_segment_add(worker->frames[i - 1].out, frame->task, 0);
+        frame->out = &frame->task->out;
+    }
+}
+
+/*
+ * Visits the subtree of a task's directory, depth first. A subdirectory
+ * becomes a task of its own, queued for other threads, only while one of
+ * them is idle (or may still be started) and this thread has nothing
+ * queued; otherwise it is visited in place, so a walk with nobody to
+ * share it with costs no more than a plain recursive one.
+ */
+static void walk_visit(walk_worker *worker, walk_task *task) {
+    walk_state *w = worker->w;
+    walk_visitor *v = w->visitor;
+    walk_deque *d = &w->deques[worker->index];
+    int depth = 0;
+
+    walk_path_reserve(worker, task->path_len);
+    memcpy(worker->path, task->path, task->path_len + 1);
+    walk_frame_push(worker, &depth, task, &task->out, task->copy, 0, task->inumber,
+            task->depth, task->path_len);
+
+    while (depth > 0) {
+        walk_frame *frame = &worker->frames[depth - 1];
+        int stopped = __atomic_load_n(&w->stopped, __ATOMIC_RELAXED);
+
+        if (stopped || frame->copy == NULL || frame->next == frame->copy->count) {
+            walk_task *own = frame->task;
+            long value = 0;
+
+            worker->path[frame->path_len] = '\0';
+            depth--;
+
+            /* a task is left by walk_finish, once its subtree is done */
+            if (own != NULL) {
+                __atomic_fetch_add(&own->total, frame->total, __ATOMIC_RELAXED);
+                if (__atomic_sub_fetch(&own->pending, 1, __ATOMIC_ACQ_REL) == 0)
+                    walk_finish(w, own);
+                __atomic_fetch_sub(&w->outstanding, 1, __ATOMIC_RELEASE);
+                continue;
+            }
+
+            if (v->leave && !stopped) {
+                walk_node node = { frame->inumber, T_DIRECTORY, worker->path, frame->path_len,
+                    frame->depth, frame->total };
+
+                value = v->leave(&node, frame->out, v->arg);
+            }
+            if (frame->owned)
+                free(frame->copy);
+            worker->frames[depth - 1].total += value;
+            continue;
+        }
+
+        int len = (unsigned char) *frame->name;
+        int path_len = frame->path_len + 1 + len;
+
+        walk_path_reserve(worker, path_len);
+        worker->path[frame->path_len] = '/';
+        memcpy(worker->path + frame->path_len + 1, frame->name + 1, len);
+        worker->path[path_len] = '\0';
+        frame->name += 1 + len;
+
+        SnapCopy *copy;
+        int owned, inumber = frame->copy->inumbers[frame->next++];
+        type nType = inode_snapshot_read(inumber, &copy, &owned);
+        walk_node node = { inumber, nType, worker->path, path_len, frame->depth + 1, 0 };
+        int action = v->enter ? v->enter(&node, frame->out, v->arg) : WALK_DESCEND;
+
+        if (action == FAIL) {
+            __atomic_store_n(&w->stopped, 1, __ATOMIC_RELAXED);
+            if (owned)
+                free(copy);
+            continue;
+        }
+
+        if (nType == T_DIRECTORY && action == WALK_DESCEND) {
+            int threads = __atomic_load_n(&w->threads, __ATOMIC_ACQUIRE);
+
+            if (__atomic_load_n(&d->count, __ATOMIC_RELAXED) == 0 &&
+                    (__atomic_load_n(&w->idle, __ATOMIC_RELAXED) > 0 || threads < w->max_threads)) {
+                walk_promote(worker, depth);
+                frame = &worker->frames[depth - 1];
+
+                walk_task *child = walk_task_create(w, frame->task, inumber, nType,
+                        frame->depth + 1, worker->path, path_len, copy, owned);
+
+                __atomic_fetch_add(&frame->task->pending, 1, __ATOMIC_RELAXED);
+                walk_segment_add(frame->out, child, 0);
+                walk_deque_push(d, child);
+                if (threads < w->max_threads)
+                    walk_spawn(w);
+            }
+            else {
+                walk_frame_push(worker, &depth, NULL, frame->out, copy, owned, inumber,
+                        frame->depth + 1, path_len);
+            }
+            continue;
+        }
+
+        if (owned)
+            free(copy);
+        if (v->leave)
+            frame->total += v->leave(&node, frame->out, v->arg);
+    }
+}
+
+/*
+ * Serves tasks, its own first and then stolen ones, until none is left.
+ */
+static void walk_work(walk_worker *worker) {
+    walk_state *w = worker->w;
+    int idle = 0;
+
+    for (;;) {
+        walk_task *task = walk_deque_take(&w->deques[worker->index], 0);
+
+        for (int i = 1; task == NULL && i < w->max_threads; i++)
+            task = walk_deque_take(&w->deques[(worker->index + i) % w->max_threads], 1);
+
+        if (task != NULL) {
+            if (idle > 0)
+                __atomic_fetch_sub(&w->idle, 1, __ATOMIC_RELAXED);
+            walk_visit(worker, task);
+            idle = 0;
+            continue;
+        }
+
+        if (idle == 0)
+            __atomic_fetch_add(&w->idle, 1, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&w->outstanding, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        }
+        else if (++idle < 64) {
+            sched_yield();
+        }
+        else {
+            /* a long directory is keeping one thread busy */
+            struct timespec pause = { 0, 50000 };
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    free(worker->path);
+    free(worker->frames);
+}
+
+static void *walk_helper(void *arg) {
+    walk_work(arg);
+    free(arg);
+    return NULL;
+}
+
+/*
+ * Writes a task's output and its subtasks', in order, and releases them.
+ */
+static void walk_merge(walk_task *root, FILE *fp) {
+    int depth = 0, capacity = 64;
+    walk_segment **stack = walk_alloc(sizeof(walk_segment *) * capacity);
+
+    stack[depth++] = root->out.head;
+    free(root);
+
+    while (depth > 0) {
+        walk_segment *segment = stack[--depth];
+
+        if (segment == NULL)
+            continue;
+
+        if (depth + 2 > capacity) {
+            capacity *= 2;
+            if ((stack = realloc(stack, sizeof(walk_segment *) * capacity)) == NULL) {
+                fprintf(stderr, "Error: could not allocate walk memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        /* the subtree's output comes before what follows it */
+        stack[depth++] = segment->next;
+        if (segment->child) {
+            stack[depth++] = segment->child->out.head;
+            free(segment->child);
+        }
+        else if (fp != NULL) {
+            fwrite(segment->bytes, 1, segment->used, fp);
+        }
+        free(segment->bytes);
+        free(segment);
+    }
+
+    free(stack);
+}
+
+/*
+ * Walks the tree below an i-node.
+ * Input:
+ *  - inumber: identifier of the i-node, the root of the walk
+ *  - path: its path, "" for the file system's root
+ *  - visitor: what to do with each node
+ *  - fp: where the visitor's output is written, in order, or NULL
+ *  - total: if not NULL, set to the value of the root
+ * Returns: SUCCESS, or FAIL if the visitor stopped the walk
+ */
+int walk_tree(int inumber, const char *path, walk_visitor *visitor, FILE *fp, long *total) {
+    walk_state *w = walk_alloc(sizeof(walk_state));
+    walk_worker caller = { w, 0, NULL, 0, NULL, 0 };
+    SnapCopy *copy;
+    int owned;
+
+    w->visitor = visitor;
+    w->max_threads = walk_threads;
+    w->threads = 1;
+    w->outstanding = 0;
+    w->idle = 0;
+    w->stopped = 0;
+    w->total = 0;
+    pthread_mutex_init(&w->spawn_mutex, NULL);
+    for (int i = 0; i < w->max_threads; i++) {
+        pthread_mutex_init(&w->deques[i].mutex, NULL);
+        w->deques[i].head = w->deques[i].count = w->deques[i].capacity = 0;
+        w->deques[i].tasks = NULL;
+    }
+
+    type nType = inode_snapshot_read(inumber, &copy, &owned);
+    walk_task *root = walk_task_create(w, NULL, inumber, nType, 0, path, strlen(path), NULL, 0);
+    walk_node node = { inumber, nType, root->path, root->path_len, 0, 0 };
+    int action = visitor->enter ? visitor->enter(&node, &root->out, visitor->arg) : WALK_DESCEND;
+
+    if (action == FAIL)
+        w->stopped = 1;
+    if (nType == T_DIRECTORY && action == WALK_DESCEND) {
+        root->copy = copy;
+        root->owned = owned;
+    }
+    else if (owned) {
+        free(copy);
+    }
+
+    walk_visit(&caller, root);
+    walk_work(&caller);
+
+    for (int i = 1; i < w->threads; i++) {
+        if (pthread_join(w->helpers[i], NULL)) {
+            fprintf(stderr, "Error: could not join thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int result = w->stopped ? FAIL : SUCCESS;
+
+    if (total != NULL)
+        *total = w->total;
+    walk_merge(root, result == SUCCESS ? fp : NULL);
+
+    for (int i = 0; i < w->max_threads; i++) {
+        pthread_mutex_destroy(&w->deques[i].mutex);
+        free(w->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&w->spawn_mutex);
+    free(w);
+    return result;
+}
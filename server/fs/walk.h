@@ -0,0 +1,57 @@
+#ifndef WALK_H
+#define WALK_H
+
+/*
+ * Parallel traversal of the i-node tree, as of the active snapshot (see
+ * inode_snapshot_take), or as it is if there is none. A thread walks its
+ * part of the tree depth first and hands a subdirectory over as a task of
+ * its own only when another thread is idle, or may still be started, and
+ * it has no task queued already. Tasks wait on the deque of the thread
+ * that made them, which takes back its newest one when done while idle
+ * threads steal the oldest, i.e. the largest subtrees still waiting. A
+ * walk starts on the caller alone and gains threads, up to walk_threads,
+ * as it finds subdirectories to give them.
+ *
+ * A visitor sees each node once on the way down (enter) and once on the
+ * way up (leave), a directory's leave coming after those of its whole
+ * subtree. What it writes to its walk_out is merged in depth-first order
+ * however the subtrees were spread over threads: enter's output precedes
+ * the node's subtree, leave's follows it. The values leave returns are
+ * summed up the tree. Visitors run on several threads at once.
+ */
+
+#include <stdio.h>
+#include "state.h"
+
+#define WALK_MAX_THREADS 64
+#define WALK_SEGMENT_MIN 256
+#define WALK_SEGMENT_MAX (1 << 16)
+
+/* enter results */
+#define WALK_DESCEND 0
+#define WALK_PRUNE 1 /* do not visit the directory's entries */
+
+typedef struct walk_node {
+    int inumber;
+    type nodeType;
+    const char *path; /* full path, "" for the root; not kept past the call */
+    int path_len;
+    int depth; /* 0 for the root of the walk */
+    long total; /* leave: sum of what leave returned for the entries */
+} walk_node;
+
+typedef struct walk_out walk_out;
+
+typedef struct walk_visitor {
+    /* Returns WALK_DESCEND, WALK_PRUNE, or FAIL to stop the walk */
+    int (*enter)(walk_node *node, walk_out *out, void *arg);
+    /* Returns the node's value, added to its parent's total */
+    long (*leave)(walk_node *node, walk_out *out, void *arg);
+    void *arg;
+} walk_visitor;
+
+void walk_init();
+void walk_write(walk_out *out, const char *bytes, size_t len);
+int walk_tree(int inumber, const char *path, walk_visitor *visitor, FILE *fp, long *total);
+
+#endif /* WALK_H */
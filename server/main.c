@@ -1,84 +1,122 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <linux/futex.h>
+#include <linux/fcntl.h>
 #include "fs/operations.h"
+#include "pool.h"
+#include "files.h"
+#include "../tecnicofs-protocol.h"
+#include "../tecnicofs-ring.h"
 
 #define MAX_INPUT_SIZE 100
-#define INDIM 30
+#define INDIM (TFS_MAX_BATCH_MESSAGE + 1)
+/* Longest text command, "m <path> <path>" with both at the path limit */
+#define TEXT_DIM (2 * TFS_MAX_PATH + 4)
 
 int numberThreads = 0;
 
+/* Most datagrams the front end receives per system call (-m) */
+#define MAX_IO_BATCH 64
+int ioBatch = 1;
+
+#define EPOLL_EVENTS 16
+
+/*
+ * Transport (-t): datagrams (SOCK_DGRAM), or connected sessions
+ * (SOCK_SEQPACKET), one per client, that also carry long answers
+ */
+int transport = SOCK_DGRAM;
+
+/* Sessions open at once (-c), and files each may have open (-f) */
+int maxSessions = 1024;
+int maxOpenFiles = FILES_DEFAULT_LIMIT;
+int sessionCount = 0;   /* front end only */
+
+/* Shared-memory clients (seqpacket mode only, see TFS_OP_ATTACH) */
+#define MAX_ATTACHED 256
+#define RING_BATCH 64
+#define RING_WAIT_NS 100000000
+#define RING_SEND_TIMEOUT 2 /* seconds an answer waits for room */
+
+/* Image the file system persists to (-i), or NULL */
+char *imagePath = NULL;
+
+/* Microseconds a group of log records waits for more before commit (-g) */
+long commitWindow = 0;
+
 /* Socket parameters */
 char* serverName;
 int sockfd;
 
-/* Syncronization lock */
-pthread_mutex_t mutex;
-
-/* Conditional syncronization */
-pthread_cond_t other_cond, print_cond;
-int is_printing = 0;
+/*
+ * Command gate: ordinary commands enter it in shared mode and run
+ * concurrently, relying on the per-inode locks for their correctness;
+ * print and list enter it in exclusive mode just long enough to take a
+ * snapshot with no command half done, and dump the snapshot while
+ * commands go on. A checkpoint (checkpoint_fs) holds it exclusively while
+ * it flushes the image. Writers are preferred so that a pending snapshot
+ * is not starved by a steady stream of commands.
+ */
+pthread_rwlock_t gate;
 
 /* Initializes locks */
 void sync_locks_init() {
-    if (pthread_mutex_init(&mutex, NULL)) {
-        fprintf(stderr, "Error: could not initialize mutex: mutex\n");
-    }
+    pthread_rwlockattr_t attr;
 
-    if (pthread_cond_init(&other_cond, NULL)) {
-        fprintf(stderr, "Error: could not initialize condition: other_cond\n");
+    if (pthread_rwlockattr_init(&attr) ||
+            pthread_rwlockattr_setkind_np(&attr,
+                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP)) {
+        fprintf(stderr, "Error: could not initialize rwlock attributes: gate\n");
     }
-}
 
-/* Destroys locks */
-void sync_locks_destroy() {
-    if (pthread_cond_destroy(&other_cond)) {
-        fprintf(stderr, "Error: could not destroy condition: other_cond\n");
+    if (pthread_rwlock_init(&gate, &attr)) {
+        fprintf(stderr, "Error: could not initialize rwlock: gate\n");
     }
 
-    if (pthread_mutex_destroy(&mutex)) {
-        fprintf(stderr, "Error: could not destroy mutex: mutex\n");
-    }
+    pthread_rwlockattr_destroy(&attr);
 }
 
-/* Call vector -> syncronization lock enabler */
-void mutex_lock() {
-    if (pthread_mutex_lock(&mutex)) {
-        fprintf(stderr, "Error: could not lock mutex: mutex\n");
-    }
-}
-
-/* Call vector -> syncronization lock disabler */
-void mutex_unlock() {
-    if (pthread_mutex_unlock(&mutex)) {
-        fprintf(stderr, "Error: could not unlock mutex: mutex\n");
+/* Destroys locks */
+void sync_locks_destroy() {
+    if (pthread_rwlock_destroy(&gate)) {
+        fprintf(stderr, "Error: could not destroy rwlock: gate\n");
     }
 }
 
-/* Activates the conditional wait */
-void cond_wait(pthread_cond_t* other_cond, pthread_mutex_t* mutex) {
-    if (pthread_cond_wait(other_cond, mutex)) {
-        fprintf(stderr, "Error: could not block on condition variable\n");
+/* Enters the gate as an ordinary command (shared) */
+void gate_enter() {
+    if (pthread_rwlock_rdlock(&gate)) {
+        fprintf(stderr, "Error: could not lock rwlock (read-only): gate\n");
     }
 }
 
-/* Signals the conditional wait to move on */
-void signal(pthread_cond_t* other_cond) {
-    if (pthread_cond_signal(other_cond)) {
-        fprintf(stderr, "Error: could not signal the condition variable\n");
+/* Enters the gate as print, waiting for in-flight commands (exclusive) */
+void gate_enter_exclusive() {
+    if (pthread_rwlock_wrlock(&gate)) {
+        fprintf(stderr, "Error: could not lock rwlock (write): gate\n");
     }
 }
 
-/* Broadcasts (to all threads) the conditional wait to move on */
-void broadcast(pthread_cond_t* other_cond) {
-    if (pthread_cond_broadcast(other_cond)) {
-        fprintf(stderr, "Error: could not broadcast the condition variable\n");
+/* Leaves the gate */
+void gate_exit() {
+    if (pthread_rwlock_unlock(&gate)) {
+        fprintf(stderr, "Error: could not unlock rwlock: gate\n");
     }
 }
 
@@ -94,15 +132,66 @@ int setSockAddrUn(char *path, struct sockaddr_un *addr) {
 }
 
 void argumentParser(int argc, char* argv[]) {
-    if (argc != 3) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:t:c:f:i:g:")) != -1) {
+        switch (opt) {
+            case 't':
+                if (!strcmp(optarg, "dgram"))
+                    transport = SOCK_DGRAM;
+                else if (!strcmp(optarg, "seqpacket"))
+                    transport = SOCK_SEQPACKET;
+                else {
+                    fprintf(stderr, "Error: invalid transport\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                ioBatch = atoi(optarg);
+                if (ioBatch < 1 || ioBatch > MAX_IO_BATCH) {
+                    fprintf(stderr, "Error: invalid I/O batch size\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                maxSessions = atoi(optarg);
+                if (maxSessions < 1) {
+                    fprintf(stderr, "Error: invalid number of sessions\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                maxOpenFiles = atoi(optarg);
+                if (maxOpenFiles < 1 || maxOpenFiles > FILES_MAX_LIMIT) {
+                    fprintf(stderr, "Error: invalid number of open files\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                imagePath = optarg;
+                break;
+            case 'g':
+                commitWindow = atol(optarg);
+                if (commitWindow < 0 || commitWindow > 1000000) {
+                    fprintf(stderr, "Error: invalid commit window\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Error: invalid arguments\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind != 2) {
         fprintf(stderr, "Error: invalid arguments\n");
         exit(EXIT_FAILURE);
     }
 
-    numberThreads = atoi(argv[1]);
-    serverName = argv[2];
+    numberThreads = atoi(argv[optind]);
+    serverName = argv[optind + 1];
 
-    if (numberThreads < 1) {
+    if (numberThreads < 1 || numberThreads > POOL_MAX_WORKERS) {
         fprintf(stderr, "Error: invalid number of threads\n");
         exit(EXIT_FAILURE);
     }
@@ -112,7 +201,9 @@ int fsMount() {
     struct sockaddr_un server_addr;
     socklen_t addrlen;
 
-    if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    /* Only the listening socket is non-blocking, for the front end */
+    if ((sockfd = socket(AF_UNIX, transport == SOCK_SEQPACKET ?
+                    SOCK_SEQPACKET | SOCK_NONBLOCK : SOCK_DGRAM, 0)) < 0) {
         fprintf(stderr, "server: can't open socket\n");
         exit(EXIT_FAILURE);
     }
@@ -125,6 +216,11 @@ int fsMount() {
         exit(EXIT_FAILURE);
     }
 
+    if (transport == SOCK_SEQPACKET && listen(sockfd, SOMAXCONN) < 0) {
+        fprintf(stderr, "server: listen error\n");
+        exit(EXIT_FAILURE);
+    }
+
     return 0;
 }
 
@@ -142,45 +238,287 @@ int fsUnmount() {
     return 0;
 }
 
-int applyCommands(const char* command) {
-    char token;
-    char name[MAX_INPUT_SIZE], type[MAX_INPUT_SIZE];
-    int numTokens = sscanf(command, "%c %s %s", &token, name, type);
+/*
+ * A decoded request. For binary requests name and arg point into the
+ * receive buffer; for text requests into the buffers given to parseText.
+ */
+typedef struct command {
+    char token;     /* 'c', 'l', 'd', 'm', 'p', or 'o', 'r', 'w', 't', 'x', 'e', 's' */
+    char type;      /* 'f', 'd' or 'p' (with parents), for create; 'r'
+                       (recursive) or 0, for delete; the permission, for open */
+    char *name;
+    char *arg;      /* new path, for move; bytes, for write */
+    long size;      /* new size, for truncate; cursor, for readdir */
+    int length;     /* for read and write; most entries, for readdir */
+    int handle;     /* for file requests but open */
+} command;
 
-    if (numTokens < 2) {
-        fprintf(stderr, "Error: invalid command in Queue\n");
-        exit(EXIT_FAILURE);
+/* Parse cost of each wire format, reported after every print */
+typedef struct parse_stats {
+    unsigned long requests;
+    unsigned long nanoseconds;
+} parse_stats;
+
+parse_stats textStats, binaryStats;
+
+static unsigned long elapsedNanoseconds(struct timespec *start,
+        struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000UL +
+        end->tv_nsec - start->tv_nsec;
+}
+
+void parseStatsAdd(parse_stats *stats, int requests, struct timespec *start,
+        struct timespec *end) {
+    __atomic_fetch_add(&stats->requests, requests, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->nanoseconds, elapsedNanoseconds(start, end),
+            __ATOMIC_RELAXED);
+}
+
+void parseStatsPrint() {
+    unsigned long text = __atomic_load_n(&textStats.requests, __ATOMIC_RELAXED);
+    unsigned long binary = __atomic_load_n(&binaryStats.requests, __ATOMIC_RELAXED);
+
+    printf("Parse: text %lu requests, %.1f ns avg; binary %lu requests, %.1f ns avg\n",
+            text, text ? (double) textStats.nanoseconds / text : 0.0,
+            binary, binary ? (double) binaryStats.nanoseconds / binary : 0.0);
+    fflush(stdout);
+}
+
+/* System calls made on the socket, and requests received */
+unsigned long ioSyscalls, ioRequests;
+
+void ioStatsPrint() {
+    unsigned long syscalls = __atomic_load_n(&ioSyscalls, __ATOMIC_RELAXED);
+    unsigned long requests = __atomic_load_n(&ioRequests, __ATOMIC_RELAXED);
+
+    unsigned long served, stolen;
+
+    pool_stats(&served, &stolen);
+    printf("I/O: %lu syscalls for %lu requests (%.2f per request)\n",
+            syscalls, requests, requests ? (double) syscalls / requests : 0.0);
+    printf("Pool: %lu requests served, %lu stolen\n", served, stolen);
+    fflush(stdout);
+}
+
+/*
+ * Parses a legacy text command ("c /a f", "m /a /b", ...).
+ * Input:
+ *  - message: the '\0'-terminated command
+ *  - cmd: decoded command, pointing into name and arg
+ *  - name, arg: buffers of TEXT_DIM chars, room for the whole message
+ * Returns: SUCCESS or FAIL
+ */
+int parseText(char *message, command *cmd, char *name, char *arg) {
+    char type[TEXT_DIM];
+    int numTokens = sscanf(message, "%c %s %s", &cmd->token, name, type);
+
+    /* the same limit checkPath puts on binary requests */
+    if (numTokens < 2 || strlen(name) >= TFS_MAX_PATH ||
+            (numTokens == 3 && strlen(type) >= TFS_MAX_PATH))
+        return FAIL;
+
+    cmd->name = name;
+    cmd->arg = arg;
+    cmd->type = 0;
+
+    switch (cmd->token) {
+        case 'c':
+            if (numTokens != 3 || (type[0] != 'f' && type[0] != 'd' && type[0] != 'p'))
+                return FAIL;
+            cmd->type = type[0];
+            return SUCCESS;
+        case 'd':
+            if (numTokens == 3 && type[0] != 'r')
+                return FAIL;
+            cmd->type = numTokens == 3 ? 'r' : 0;
+            return SUCCESS;
+        case 'm':
+            if (numTokens != 3)
+                return FAIL;
+            strcpy(arg, type);
+            return SUCCESS;
+        case 'l':
+        case 'p':
+            return SUCCESS;
+        default:
+            return FAIL;
+    }
+}
+
+/*
+ * Checks that a path of a binary request lies inside the message and is
+ * '\0'-terminated exactly at its end.
+ * Input:
+ *  - path: start of the path
+ *  - len: declared length, terminator included
+ *  - end: end of the message
+ * Returns: SUCCESS or FAIL
+ */
+static int checkPath(char *path, uint16_t len, char *end) {
+    if (len == 0 || len > TFS_MAX_PATH || len > end - path)
+        return FAIL;
+    return memchr(path, '\0', len) == path + len - 1 ? SUCCESS : FAIL;
+}
+
+/*
+ * Decodes one binary request in place: the paths are not copied.
+ * Input:
+ *  - message: start of the request
+ *  - end: end of the received data
+ *  - cmd: decoded command, pointing into message
+ * Returns: end of the request, or NULL if it is invalid
+ */
+static char *decodeRequest(char *message, char *end, command *cmd) {
+    tfs_request *request = (tfs_request *) message;
+    char *path = message + sizeof(tfs_request);
+
+    static const char tokens[] = { 'c', 'd', 'l', 'm', 'p' };
+
+    if (end - message < sizeof(tfs_request) ||
+            request->opcode < TFS_OP_CREATE || request->opcode > TFS_OP_PRINT)
+        return NULL;
+
+    cmd->token = tokens[request->opcode - TFS_OP_CREATE];
+    if (request->opcode == TFS_OP_DELETE)
+        cmd->type = request->flags & TFS_FLAG_RECURSIVE ? 'r' : 0;
+    else if (request->flags & TFS_FLAG_PARENTS)
+        cmd->type = 'p';
+    else
+        cmd->type = request->flags & TFS_FLAG_DIRECTORY ? 'd' : 'f';
+
+    if (checkPath(path, request->path_len[0], end) == FAIL)
+        return NULL;
+    cmd->name = path;
+    path += request->path_len[0];
+
+    if (request->opcode == TFS_OP_MOVE) {
+        if (checkPath(path, request->path_len[1], end) == FAIL)
+            return NULL;
+        cmd->arg = path;
+        path += request->path_len[1];
+    }
+
+    return path;
+}
+
+/*
+ * Decodes a single binary request.
+ * Input:
+ *  - message: the received request
+ *  - size: number of bytes received
+ *  - cmd: decoded command, pointing into message
+ * Returns: SUCCESS or FAIL
+ */
+int parseBinary(char *message, int size, command *cmd) {
+    return decodeRequest(message, message + size, cmd) == message + size ?
+        SUCCESS : FAIL;
+}
+
+/*
+ * Decodes every request of a batch.
+ * Input:
+ *  - message: the received batch
+ *  - size: number of bytes received
+ *  - cmds: decoded commands, TFS_MAX_BATCH of them
+ * Returns: number of commands, or FAIL
+ */
+int parseBatch(char *message, int size, command *cmds) {
+    tfs_request *request = (tfs_request *) message;
+    char *end = message + size;
+    char *next = message + sizeof(tfs_request);
+    int count = request->path_len[0];
+
+    if (count < 1 || count > TFS_MAX_BATCH)
+        return FAIL;
+
+    for (int i = 0; i < count; i++) {
+        if ((next = decodeRequest(next, end, &cmds[i])) == NULL)
+            return FAIL;
+        next = message + TFS_ALIGN(next - message);
+    }
+
+    return next == end ? count : FAIL;
+}
+
+/*
+ * Decodes a file request (OPEN to STAT) in place.
+ * Input:
+ *  - message: the received request
+ *  - size: number of bytes received
+ *  - cmd: decoded command, pointing into message
+ * Returns: SUCCESS or FAIL
+ */
+int parseFile(char *message, int size, command *cmd) {
+    tfs_request *request = (tfs_request *) message;
+    char *end = message + size;
+    char *next = message + sizeof(tfs_request) + sizeof(tfs_io);
+    tfs_io io;
+
+    static const char tokens[] = { 'o', 'r', 'w', 't', 'x', 'e', 's' };
+
+    if (size < sizeof(tfs_request) + sizeof(tfs_io))
+        return FAIL;
+
+    /* not necessarily aligned in the message */
+    memcpy(&io, message + sizeof(tfs_request), sizeof(io));
+
+    cmd->token = tokens[request->opcode - TFS_OP_OPEN];
+    cmd->type = request->flags;
+    cmd->size = io.size;
+    cmd->length = io.length <= INT32_MAX ? io.length : INT32_MAX;
+    cmd->handle = io.handle <= INT32_MAX ? io.handle : -1;
+
+    if (request->opcode == TFS_OP_OPEN || request->opcode == TFS_OP_READDIR ||
+            request->opcode == TFS_OP_STAT) {
+        if (checkPath(next, request->path_len[0], end) == FAIL)
+            return FAIL;
+        cmd->name = next;
+        next += request->path_len[0];
+    }
+
+    if (request->opcode == TFS_OP_WRITE) {
+        if (request->path_len[1] > TFS_MAX_IO)
+            return FAIL;
+        cmd->arg = next;
+        cmd->length = request->path_len[1];
+        next += request->path_len[1];
     }
 
+    return next == end ? SUCCESS : FAIL;
+}
+
+int applyCommands(command *cmd) {
     int searchResult;
-    switch (token) {
+    switch (cmd->token) {
         case 'c':
-            switch (type[0]) {
+            switch (cmd->type) {
                 case 'f':
-                    return create(name, T_FILE);
+                    return create(cmd->name, T_FILE);
                 case 'd':
-                    return create(name, T_DIRECTORY);
+                    return create(cmd->name, T_DIRECTORY);
+                case 'p':
+                    return create_parents(cmd->name);
                 default:
                     fprintf(stderr, "Error: invalid node type\n");
                     exit(EXIT_FAILURE);
             }
 
         case 'l':
-            searchResult = lookup(name);
+            searchResult = lookup(cmd->name);
             if (searchResult >= 0) {
-                printf("Search: %s found\n", name);
+                printf("Search: %s found\n", cmd->name);
                 return searchResult;
             }
             else {
-                printf("Search: %s not found\n", name);
+                printf("Search: %s not found\n", cmd->name);
                 return searchResult;
             }
 
         case 'd':
-            return delete(name);
+            return cmd->type == 'r' ? delete_recursive(cmd->name) : delete(cmd->name);
 
         case 'm':
-            return move(name, type);
+            return move(cmd->name, cmd->arg);
 
         default: { /* error */
                      fprintf(stderr, "Error: command to apply\n");
@@ -191,95 +529,975 @@ int applyCommands(const char* command) {
     return 0;
 }
 
-int applyOther(const char* command) {
-    mutex_lock();
-    while (is_printing) {
-        cond_wait(&other_cond, &mutex);
-    }
+int applyOther(command *cmd) {
+    gate_enter();
+    int answer = applyCommands(cmd);
+    gate_exit();
 
-    int answer = applyCommands(command);
+    /* whoever finds the log full flushes the image, with no command in
+     * flight; the others see it emptied once they get in */
+    if (checkpoint_due()) {
+        gate_enter_exclusive();
+        checkpoint_fs();
+        gate_exit();
+    }
 
-    mutex_unlock();
     return answer;
 }
 
-int applyPrint(const char* command) {
-    char token;
-    char filename[MAX_INPUT_SIZE];
+/*
+ * Takes a snapshot of the tree, for print or list, between commands.
+ * Released with snapshot_release.
+ */
+void takeSnapshot() {
+    snapshot_reserve();
+    gate_enter_exclusive();
+    snapshot_take();
+    gate_exit();
+}
+
+int applyPrint(command *cmd) {
+    takeSnapshot();
+    int answer = print(cmd->name);
+    snapshot_release();
 
-    sscanf(command, "%c %s", &token, filename);
-    int answer = print(filename);
-    broadcast(&other_cond);
+    parseStatsPrint();
+    ioStatsPrint();
 
     return answer;
 }
 
-void *receiveCommands() {
-    struct sockaddr_un client_addr;
+/*
+ * Runs the commands of a batch in order.
+ * Input:
+ *  - cmds: the commands
+ *  - count: number of commands
+ *  - stopOnFailure: whether a negative result ends the batch
+ *  - results: result of every command run
+ * Returns: number of commands run
+ */
+int applyBatch(command *cmds, int count, int stopOnFailure, int32_t *results) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        results[i] = cmds[i].token == 'p' ? applyPrint(&cmds[i]) :
+            applyOther(&cmds[i]);
+        if (stopOnFailure && results[i] < 0)
+            return i + 1;
+    }
+
+    return count;
+}
+
+struct session;
+
+/* What an epoll event is about: a session's socket, or its request ring */
+typedef struct watch {
+    struct session *s;
+    int ring;
+} watch;
+
+/*
+ * A client connected in seqpacket mode. Referenced by the front end while
+ * the connection is open and by every job of the session in flight.
+ */
+typedef struct session {
+    int fd;
+    int refs;
+    int closed;
+    int stalled;    /* its client stopped taking answers off the ring */
+    watch socket_watch, ring_watch;
+
+    file_table *files;
+
+    /* Shared-memory rings, once attached (TFS_OP_ATTACH) */
+    tfs_ring_pair *rings;
+    int request_event, response_event;
+    pthread_mutex_t response_lock;  /* workers share the answer ring */
+} session;
+
+static void sessionRelease(session *s) {
+    if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (s->rings != NULL) {
+            munmap(s->rings, sizeof(tfs_ring_pair));
+            close(s->request_event);
+            close(s->response_event);
+        }
+        if (s->files != NULL)
+            file_table_destroy(s->files);
+        pthread_mutex_destroy(&s->response_lock);
+        close(s->fd);
+        free(s);
+    }
+}
+
+/*
+ * Queues an answer on a session's answer ring, waiting for room while the
+ * client catches up, and wakes the client if it sleeps. A client that
+ * leaves no room for RING_SEND_TIMEOUT seconds is taken as stalled: its
+ * answers are dropped and its socket shut down, so the front end ends the
+ * session, rather than it keeping workers waiting.
+ * Input:
+ *  - s: the session
+ *  - iov, iovlen: the answer
+ * Returns: SUCCESS, or FAIL if the client has gone away or stalled
+ */
+static int ringSend(session *s, struct iovec *iov, int iovlen) {
+    tfs_ring *ring = &s->rings->responses;
+    struct timespec timeout = { 0, RING_WAIT_NS }, now, deadline;
+    uint64_t one = 1;
+    int result = SUCCESS;
+
+    pthread_mutex_lock(&s->response_lock);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += RING_SEND_TIMEOUT;
+
+    while (tfs_ring_push(ring, iov, iovlen) < 0) {
+        uint32_t consumed = __atomic_load_n(&ring->consumed, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&s->closed, __ATOMIC_ACQUIRE) ||
+                __atomic_load_n(&s->stalled, __ATOMIC_ACQUIRE)) {
+            result = FAIL;
+            break;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec &&
+                    now.tv_nsec >= deadline.tv_nsec)) {
+            fprintf(stderr, "Error: client stopped taking answers, closing session\n");
+            __atomic_store_n(&s->stalled, 1, __ATOMIC_RELEASE);
+            shutdown(s->fd, SHUT_RDWR);
+            result = FAIL;
+            break;
+        }
+
+        __atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (tfs_ring_push(ring, iov, iovlen) == 0) {
+            __atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_SEQ_CST);
+            break;
+        }
+        __atomic_fetch_add(&ioSyscalls, 1, __ATOMIC_RELAXED);
+        syscall(SYS_futex, &ring->consumed, FUTEX_WAIT, consumed, &timeout,
+                NULL, 0);
+        __atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+    pthread_mutex_unlock(&s->response_lock);
+
+    if (result == SUCCESS &&
+            __atomic_load_n(&ring->consumer_waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(&ioSyscalls, 1, __ATOMIC_RELAXED);
+        if (write(s->response_event, &one, sizeof(one)) < 0)
+            result = FAIL;
+    }
+    return result;
+}
+
+/* Where the answers to a request go: its session, or a datagram address */
+typedef struct channel {
+    session *s;
+    struct sockaddr_un addr;
     socklen_t addrlen;
-    char in_buffer[INDIM];
-    int c;
+} channel;
+
+/*
+ * Sends one answer message down a channel.
+ * Input:
+ *  - ch: the channel
+ *  - iov, iovlen: the message
+ * Returns: SUCCESS, or FAIL if the session's client has gone away
+ */
+int channelSend(channel *ch, struct iovec *iov, int iovlen) {
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovlen;
+
+    if (ch->s != NULL && __atomic_load_n(&ch->s->rings, __ATOMIC_ACQUIRE))
+        return ringSend(ch->s, iov, iovlen);
+
+    __atomic_fetch_add(&ioSyscalls, 1, __ATOMIC_RELAXED);
+
+    if (ch->s != NULL)
+        return sendmsg(ch->s->fd, &msg, MSG_NOSIGNAL) < 0 ? FAIL : SUCCESS;
+
+    msg.msg_name = &ch->addr;
+    msg.msg_namelen = ch->addrlen;
+    if (sendmsg(sockfd, &msg, 0) < 0) {
+        fprintf(stderr,"client: sendto error\n");
+        exit(EXIT_FAILURE);
+    }
+    return SUCCESS;
+}
+
+/* A LIST answer being streamed: what is written goes out in chunks */
+typedef struct list_stream {
+    channel *ch;
+    uint32_t request_id;
+} list_stream;
+
+static ssize_t listWrite(void *cookie, const char *buf, size_t size) {
+    list_stream *ls = cookie;
+    tfs_response header = { ls->request_id, TFS_PARTIAL };
+    struct iovec iov[2];
+    size_t sent = 0;
+
+    while (sent < size) {
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = (char *) buf + sent;
+        iov[1].iov_len = size - sent < TFS_MAX_CHUNK ? size - sent : TFS_MAX_CHUNK;
+
+        if (channelSend(ls->ch, iov, 2) == FAIL)
+            return -1;
+        sent += iov[1].iov_len;
+    }
+    return size;
+}
+
+/*
+ * Streams the tree listing to the client, in TFS_PARTIAL chunks.
+ * Input:
+ *  - ch: channel of the request
+ *  - request_id: id of the request
+ * Returns: SUCCESS or FAIL
+ */
+int applyList(channel *ch, uint32_t request_id) {
+    cookie_io_functions_t io = { NULL, listWrite, NULL, NULL };
+    list_stream ls = { ch, request_id };
+    FILE *stream = fopencookie(&ls, "w", io);
+
+    if (stream == NULL)
+        return FAIL;
+    setvbuf(stream, NULL, _IOFBF, TFS_MAX_CHUNK);
+
+    takeSnapshot();
+    print_tecnicofs_tree(stream);
+    snapshot_release();
+
+    return fclose(stream) ? FAIL : SUCCESS;
+}
+
+/*
+ * Reads from an open file at its offset, streaming the bytes read in
+ * TFS_PARTIAL answers but for the last chunk, which is left in data.
+ * Input:
+ *  - f: the open file, acquired
+ *  - ch: channel of the request
+ *  - request_id: id of the request
+ *  - length: most bytes to read
+ *  - data: where the last chunk is left, TFS_MAX_IO bytes
+ *  - last: set to the size of the last chunk
+ * Returns: number of bytes read, or an error code
+ */
+static int readFile(file_handle *f, channel *ch, uint32_t request_id,
+        int length, char *data, int *last) {
+    tfs_response header = { request_id, TFS_PARTIAL };
+    struct iovec iov[2];
+    int total = 0, n;
+
+    *last = 0;
+    for (;;) {
+        int want = length - total < TFS_MAX_IO ? length - total : TFS_MAX_IO;
+
+        /* The gate is left between chunks: a slow client holds no print */
+        gate_enter();
+        n = read_file(f->inumber, f->offset, data, want);
+        gate_exit();
+
+        if (n < 0)
+            return n;
+        f->offset += n;
+        total += n;
+        if (n < want || total == length)
+            break;
+
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = data;
+        iov[1].iov_len = n;
+        if (channelSend(ch, iov, 2) == FAIL)
+            return TECNICOFS_ERROR_CONNECTION_ERROR;
+    }
+
+    *last = n;
+    return total;
+}
+
+/*
+ * Lists a page of a directory into an answer: the next cursor, then each
+ * entry as a tfs_dirent and its name.
+ * Input:
+ *  - cmd: the command
+ *  - data: where the answer is written, TFS_MAX_IO bytes
+ *  - bytes: set to the number of bytes written
+ * Returns: the number of bytes written, or an error code
+ */
+static int readDir(command *cmd, char *data, int *bytes) {
+    DirListing entries[TFS_MAX_DIRENTS];
+    char names[TFS_MAX_IO];
+    uint64_t cursor = (uint64_t) cmd->size;
+    int max = cmd->length < TFS_MAX_DIRENTS ? cmd->length : TFS_MAX_DIRENTS;
+    int count, offset = sizeof(cursor);
+
+    if (max < 1)
+        return TECNICOFS_ERROR_OTHER;
+
+    /* a name costs a terminator in names and a tfs_dirent less one byte
+     * in the answer */
+    gate_enter();
+    count = read_dir(cmd->name, &cursor, entries, max, names,
+            TFS_MAX_IO - sizeof(cursor) - max * (sizeof(tfs_dirent) - 1));
+    gate_exit();
+
+    if (count < 0)
+        return count;
+
+    memcpy(data, &cursor, sizeof(cursor));
+    for (int i = 0; i < count; i++) {
+        tfs_dirent entry = { entries[i].inumber, strlen(entries[i].name),
+            entries[i].nodeType };
+
+        memcpy(data + offset, &entry, sizeof(entry));
+        memcpy(data + offset + sizeof(entry), entries[i].name, entry.name_len);
+        offset += sizeof(entry) + entry.name_len;
+    }
+
+    *bytes = offset;
+    return offset;
+}
+
+/*
+ * Reads the metadata of a node into an answer, as a tfs_stat.
+ * Input:
+ *  - cmd: the command
+ *  - data: where the answer is written
+ *  - bytes: set to the number of bytes written
+ * Returns: the number of bytes written, or an error code
+ */
+static int statNode(command *cmd, char *data, int *bytes) {
+    InodeStat st;
+
+    gate_enter();
+    int inumber = stat_node(cmd->name, &st);
+    gate_exit();
+
+    if (inumber < 0)
+        return inumber;
+
+    tfs_stat answer = { st.version, st.size, st.ctime, st.mtime, inumber, st.nlink,
+        st.nodeType, 0 };
+
+    memcpy(data, &answer, sizeof(answer));
+    *bytes = sizeof(answer);
+    return sizeof(answer);
+}
+
+/*
+ * Runs a file request against the open-file table of its session (but
+ * READDIR and STAT, which need none).
+ * Input:
+ *  - cmd: the command
+ *  - ch: channel of the request
+ *  - request_id: id of the request
+ *  - data: where read bytes are left, TFS_MAX_IO of them
+ *  - read: set to the number of bytes left in data
+ * Returns: the result of the request
+ */
+int applyFile(command *cmd, channel *ch, uint32_t request_id, char *data,
+        int *read) {
+    file_table *table = ch->s != NULL ? ch->s->files : NULL;
+    file_handle *f;
     int answer;
 
-    addrlen = sizeof(struct sockaddr_un);
+    *read = 0;
+    if (cmd->token == 'e')
+        return readDir(cmd, data, read);
+    if (cmd->token == 's')
+        return statNode(cmd, data, read);
+    if (table == NULL)
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
 
-    while (1) {
-        c = recvfrom(sockfd, in_buffer, sizeof(in_buffer)-1, 0,
-                (struct sockaddr *) &client_addr, &addrlen);
+    if (cmd->token == 'o') {
+        if (cmd->type != READ && cmd->type != WRITE && cmd->type != RW)
+            return TECNICOFS_ERROR_INVALID_MODE;
+
+        gate_enter();
+        int inumber = open_file(cmd->name);
+        gate_exit();
+
+        if (inumber < 0)
+            return inumber;
+        if ((answer = file_table_open(table, inumber, cmd->type)) < 0)
+            close_file(inumber);
+        return answer;
+    }
+
+    if (cmd->token == 'x')
+        return file_table_close(table, cmd->handle);
+
+    if ((f = file_table_acquire(table, cmd->handle)) == NULL)
+        return TECNICOFS_ERROR_FILE_NOT_OPEN;
+
+    switch (cmd->token) {
+        case 'r':
+            if (!(f->mode & READ))
+                answer = TECNICOFS_ERROR_INVALID_MODE;
+            else
+                answer = readFile(f, ch, request_id, cmd->length, data, read);
+            break;
+        case 'w':
+            if (!(f->mode & WRITE))
+                answer = TECNICOFS_ERROR_INVALID_MODE;
+            else {
+                gate_enter();
+                answer = write_file(f->inumber, f->offset, cmd->arg, cmd->length);
+                gate_exit();
+                if (answer > 0)
+                    f->offset += answer;
+            }
+            break;
+        default:
+            if (!(f->mode & WRITE))
+                answer = TECNICOFS_ERROR_INVALID_MODE;
+            else {
+                gate_enter();
+                answer = truncate_file(f->inumber, cmd->size);
+                gate_exit();
+            }
+    }
 
-        if (c <= 0) continue;
+    file_table_release(f);
+    return answer;
+}
 
-        in_buffer[c]='\0';
+/* Answer to a request: an int for text requests, a tfs_response (and
+ * the results of a batch, or the bytes read) for binary ones */
+typedef struct reply {
+    tfs_response header;
+    union {
+        int32_t results[TFS_MAX_BATCH];
+        char data[TFS_MAX_IO];
+    };
+} reply;
 
-        if (in_buffer[0] == 'p') {
-            mutex_lock();
-            is_printing = 1;
-            mutex_unlock();
-            answer = applyPrint(in_buffer);
-            mutex_lock();
-            is_printing = 0;
-            mutex_unlock();
+/*
+ * Serves one request and sends its answer.
+ * Input:
+ *  - message: the request, with room for a terminator after it
+ *  - size: size of the request
+ *  - ch: where the answer goes
+ */
+void serveRequest(char *message, int size, channel *ch) {
+    tfs_request *request = (tfs_request *) message;
+    char name[TEXT_DIM], arg[TEXT_DIM];
+    struct timespec start, end;
+    command cmds[TFS_MAX_BATCH];
+    int binary, hello, batch, list, file, parsed = FAIL;
+    int answer, executed = 0, read = 0;
+    struct iovec iov;
+    reply out;
+
+    message[size] = '\0';
+
+    /* Binary opcodes have the high bit set; text commands are letters */
+    binary = (unsigned char) message[0] >= TFS_OP_HELLO;
+    hello = binary && size >= sizeof(tfs_request) &&
+        request->opcode == TFS_OP_HELLO;
+    batch = binary && size >= sizeof(tfs_request) &&
+        request->opcode == TFS_OP_BATCH;
+    list = binary && size == sizeof(tfs_request) &&
+        request->opcode == TFS_OP_LIST;
+    file = binary && size >= sizeof(tfs_request) &&
+        request->opcode >= TFS_OP_OPEN && request->opcode <= TFS_OP_STAT;
+
+    if (!hello && !list) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (batch)
+            parsed = parseBatch(message, size, cmds);
+        else if (file)
+            parsed = parseFile(message, size, &cmds[0]);
+        else if (binary)
+            parsed = parseBinary(message, size, &cmds[0]);
+        else if (size < TEXT_DIM)
+            parsed = parseText(message, &cmds[0], name, arg);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        parseStatsAdd(binary ? &binaryStats : &textStats,
+                batch && parsed > 0 ? parsed : 1, &start, &end);
+    }
+
+    if (hello)
+        /* Agree on the smaller of both path limits */
+        answer = request->path_len[0] < TFS_MAX_PATH ?
+            request->path_len[0] : TFS_MAX_PATH;
+    else if (list)
+        answer = applyList(ch, request->request_id);
+    else if (parsed == FAIL) {
+        fprintf(stderr, "Error: invalid request\n");
+        answer = TECNICOFS_ERROR_OTHER;
+    }
+    else if (batch)
+        answer = executed = applyBatch(cmds, parsed,
+                request->flags & TFS_FLAG_STOP_ON_FAILURE, out.results);
+    else if (file)
+        answer = applyFile(&cmds[0], ch, request->request_id, out.data, &read);
+    else if (cmds[0].token == 'p')
+        answer = applyPrint(&cmds[0]);
+    else
+        answer = applyOther(&cmds[0]);
+
+    if (!binary) {
+        iov.iov_base = &answer;
+        iov.iov_len = sizeof(int);
+    }
+    else {
+        out.header.request_id = size >= sizeof(tfs_request) ?
+            request->request_id : 0;
+        out.header.result = answer;
+        iov.iov_base = &out;
+        iov.iov_len = sizeof(tfs_response) + executed * sizeof(int32_t) + read;
+    }
+
+    channelSend(ch, &iov, 1);
+}
+
+/* A received request, queued for the workers */
+typedef struct job {
+    channel ch;
+    int size;
+    char data[] __attribute__((aligned(8)));
+} job;
+
+/* Serves a job on a worker */
+void serveJob(void *item) {
+    job *j = item;
+
+    serveRequest(j->data, j->size, &j->ch);
+
+    if (j->ch.s != NULL)
+        sessionRelease(j->ch.s);
+    free(j);
+}
+
+/*
+ * Copies a received request into a job and queues it for the workers.
+ * Input:
+ *  - data, size: the request
+ *  - s: its session, or NULL for datagrams
+ *  - addr, addrlen: its sender, for datagrams
+ */
+static void submitJob(char *data, int size, session *s,
+        struct sockaddr_un *addr, socklen_t addrlen) {
+    /* Room for the terminator serveRequest puts after the data */
+    job *j = malloc(sizeof(job) + size + 1);
+
+    if (j == NULL) {
+        fprintf(stderr, "Error: could not allocate request\n");
+        exit(EXIT_FAILURE);
+    }
+
+    j->ch.s = s;
+    if (s != NULL)
+        __atomic_fetch_add(&s->refs, 1, __ATOMIC_RELAXED);
+    else {
+        j->ch.addr = *addr;
+        j->ch.addrlen = addrlen;
+    }
+    j->size = size;
+    memcpy(j->data, data, size);
+
+    __atomic_fetch_add(&ioRequests, 1, __ATOMIC_RELAXED);
+    pool_submit(j);
+}
+
+/* Receive buffer of one datagram */
+typedef struct message {
+    char data[INDIM];
+} message;
+
+/*
+ * Receives every queued datagram, up to ioBatch per recvmmsg, and hands
+ * them to the workers.
+ * Input:
+ *  - in, addrs, msgs, iovs: ioBatch receive buffers and headers
+ */
+static void drainSocket(message *in, struct sockaddr_un *addrs,
+        struct mmsghdr *msgs, struct iovec *iovs) {
+    int i, received;
+
+    do {
+        for (i = 0; i < ioBatch; i++) {
+            iovs[i].iov_base = in[i].data;
+            iovs[i].iov_len = INDIM - 1;
+            memset(&msgs[i], 0, sizeof(struct mmsghdr));
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
         }
-        else
-            answer = applyOther(in_buffer);
 
-        if (sendto(sockfd, &answer, sizeof(int), 0, 
-                (struct sockaddr *) &client_addr, addrlen) < 0) {
-            fprintf(stderr,"client: sendto error\n");
+        received = recvmmsg(sockfd, msgs, ioBatch, MSG_DONTWAIT, NULL);
+        __atomic_fetch_add(&ioSyscalls, 1, __ATOMIC_RELAXED);
+
+        for (i = 0; i < received; i++)
+            submitJob(in[i].data, msgs[i].msg_len, NULL, &addrs[i],
+                    msgs[i].msg_hdr.msg_namelen);
+    } while (received == ioBatch);
+}
+
+/* Sessions attached to shared-memory rings, polled by the front end */
+session *attached[MAX_ATTACHED];
+int attachedCount = 0;
+
+/*
+ * Accepts every pending connection as a new session.
+ * Input:
+ *  - epfd: epoll instance the sessions are watched by
+ */
+static void acceptSessions(int epfd) {
+    struct epoll_event event;
+    int fd;
+
+    /* Sessions stay blocking: workers wait for room to send answers */
+    while ((fd = accept(sockfd, NULL, NULL)) >= 0) {
+        session *s;
+
+        __atomic_fetch_add(&ioSyscalls, 1, __ATOMIC_RELAXED);
+
+        /* Over the limit, the client finds its session closed */
+        if (sessionCount == maxSessions) {
+            fprintf(stderr, "Error: too many sessions\n");
+            close(fd);
+            continue;
+        }
+
+        if ((s = calloc(1, sizeof(session))) == NULL ||
+                (s->files = file_table_create(maxOpenFiles)) == NULL) {
+            fprintf(stderr, "Error: could not allocate session\n");
             exit(EXIT_FAILURE);
         }
+        sessionCount++;
+        s->fd = fd;
+        s->refs = 1;
+        s->socket_watch.s = s->ring_watch.s = s;
+        s->ring_watch.ring = 1;
+        pthread_mutex_init(&s->response_lock, NULL);
 
+        event.events = EPOLLIN;
+        event.data.ptr = &s->socket_watch;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            fprintf(stderr, "Error: could not watch session\n");
+            sessionRelease(s);
+        }
     }
-    return NULL;
+    __atomic_fetch_add(&ioSyscalls, 1, __ATOMIC_RELAXED);
 }
 
-/* process pool initializer and runner */
-void processPool() {
-    int i;
-    pthread_t tid[numberThreads];
+/*
+ * Moves a session onto the shared-memory rings the client sent
+ * (TFS_OP_ATTACH), and answers on the socket.
+ * Input:
+ *  - s: the session
+ *  - epfd: epoll instance the session is watched by
+ *  - request: the ATTACH request
+ *  - fds: memfd, sealed against shrinking and growing, request eventfd
+ *    and answer eventfd
+ */
+static void attachSession(session *s, int epfd, tfs_request *request,
+        int *fds) {
+    tfs_response response = { request->request_id, TECNICOFS_ERROR_OTHER };
+    struct epoll_event event;
+    struct stat st;
+    void *rings = MAP_FAILED;
 
-    for (i = 0; i < numberThreads; i++) {
-        if (pthread_create(&tid[i], NULL, receiveCommands, NULL)) {
-            fprintf(stderr, "Error: could not create threads\n");
-            exit(EXIT_FAILURE);
+    /* an unsealed memfd could be shrunk under the mapping, and the next
+     * ring access would kill the server with SIGBUS */
+    /* fcntl.h would clash with file_handle (files.h) */
+    int seals = syscall(SYS_fcntl, fds[0], F_GET_SEALS);
+
+    if (s->rings == NULL && attachedCount < MAX_ATTACHED && seals >= 0 &&
+            (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) == (F_SEAL_SHRINK | F_SEAL_GROW) &&
+            fstat(fds[0], &st) == 0 && st.st_size == sizeof(tfs_ring_pair))
+        rings = mmap(NULL, sizeof(tfs_ring_pair), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+
+    event.events = EPOLLIN;
+    event.data.ptr = &s->ring_watch;
+    if (rings == MAP_FAILED ||
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fds[1], &event) < 0) {
+        if (rings != MAP_FAILED)
+            munmap(rings, sizeof(tfs_ring_pair));
+        close(fds[1]);
+        close(fds[2]);
+    }
+    else {
+        s->request_event = fds[1];
+        s->response_event = fds[2];
+        __atomic_store_n(&s->rings, rings, __ATOMIC_RELEASE);
+        attached[attachedCount++] = s;
+        response.result = SUCCESS;
+    }
+
+    __atomic_fetch_add(&ioSyscalls, 1, __ATOMIC_RELAXED);
+    send(s->fd, &response, sizeof(response), MSG_NOSIGNAL);
+}
+
+/*
+ * Sessions closed while handling a round of events: their other events of
+ * the round may still point to them, so they are released after it. Each
+ * event closes at most one, and so does each attached ring.
+ */
+session *closing[EPOLL_EVENTS + MAX_ATTACHED];
+int closingCount = 0;
+
+/*
+ * Ends a session whose client disconnected. Jobs in flight keep it until
+ * they end.
+ */
+static void closeSession(session *s, int epfd) {
+    sessionCount--;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    __atomic_store_n(&s->closed, 1, __ATOMIC_RELEASE);
+
+    if (s->rings != NULL) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, s->request_event, NULL);
+        for (int i = 0; i < attachedCount; i++)
+            if (attached[i] == s)
+                attached[i] = attached[--attachedCount];
+    }
+    closing[closingCount++] = s;
+}
+
+/*
+ * Receives every queued request of a session and hands them to the
+ * workers; ends the session when its client disconnects.
+ * Input:
+ *  - s: the session
+ *  - epfd: epoll instance the session is watched by
+ *  - in: receive buffer
+ */
+static void drainSession(session *s, int epfd, message *in) {
+    char control[CMSG_SPACE(sizeof(int) * TFS_ATTACH_FDS)];
+    struct iovec iov = { in->data, INDIM - 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        int c = recvmsg(s->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        __atomic_fetch_add(&ioSyscalls, 1, __ATOMIC_RELAXED);
+
+        if (c < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (c <= 0) {
+            closeSession(s, epfd);
+            return;
         }
+
+        /* Descriptors only come with ATTACH; anything else drops them */
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_RIGHTS) {
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int fds[TFS_ATTACH_FDS];
+
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+            if (count == TFS_ATTACH_FDS && c == sizeof(tfs_request) &&
+                    ((tfs_request *) in->data)->opcode == TFS_OP_ATTACH) {
+                attachSession(s, epfd, (tfs_request *) in->data, fds);
+                continue;
+            }
+            for (int i = 0; i < count; i++)
+                close(fds[i]);
+        }
+
+        submitJob(in->data, c, s, NULL, 0);
     }
+}
 
-    for (i = 0; i < numberThreads; i++) {
-        if (pthread_join(tid[i], NULL)) {
-            fprintf(stderr, "Error: could not join thread\n");
-            exit(EXIT_FAILURE);
+/*
+ * Hands the requests queued on the attached rings to the workers, up to
+ * RING_BATCH per ring so that no client starves the others. A session
+ * whose ring is found inconsistent is ended.
+ * Input:
+ *  - epfd: epoll instance the sessions are watched by
+ * Returns: number of requests taken
+ */
+static int drainRings(int epfd) {
+    int taken = 0;
+
+    for (int i = 0; i < attachedCount; i++) {
+        tfs_ring *ring = &attached[i]->rings->requests;
+        char *data;
+        uint32_t size;
+
+        for (int n = 0; n < RING_BATCH &&
+                (data = tfs_ring_peek(ring, &size)) != NULL; n++) {
+            /* cut short, like a socket read, an oversized request fails
+             * to parse and is answered with an error */
+            submitJob(data, size < INDIM ? size : INDIM - 1, attached[i], NULL, 0);
+            tfs_ring_pop(ring, size);
+            taken++;
+        }
+
+        if (data == NULL && size == TFS_RING_WRAP) {
+            fprintf(stderr, "Error: inconsistent request ring, closing session\n");
+            /* takes the session out of attached, the next one into slot i */
+            closeSession(attached[i--], epfd);
         }
     }
+    return taken;
+}
 
+/* Tells every attached client whether the front end is about to sleep */
+static void ringsWaiting(int waiting) {
+    for (int i = 0; i < attachedCount; i++)
+        __atomic_store_n(&attached[i]->rings->requests.consumer_waiting,
+                waiting, __ATOMIC_SEQ_CST);
 }
 
-int main(int argc, char* argv[]) {
-    /* init filesystem */
-    init_fs();
+/* Event of the signals that stop the server, and whether one came */
+static watch shutdownWatch;
+static int stopping = 0;
+
+/*
+ * I/O front end: waits for the socket (and, in seqpacket mode, for every
+ * session) with epoll and queues what arrives for the workers, so no
+ * worker blocks on socket reads and a slow command never delays the
+ * reading of other clients' requests. Attached rings are polled on every
+ * round; the front end only sleeps, and asks to be woken, once they are
+ * all empty. Returns when the server is told to stop.
+ */
+void *frontEnd() {
+    message *in = malloc(sizeof(message) * ioBatch);
+    struct sockaddr_un *addrs = malloc(sizeof(struct sockaddr_un) * ioBatch);
+    struct mmsghdr *msgs = malloc(sizeof(struct mmsghdr) * ioBatch);
+    struct iovec *iovs = malloc(sizeof(struct iovec) * ioBatch);
+    struct epoll_event event, events[EPOLL_EVENTS];
+    int epfd, sigfd, ready, timeout;
+    uint64_t count;
+    sigset_t signals;
 
+    if (!in || !addrs || !msgs || !iovs) {
+        fprintf(stderr, "Error: could not allocate I/O buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((epfd = epoll_create1(0)) < 0) {
+        fprintf(stderr, "Error: could not create epoll instance\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* The server socket is the only event without a session */
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &event) < 0) {
+        fprintf(stderr, "Error: could not watch server socket\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* SIGINT and SIGTERM (blocked in every thread) stop the front end */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    event.data.ptr = &shutdownWatch;
+    if ((sigfd = signalfd(-1, &signals, 0)) < 0 ||
+            epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &event) < 0) {
+        fprintf(stderr, "Error: could not watch signals\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (!stopping) {
+        timeout = 0;
+        if (drainRings(epfd) == 0) {
+            ringsWaiting(1);
+            if (drainRings(epfd) == 0)
+                timeout = -1;
+        }
+
+        ready = epoll_wait(epfd, events, EPOLL_EVENTS, timeout);
+        __atomic_fetch_add(&ioSyscalls, 1, __ATOMIC_RELAXED);
+        if (timeout < 0)
+            ringsWaiting(0);
+
+        for (int i = 0; i < ready; i++) {
+            watch *w = events[i].data.ptr;
+
+            if (w == &shutdownWatch)
+                stopping = 1;
+            else if (w != NULL && w->s->closed)
+                continue;
+            else if (w != NULL && w->ring) {
+                /* Drained on the next round; just reset the eventfd */
+                if (read(w->s->request_event, &count, sizeof(count)) > 0)
+                    __atomic_fetch_add(&ioSyscalls, 1, __ATOMIC_RELAXED);
+            }
+            else if (w != NULL)
+                drainSession(w->s, epfd, in);
+            else if (transport == SOCK_SEQPACKET)
+                acceptSessions(epfd);
+            else
+                drainSocket(in, addrs, msgs, iovs);
+        }
+
+        while (closingCount > 0)
+            sessionRelease(closing[--closingCount]);
+    }
+
+    close(sigfd);
+    close(epfd);
+    free(in);
+    free(addrs);
+    free(msgs);
+    free(iovs);
+    return NULL;
+}
+
+/*
+ * Process pool initializer and runner: serves until SIGINT or SIGTERM,
+ * then lets the workers finish what they hold and stops them.
+ */
+void processPool() {
+    pthread_t tid;
+    sigset_t signals;
+
+    /* Blocked before any thread starts, so only the front end sees them */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL)) {
+        fprintf(stderr, "Error: could not block signals\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pool_init(numberThreads, serveJob);
+
+    if (pthread_create(&tid, NULL, frontEnd, NULL)) {
+        fprintf(stderr, "Error: could not create threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pthread_join(tid, NULL)) {
+        fprintf(stderr, "Error: could not join thread\n");
+        exit(EXIT_FAILURE);
+    }
+    pool_stop();
+    pool_join();
+}
+
+int main(int argc, char* argv[]) {
     argumentParser(argc, argv);
 
+    /* init filesystem, from its image if there is one */
+    init_fs(imagePath, commitWindow, numberThreads);
+
     /* Create server socket */
     fsMount();
 
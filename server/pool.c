@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "pool.h"
+
+/*
+ * FIFO of items, a ring buffer that doubles when full. Padded to its own
+ * cache line.
+ */
+typedef struct queue {
+    pthread_mutex_t mutex;
+    int head, count, capacity;
+    void **items;
+    unsigned long served, stolen;
+} __attribute__((aligned(64))) queue;
+
+queue queues[POOL_MAX_WORKERS];
+int worker_count = 0;
+pthread_t workers[POOL_MAX_WORKERS];
+void (*serve_item)(void *);
+
+/* One token per queued item: a worker that takes a token finds an item */
+sem_t pending;
+
+/* Queue the next item is submitted to */
+unsigned int next_queue = 0;
+
+/*
+ * Appends an item to a queue.
+ */
+static void queue_push(queue *q, void *item) {
+    pthread_mutex_lock(&q->mutex);
+
+    if (q->count == q->capacity) {
+        void **items = malloc(sizeof(void *) * q->capacity * 2);
+
+        if (items == NULL) {
+            fprintf(stderr, "Error: could not grow worker queue\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < q->count; i++)
+            items[i] = q->items[(q->head + i) % q->capacity];
+        free(q->items);
+        q->items = items;
+        q->head = 0;
+        q->capacity *= 2;
+    }
+
+    q->items[(q->head + q->count) % q->capacity] = item;
+    __atomic_store_n(&q->count, q->count + 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/*
+ * Takes the oldest item of a queue.
+ * Returns: the item, or NULL if the queue is empty
+ */
+static void *queue_pop(queue *q) {
+    void *item = NULL;
+
+    /* Unlocked peek: a thief skips empty queues without contending */
+    if (__atomic_load_n(&q->count, __ATOMIC_RELAXED) == 0)
+        return NULL;
+
+    pthread_mutex_lock(&q->mutex);
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        __atomic_store_n(&q->count, q->count - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&q->mutex);
+
+    return item;
+}
+
+/* Item that makes the worker taking it exit, see pool_stop */
+static char stop_item;
+
+/*
+ * Serves items until it takes a stop item: its own queue first, then the
+ * others'.
+ * Input:
+ *  - arg: the worker's index
+ */
+static void *worker(void *arg) {
+    int self = (long) arg;
+
+    while (1) {
+        void *item;
+        int victim = self;
+
+        sem_wait(&pending);
+
+        /* The token guarantees an item somewhere, perhaps not yet visible */
+        while ((item = queue_pop(&queues[victim])) == NULL)
+            victim = (victim + 1) % worker_count;
+
+        if (item == &stop_item)
+            break;
+
+        __atomic_fetch_add(&queues[self].served, 1, __ATOMIC_RELAXED);
+        if (victim != self)
+            __atomic_fetch_add(&queues[self].stolen, 1, __ATOMIC_RELAXED);
+
+        serve_item(item);
+    }
+    return NULL;
+}
+
+/*
+ * Starts the workers.
+ * Input:
+ *  - count: number of workers
+ *  - serve: called by a worker for every item it takes
+ */
+void pool_init(int count, void (*serve)(void *)) {
+    if (count < 1 || count > POOL_MAX_WORKERS) {
+        fprintf(stderr, "Error: invalid number of workers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    serve_item = serve;
+    worker_count = count;
+
+    if (sem_init(&pending, 0, 0)) {
+        fprintf(stderr, "Error: could not initialize semaphore: pending\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < count; i++) {
+        queue *q = &queues[i];
+
+        if (pthread_mutex_init(&q->mutex, NULL)) {
+            fprintf(stderr, "Error: could not initialize mutex: queue\n");
+            exit(EXIT_FAILURE);
+        }
+        q->capacity = POOL_INITIAL_CAPACITY;
+        q->items = malloc(sizeof(void *) * q->capacity);
+        if (q->items == NULL) {
+            fprintf(stderr, "Error: could not allocate worker queue\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (long i = 0; i < count; i++) {
+        if (pthread_create(&workers[i], NULL, worker, (void *) i)) {
+            fprintf(stderr, "Error: could not create threads\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Queues an item, spreading items over the workers in turn.
+ */
+void pool_submit(void *item) {
+    unsigned int index = __atomic_fetch_add(&next_queue, 1, __ATOMIC_RELAXED);
+
+    queue_push(&queues[index % worker_count], item);
+    sem_post(&pending);
+}
+
+/*
+ * Reports how many items the workers served, and how many of those they
+ * stole from another worker's queue.
+ */
+void pool_stats(unsigned long *served, unsigned long *stolen) {
+    *served = *stolen = 0;
+    for (int i = 0; i < worker_count; i++) {
+        *served += __atomic_load_n(&queues[i].served, __ATOMIC_RELAXED);
+        *stolen += __atomic_load_n(&queues[i].stolen, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Tells every worker to exit once it takes the stop item queued for it.
+ * Items already queued may be left unserved.
+ */
+void pool_stop() {
+    for (int i = 0; i < worker_count; i++)
+        pool_submit(&stop_item);
+}
+
+/*
+ * Waits for the workers to exit (see pool_stop) and releases the queues.
+ */
+void pool_join() {
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_join(workers[i], NULL)) {
+            fprintf(stderr, "Error: could not join thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        pthread_mutex_destroy(&queues[i].mutex);
+        free(queues[i].items);
+    }
+    sem_destroy(&pending);
+}
@@ -0,0 +1,20 @@
+#ifndef POOL_H
+#define POOL_H
+
+/*
+ * Worker pool with per-worker queues. Submitted items are spread over the
+ * workers' queues; a worker serves its own queue first and, when it runs
+ * dry, steals from the others, so one slow item (a move, a print) does not
+ * hold up the items queued behind it while other workers are idle.
+ */
+
+#define POOL_MAX_WORKERS 256
+#define POOL_INITIAL_CAPACITY 64
+
+void pool_init(int workers, void (*serve)(void *));
+void pool_submit(void *item);
+void pool_stats(unsigned long *served, unsigned long *stolen);
+void pool_stop();
+void pool_join();
+
+#endif /* POOL_H */
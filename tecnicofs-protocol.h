@@ -0,0 +1,152 @@
+/* tecnicofs-protocol.h */
+#ifndef TECNICOFS_PROTOCOL_H
+#define TECNICOFS_PROTOCOL_H
+
+#include <stdint.h>
+
+/*
+ * Binary wire format shared by client and server.
+ *
+ * A request is a tfs_request header followed by up to two paths, each
+ * sent with its terminating '\0' and counted in path_len, so the server
+ * uses them in place. A response is a tfs_response. Both ends run on the
+ * same host, so fields are in native byte order.
+ *
+ * Opcodes have the high bit set, which tells binary requests apart from
+ * the legacy text commands ("c a f", ...) that start with a letter.
+ */
+
+#define TFS_OP_HELLO  0x80 /* path_len[0]: client's path limit; result: agreed limit */
+#define TFS_OP_CREATE 0x81 /* path: node; flags: DIRECTORY, PARENTS */
+#define TFS_OP_DELETE 0x82 /* path: node; flags: RECURSIVE */
+#define TFS_OP_LOOKUP 0x83 /* path: node; result: inumber */
+#define TFS_OP_MOVE   0x84 /* paths: current, new */
+#define TFS_OP_PRINT  0x85 /* path: output file, on the server */
+#define TFS_OP_BATCH  0x86 /* path_len[0]: number of operations, see below */
+#define TFS_OP_LIST   0x87 /* no paths; the tree listing is streamed back */
+#define TFS_OP_ATTACH 0x88 /* no paths; carries the fds of a tfs_ring_pair */
+#define TFS_OP_OPEN     0x89 /* path: file; flags: READ, WRITE or RW; result: handle */
+#define TFS_OP_READ     0x8a /* no path; result: bytes read, see below */
+#define TFS_OP_WRITE    0x8b /* no path; path_len[1]: bytes, which follow the tfs_io */
+#define TFS_OP_TRUNCATE 0x8c /* no path; tfs_io size: the new size */
+#define TFS_OP_CLOSE    0x8d /* no path */
+#define TFS_OP_READDIR  0x8e /* path: directory; result: bytes, see below */
+#define TFS_OP_STAT     0x8f /* path; result: bytes, see below */
+
+#define TFS_FLAG_DIRECTORY       0x01 /* create */
+#define TFS_FLAG_STOP_ON_FAILURE 0x02 /* batch */
+#define TFS_FLAG_PARENTS         0x04 /* create: a directory and its missing
+                                         ancestors; result: number created */
+#define TFS_FLAG_RECURSIVE       0x08 /* delete: the whole subtree; result:
+                                         number of nodes deleted */
+
+/* Longest path (including '\0') the server accepts */
+#define TFS_MAX_PATH 100
+
+typedef struct tfs_request {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t path_len[2];
+    uint32_t request_id;
+} tfs_request;
+
+typedef struct tfs_response {
+    uint32_t request_id;
+    int32_t result;
+} tfs_response;
+
+/* Largest single request a client may send */
+#define TFS_MAX_MESSAGE (sizeof(tfs_request) + 2 * TFS_MAX_PATH)
+
+/*
+ * File requests (OPEN to STAT) carry a tfs_io between the header and the
+ * path. OPEN gives a handle into the open-file table of the client's
+ * session (seqpacket sessions only); the others but READDIR and STAT (see below)
+ * name the file by handle
+ * and read or write at its offset, which they move. READ answers like
+ * LIST: TFS_PARTIAL chunks, then a tfs_response whose result is the
+ * number of bytes read, followed by the last of them. WRITE carries up to
+ * TFS_MAX_IO bytes. A file request is never part of a batch and fits in
+ * TFS_MAX_BATCH_MESSAGE.
+ */
+typedef struct tfs_io {
+    uint64_t size;   /* truncate: new size; readdir: cursor */
+    uint32_t length; /* read: most bytes to return; readdir: most entries */
+    uint32_t handle;
+} tfs_io;
+
+#define TFS_MAX_IO 4096
+
+/*
+ * READDIR lists a page of a directory's entries and needs no session. Its
+ * tfs_io carries the cursor in size (0 for the first page) and the most
+ * entries wanted in length (up to TFS_MAX_DIRENTS). The answer's result
+ * is the number of bytes that follow it: the cursor of the next page
+ * (TFS_DIR_END after the last one), as a uint64_t, then each entry as a
+ * tfs_dirent and its name, unterminated. Entries come in hash order, and
+ * a cursor stays valid whatever is created or deleted meanwhile: every
+ * entry that stays in the directory is listed exactly once.
+ */
+typedef struct tfs_dirent {
+    uint32_t inumber;
+    uint16_t name_len;
+    uint16_t type; /* T_FILE or T_DIRECTORY */
+} tfs_dirent;
+
+#define TFS_MAX_DIRENTS 128
+#define TFS_DIR_END ((uint64_t) 1 << 32)
+
+/*
+ * STAT reads the metadata of a node in one round-trip and needs no
+ * session; its tfs_io is ignored. The answer's result is the number of
+ * bytes that follow it (a tfs_stat), or an error. The version grows with
+ * every change to the node and never repeats for its inumber, so a client
+ * holding data it read at some version knows it is still current as long
+ * as STAT gives the same inumber and version. Times are in nanoseconds
+ * since the epoch.
+ */
+typedef struct tfs_stat {
+    uint64_t version;
+    int64_t size; /* files: bytes; directories: entries */
+    int64_t ctime; /* last change to anything */
+    int64_t mtime; /* last change to the contents */
+    uint32_t inumber;
+    uint32_t nlink;
+    uint32_t type; /* T_FILE or T_DIRECTORY */
+    uint32_t reserved;
+} tfs_stat;
+
+/*
+ * A batch is a tfs_request header followed by path_len[0] requests
+ * (CREATE to PRINT), each padded to a multiple of 4 bytes. They run in
+ * order; with TFS_FLAG_STOP_ON_FAILURE the first negative result ends
+ * the batch. The answer is a tfs_response whose result is the number of
+ * requests run, followed by their results as int32_t.
+ */
+#define TFS_MAX_BATCH 32
+#define TFS_ALIGN(size) (((size) + 3) & ~3)
+#define TFS_MAX_BATCH_MESSAGE \
+    (sizeof(tfs_request) + TFS_MAX_BATCH * TFS_ALIGN(TFS_MAX_MESSAGE))
+
+/*
+ * Long answers (LIST, READ) are streamed: any number of tfs_response headers
+ * with result TFS_PARTIAL, each followed by up to TFS_MAX_CHUNK bytes of
+ * data, then an ordinary tfs_response with the final result.
+ */
+#define TFS_PARTIAL 0x7fffffff
+#define TFS_MAX_CHUNK 4096
+
+/*
+ * ATTACH moves a seqpacket session onto shared memory. It carries, as
+ * SCM_RIGHTS, a memfd holding a tfs_ring_pair (see tecnicofs-ring.h),
+ * sealed with F_SEAL_SHRINK and F_SEAL_GROW or else refused, an eventfd the client writes when it queues a request for a sleeping
+ * server, and one the server writes when it queues an answer for a
+ * sleeping client. Once answered, every further request and answer goes
+ * through the rings; the session stays open until the client unmounts.
+ */
+#define TFS_ATTACH_FDS 3
+
+/* Largest answer a client may receive */
+#define TFS_MAX_RESPONSE (sizeof(tfs_response) + TFS_MAX_CHUNK)
+
+#endif /* TECNICOFS_PROTOCOL_H */
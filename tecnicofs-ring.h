@@ -0,0 +1,140 @@
+/* tecnicofs-ring.h */
+#ifndef TECNICOFS_RING_H
+#define TECNICOFS_RING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+/*
+ * Single-producer single-consumer byte ring in memory shared by a client
+ * and the server (see TFS_OP_ATTACH). Every record is a uint32_t size and
+ * the message, padded to 8 bytes; a record never wraps: when it does not
+ * fit before the end of the ring, a TFS_RING_WRAP marker sends the
+ * consumer back to the start.
+ *
+ * Neither side makes a system call while the other is running. A side
+ * that runs out of work (consumer) or room (producer) raises its waiting
+ * flag, checks the ring again, and only then sleeps; the other side wakes
+ * it only if the flag is up.
+ */
+
+#define TFS_RING_SIZE (256 * 1024)
+#define TFS_RING_WRAP 0xffffffffu
+#define TFS_RING_RECORD(size) (((size) + sizeof(uint32_t) + 7) & ~7u)
+
+typedef struct tfs_ring {
+    /* Written by the producer */
+    uint64_t tail __attribute__((aligned(64)));
+    uint32_t producer_waiting;
+
+    /* Written by the consumer */
+    uint64_t head __attribute__((aligned(64)));
+    uint32_t consumer_waiting;
+    uint32_t consumed;   /* futex word, bumped for a waiting producer */
+
+    char data[TFS_RING_SIZE] __attribute__((aligned(64)));
+} tfs_ring;
+
+/* Shared region of a client: requests go one way, answers the other */
+typedef struct tfs_ring_pair {
+    tfs_ring requests;
+    tfs_ring responses;
+} tfs_ring_pair;
+
+/*
+ * Appends a message to a ring.
+ * Input:
+ *  - ring: the ring
+ *  - iov, iovlen: the message
+ * Returns: 0, or -1 if there is no room for it yet
+ */
+static inline int tfs_ring_push(tfs_ring *ring, struct iovec *iov, int iovlen) {
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t offset = tail % TFS_RING_SIZE, size = 0, record;
+    uint32_t skip = 0;
+
+    for (int i = 0; i < iovlen; i++)
+        size += iov[i].iov_len;
+    record = TFS_RING_RECORD(size);
+
+    if (offset + record > TFS_RING_SIZE)
+        skip = TFS_RING_SIZE - offset;
+    if (record > TFS_RING_SIZE / 2 ||
+            tail + skip + record - head > TFS_RING_SIZE)
+        return -1;
+
+    if (skip) {
+        *(uint32_t *) (ring->data + offset) = TFS_RING_WRAP;
+        tail += skip;
+        offset = 0;
+    }
+
+    *(uint32_t *) (ring->data + offset) = size;
+    offset += sizeof(uint32_t);
+    for (int i = 0; i < iovlen; i++) {
+        memcpy(ring->data + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+
+    __atomic_store_n(&ring->tail, tail + record, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/*
+ * Looks at the oldest message of a ring, in place. The positions and
+ * sizes in the ring are written by the other side, so they are checked
+ * before any byte is read through them: a ring found inconsistent is
+ * reported as such and must not be used again.
+ * Input:
+ *  - ring: the ring
+ *  - size: set to the size of the message; 0 if the ring is empty, or
+ *    TFS_RING_WRAP if it is inconsistent
+ * Returns: the message, or NULL if there is none
+ */
+static inline char *tfs_ring_peek(tfs_ring *ring, uint32_t *size) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+    uint32_t offset = head % TFS_RING_SIZE;
+
+    *size = 0;
+    if (head == tail)
+        return NULL;
+
+    *size = TFS_RING_WRAP;
+    if (tail - head > TFS_RING_SIZE || offset % 8)
+        return NULL;
+
+    if (*(volatile uint32_t *) (ring->data + offset) == TFS_RING_WRAP) {
+        head += TFS_RING_SIZE - offset;
+        if (tail - head > TFS_RING_SIZE)
+            return NULL;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        *size = 0;
+        if (head == tail)
+            return NULL;
+        offset = 0;
+    }
+
+    uint32_t length = *(volatile uint32_t *) (ring->data + offset);
+
+    if (offset + sizeof(uint32_t) + (uint64_t) length > TFS_RING_SIZE ||
+            TFS_RING_RECORD(length) > tail - head)
+        return NULL;
+
+    *size = length;
+    return ring->data + offset + sizeof(uint32_t);
+}
+
+/*
+ * Drops the message returned by the last tfs_ring_peek.
+ * Returns: whether the producer is waiting for room
+ */
+static inline int tfs_ring_pop(tfs_ring *ring, uint32_t size) {
+    __atomic_store_n(&ring->head, ring->head + TFS_RING_RECORD(size),
+            __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->producer_waiting, __ATOMIC_SEQ_CST);
+}
+
+#endif /* TECNICOFS_RING_H */
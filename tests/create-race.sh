@@ -0,0 +1,59 @@
+#!/bin/sh
+# Lock order test: clients create, delete and move nodes in one directory
+# at the same time. The directory gets a high inumber and the nodes low
+# ones, so a delete or move resolving a node that was just deleted locks
+# its inumber before the directory's while a create may be handing that
+# same inumber out again under the directory's lock. Fails if the server
+# stops answering (a deadlock) or the tree is left inconsistent.
+#
+# Usage: tests/create-race.sh [iterations] [clients] [threads]
+# Run from the repository root after `make`.
+
+ITERATIONS=${1:-2000}
+CLIENTS=${2:-6}
+THREADS=${3:-8}
+TIMEOUT=120
+
+. bench/common.sh
+CLIENT="timeout $TIMEOUT $CLIENT"
+
+# low inumbers for the nodes, freed again once /p holds a high one
+awk 'BEGIN {
+    for (i = 0; i < 64; i++) printf "c /z%d f\n", i
+    print "c /p d"
+    for (i = 0; i < 64; i++) printf "d /z%d\n", i
+}' > "$WORKDIR/setup.txt"
+
+for c in $(seq 1 "$CLIENTS"); do
+    awk -v n="$ITERATIONS" -v c="$c" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            a = "/p/a" (i % 4); b = "/p/b" (i % 4)
+            if (c % 3 == 0) printf "c %s f\nd %s\n", a, a
+            else if (c % 3 == 1) printf "m %s %s\nd %s\nc %s f\n", a, b, b, b
+            else printf "d %s r\nc %s/q p\nm %s %s\n", a, a, b, a
+        }
+    }' > "$WORKDIR/input-$c.txt"
+done
+printf "p %s/tree.txt\nd /p r\nl /p\n" "$WORKDIR" > "$WORKDIR/check.txt"
+
+SERVER_LOG="$WORKDIR/server.log" start_server "$THREADS"
+run_client "$WORKDIR/setup.txt" > /dev/null
+
+for c in $(seq 1 "$CLIENTS"); do
+    spawn_client -p 4 "$WORKDIR/input-$c.txt" > /dev/null
+done
+
+RESULT=0
+if ! wait_clients; then
+    echo "FAIL: a client did not finish within $TIMEOUT seconds"
+    RESULT=1
+elif ! run_client "$WORKDIR/check.txt" > "$WORKDIR/check.log" ||
+        ! grep -q "^Search: /p not found" "$WORKDIR/check.log"; then
+    echo "FAIL: the tree could not be printed and removed"
+    RESULT=1
+else
+    echo "OK: $CLIENTS clients, $ITERATIONS iterations each"
+fi
+
+stop_server
+exit "$RESULT"
@@ -0,0 +1,93 @@
+#!/bin/sh
+# Recursive delete test: builds a tree and removes it in one request
+# ("d <path> r"), checking the number of nodes it reports and that none of
+# them can be found afterwards; then removes trees again while other
+# clients keep creating inside them, and checks that the printed tree
+# holds no node whose parent is missing.
+#
+# Usage: tests/delete-recursive.sh [fanout] [depth] [clients] [threads]
+# Run from the repository root after `make`.
+
+FANOUT=${1:-4}
+DEPTH=${2:-4}
+CLIENTS=${3:-4}
+THREADS=${4:-4}
+ROUNDS=50
+TIMEOUT=120
+
+. bench/common.sh
+CLIENT="timeout $TIMEOUT $CLIENT"
+
+# FANOUT directories and FANOUT files under every directory, DEPTH levels
+awk -v fanout="$FANOUT" -v depth="$DEPTH" -v out="$WORKDIR" '
+    function fill(path, level,    i) {
+        printf "c %s d\n", path > (out "/fill.txt")
+        nodes++
+        print "l " path > (out "/lookup.txt")
+        for (i = 0; i < fanout; i++) {
+            printf "c %s/f%d f\n", path, i > (out "/fill.txt")
+            print "l " path "/f" i > (out "/lookup.txt")
+            nodes++
+            if (level < depth)
+                fill(path "/d" i, level + 1)
+        }
+    }
+    BEGIN { fill("/t", 1); print nodes > (out "/nodes.txt") }'
+NODES=$(cat "$WORKDIR/nodes.txt")
+
+echo "d /t r" > "$WORKDIR/delete.txt"
+
+# the deleter keeps rebuilding and removing /r; the others create under it
+for r in $(seq 1 "$ROUNDS"); do
+    echo "c /r/a/b/c p"
+    echo "d /r r"
+done > "$WORKDIR/deleter.txt"
+for c in $(seq 1 "$CLIENTS"); do
+    for r in $(seq 1 "$ROUNDS"); do
+        echo "c /r/a/c$c-$r d"
+        echo "c /r/a/b/c$c-$r f"
+        echo "c /r/a/b/c/x$c/y p"
+    done > "$WORKDIR/creator-$c.txt"
+done
+printf "d /r r\np %s/tree.txt\n" "$WORKDIR" > "$WORKDIR/check.txt"
+
+RESULT=0
+start_server "$THREADS"
+
+run_client "$WORKDIR/fill.txt" > /dev/null
+run_client "$WORKDIR/delete.txt" > "$WORKDIR/delete.log"
+run_client "$WORKDIR/lookup.txt" > "$WORKDIR/lookup.log"
+
+if ! grep -q "^Deleted: /t, $NODES nodes" "$WORKDIR/delete.log"; then
+    echo "FAIL: expected $NODES nodes deleted, got: $(grep "/t" "$WORKDIR/delete.log")"
+    RESULT=1
+fi
+if grep "^Search: " "$WORKDIR/lookup.log" | grep -qv "not found$"; then
+    echo "FAIL: a deleted node can still be found"
+    RESULT=1
+fi
+
+spawn_client "$WORKDIR/deleter.txt" > /dev/null
+for c in $(seq 1 "$CLIENTS"); do
+    spawn_client "$WORKDIR/creator-$c.txt" > /dev/null
+done
+if ! wait_clients; then
+    echo "FAIL: a client did not finish within $TIMEOUT seconds"
+    RESULT=1
+fi
+
+# with /r gone for good, the tree is "/" alone; any other line is a leak
+run_client "$WORKDIR/check.txt" > /dev/null
+if [ ! -f "$WORKDIR/tree.txt" ]; then
+    echo "FAIL: the tree could not be printed"
+    RESULT=1
+elif [ "$(grep -vc '^/\?$' "$WORKDIR/tree.txt")" -ne 0 ]; then
+    echo "FAIL: nodes left after deleting everything:"
+    head -5 "$WORKDIR/tree.txt"
+    RESULT=1
+fi
+
+stop_server
+
+[ "$RESULT" -eq 0 ] && echo "OK: $NODES nodes, $ROUNDS concurrent rounds with $CLIENTS clients"
+exit "$RESULT"
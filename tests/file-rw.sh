@@ -0,0 +1,68 @@
+#!/bin/sh
+# File read/write test: clients write files of sizes around block and run
+# boundaries ("w", a known pattern), read them back ("r", which checks the
+# pattern), rewrite them shorter and read them again, over each session
+# transport. Fails unless every read returns the pattern at the size last
+# written.
+#
+# Usage: tests/file-rw.sh [clients] [threads]
+# Run from the repository root after `make`.
+
+CLIENTS=${1:-4}
+THREADS=${2:-4}
+SIZES="0 1 4095 4096 4097 65536 262145 3000000"
+TIMEOUT=120
+
+. bench/common.sh
+CLIENT="timeout $TIMEOUT $CLIENT"
+
+# a file of each size, then the largest rewritten at every size, largest
+# first so each rewrite shrinks it, and grown back
+for c in $(seq 1 "$CLIENTS"); do
+    {
+        for size in $SIZES; do
+            echo "c /c$c-$size f"
+            echo "w /c$c-$size $size"
+            echo "r /c$c-$size"
+        done
+        for size in $(echo $SIZES | tr ' ' '\n' | sort -rn); do
+            echo "w /c$c-3000000 $size"
+            echo "r /c$c-3000000"
+        done
+        echo "w /c$c-3000000 3000000"
+        echo "r /c$c-3000000"
+    } > "$WORKDIR/input-$c.txt"
+done
+
+RESULT=0
+for transport in seqpacket shm; do
+    start_server -t seqpacket "$THREADS"
+
+    for c in $(seq 1 "$CLIENTS"); do
+        spawn_client -t "$transport" "$WORKDIR/input-$c.txt" > "$WORKDIR/output-$c.txt"
+    done
+    if ! wait_clients; then
+        echo "FAIL: $transport: a client did not finish within $TIMEOUT seconds"
+        RESULT=1
+    fi
+    stop_server
+
+    # "Wrote: <path>, <size> bytes" is followed by "Read: <path>, <size> bytes"
+    for c in $(seq 1 "$CLIENTS"); do
+        awk -v t="$transport" '
+            /^Wrote: / { wrote = $3 }
+            /^Read: / {
+                reads++
+                if ($3 != wrote) {
+                    printf "FAIL: %s: read %s bytes of %s after writing %s\n", t, $3, $2, wrote
+                    exit 1
+                }
+            }
+            /^Unable/ { printf "FAIL: %s: %s\n", t, $0; exit 1 }
+            END { if (reads == 0) { printf "FAIL: %s: nothing read\n", t; exit 1 } }
+        ' "$WORKDIR/output-$c.txt" || RESULT=1
+    done
+done
+
+[ "$RESULT" -eq 0 ] && echo "OK: $CLIENTS clients, sizes $SIZES"
+exit "$RESULT"
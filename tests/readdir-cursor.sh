@@ -0,0 +1,67 @@
+#!/bin/sh
+# Directory cursor test: lists a directory page by page ("e") over and over
+# while another client keeps adding and removing enough entries in it to
+# make its table grow and shrink. Fails unless every listing holds each
+# entry that stayed in the directory exactly once.
+#
+# Usage: tests/readdir-cursor.sh [entries] [rounds] [threads]
+# Run from the repository root after `make`.
+
+ENTRIES=${1:-1000}
+ROUNDS=${2:-10}
+THREADS=${3:-4}
+LISTINGS=200
+TIMEOUT=120
+
+. bench/common.sh
+CLIENT="timeout $TIMEOUT $CLIENT"
+
+awk -v n="$ENTRIES" 'BEGIN {
+    print "c /dir d"
+    for (i = 0; i < n; i++)
+        printf "c /dir/keep%d f\n", i
+}' > "$WORKDIR/setup.txt"
+
+# each round doubles the directory and then empties it of churn entries
+awk -v n="$ENTRIES" -v rounds="$ROUNDS" 'BEGIN {
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < n; i++)
+            printf "c /dir/churn%d f\n", i
+        for (i = 0; i < n; i++)
+            printf "d /dir/churn%d\n", i
+    }
+}' > "$WORKDIR/churn.txt"
+
+for i in $(seq 1 "$LISTINGS"); do echo "e /dir"; done > "$WORKDIR/list.txt"
+
+start_server "$THREADS"
+run_client "$WORKDIR/setup.txt" > /dev/null
+
+spawn_client "$WORKDIR/churn.txt" > /dev/null
+spawn_client "$WORKDIR/list.txt" > "$WORKDIR/list.log"
+
+RESULT=0
+if ! wait_clients; then
+    echo "FAIL: a client did not finish within $TIMEOUT seconds"
+    RESULT=1
+# listDir prints "  <name> <type>" per entry, then "Listed: ..."
+elif ! awk -v n="$ENTRIES" '
+        /^  keep[0-9]+ f$/ { seen[$1]++ }
+        /^Listed: / {
+            listings++
+            for (i = 0; i < n; i++)
+                if (seen["keep" i] != 1) {
+                    printf "FAIL: listing %d has keep%d %d times\n", listings, i, seen["keep" i]
+                    exit 1
+                }
+            delete seen
+        }
+        /^Unable to list/ { print "FAIL: " $0; exit 1 }
+        END { if (listings == 0) { print "FAIL: no listing"; exit 1 } }' "$WORKDIR/list.log"; then
+    RESULT=1
+else
+    echo "OK: $LISTINGS listings of $ENTRIES entries during $ROUNDS rounds of churn"
+fi
+
+stop_server
+exit "$RESULT"
@@ -0,0 +1,73 @@
+#!/bin/sh
+# Stat version test: checks that a node's version ("s", TFS_OP_STAT) moves
+# on every change to it and only then: a file's on a write, a directory's
+# when an entry is added or removed, and that a node created again under
+# an old name, before or after a restart from the image (-i), never gets
+# a version it had before.
+#
+# Usage: tests/stat-version.sh [threads]
+# Run from the repository root after `make`.
+
+THREADS=${1:-4}
+TIMEOUT=30
+
+. bench/common.sh
+CLIENT="timeout $TIMEOUT $CLIENT"
+IMAGE=$WORKDIR/image
+
+RESULT=0
+
+# Runs operations, one per argument, in a session
+ops() {
+    printf '%s\n' "$@" > "$WORKDIR/ops.txt"
+    run_client -t seqpacket "$WORKDIR/ops.txt" > /dev/null
+}
+
+# Prints the version of a node, as "s" reports it
+version() {
+    printf 's %s\n' "$1" > "$WORKDIR/stat.txt"
+    run_client -t seqpacket "$WORKDIR/stat.txt" | sed -n 's/.*, version \([0-9]*\),.*/\1/p'
+}
+
+# Usage: expect <version> -gt|-eq <version> <what>
+expect() {
+    if [ -z "$1" ] || [ -z "$3" ] || ! [ "$1" "$2" "$3" ]; then
+        echo "FAIL: $4 ($1 $2 $3)"
+        RESULT=1
+    fi
+}
+
+start_server -t seqpacket -i "$IMAGE" "$THREADS"
+
+ops "c /d d" "c /d/f f"
+FILE0=$(version /d/f)
+DIR0=$(version /d)
+expect "$(version /d/f)" -eq "$FILE0" "stat alone changed a file's version"
+
+ops "w /d/f 5000"
+FILE1=$(version /d/f)
+expect "$FILE1" -gt "$FILE0" "a write did not change the file's version"
+expect "$(version /d)" -eq "$DIR0" "a write changed its directory's version"
+
+ops "c /d/g f"
+DIR1=$(version /d)
+expect "$DIR1" -gt "$DIR0" "a create did not change the directory's version"
+ops "d /d/g"
+DIR2=$(version /d)
+expect "$DIR2" -gt "$DIR1" "a delete did not change the directory's version"
+
+ops "d /d/f" "c /d/f f"
+FILE2=$(version /d/f)
+expect "$FILE2" -gt "$FILE1" "a file created again reused a version"
+
+stop_server
+start_server -t seqpacket -i "$IMAGE" "$THREADS"
+
+expect "$(version /d/f)" -eq "$FILE2" "a file's version changed across a restart"
+ops "d /d/f" "c /d/f f"
+expect "$(version /d/f)" -gt "$FILE2" "a file created again after a restart reused a version"
+
+stop_server
+
+[ "$RESULT" -eq 0 ] && echo "OK: versions follow changes, across a restart too"
+exit "$RESULT"
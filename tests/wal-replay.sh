@@ -0,0 +1,101 @@
+#!/bin/sh
+# Log replay test: clients create, move and delete nodes (one by one, with
+# parents and whole subtrees) on a server with an image (-i), which is then
+# killed before it can flush. Fails unless the server started again on the
+# image replays its log (image.wal) to the exact tree that was printed
+# before the kill, over two crashes and a clean restart.
+#
+# Usage: tests/wal-replay.sh [clients] [iterations] [threads]
+# Run from the repository root after `make`.
+
+CLIENTS=${1:-4}
+ITERATIONS=${2:-200}
+THREADS=${3:-4}
+TIMEOUT=120
+
+. bench/common.sh
+CLIENT="timeout $TIMEOUT $CLIENT"
+IMAGE=$WORKDIR/image
+
+RESULT=0
+
+# Writes the ops of client $1, round $2, for a workload that leaves some
+# of everything behind
+workload() {
+    awk -v n="$ITERATIONS" -v c="$1" -v r="$2" 'BEGIN {
+        d = "/c" c "-" r
+        printf "c %s d\n", d
+        for (i = 0; i < n; i++) {
+            printf "c %s/f%d f\n", d, i
+            printf "c %s/t%d/a/b p\n", d, i
+            if (i % 2) printf "m %s/f%d %s/t%d/a/g%d\n", d, i, d, i, i
+            if (i % 3 == 0) printf "d %s/t%d r\n", d, i
+            if (i % 5 == 0) printf "d %s/f%d\n", d, i
+        }
+    }' > "$WORKDIR/input-$1.txt"
+}
+
+# Runs a round of the workload, prints the tree to $1 and kills the server
+crash_after_round() {
+    for c in $(seq 1 "$CLIENTS"); do
+        workload "$c" "$1"
+        spawn_client "$WORKDIR/input-$c.txt" > /dev/null
+    done
+    if ! wait_clients; then
+        echo "FAIL: round $1: a client did not finish within $TIMEOUT seconds"
+        RESULT=1
+    fi
+    print_tree "$WORKDIR/before-$1.txt"
+    kill -9 "$SERVER_PID"
+    wait "$SERVER_PID" 2>/dev/null
+    SERVER_PID=
+}
+
+# Prints the tree, sorted, to a file
+print_tree() {
+    echo "p $WORKDIR/tree.txt" > "$WORKDIR/print.txt"
+    rm -f "$WORKDIR/tree.txt"
+    run_client "$WORKDIR/print.txt" > /dev/null
+    sort "$WORKDIR/tree.txt" > "$1"
+}
+
+# Fails unless the tree can only come back from the log: nothing flushed
+# an image yet, and the log holds records
+expect_log_only() {
+    if [ -e "$IMAGE" ] || [ ! -s "$IMAGE.wal" ]; then
+        echo "FAIL: $1: expected a log and no image"
+        RESULT=1
+    fi
+}
+
+# Usage: compare <expected> <what>
+compare() {
+    print_tree "$WORKDIR/after.txt"
+    if ! cmp -s "$1" "$WORKDIR/after.txt"; then
+        echo "FAIL: $2: the tree differs from before"
+        diff "$1" "$WORKDIR/after.txt" | head -5
+        RESULT=1
+    fi
+}
+
+SERVER_LOG="$WORKDIR/server.log" start_server -i "$IMAGE" "$THREADS"
+crash_after_round 1
+
+expect_log_only "first crash"
+SERVER_LOG="$WORKDIR/server.log" start_server -i "$IMAGE" "$THREADS"
+compare "$WORKDIR/before-1.txt" "first crash"
+crash_after_round 2
+
+expect_log_only "second crash"
+SERVER_LOG="$WORKDIR/server.log" start_server -i "$IMAGE" "$THREADS"
+compare "$WORKDIR/before-2.txt" "second crash"
+stop_server
+
+SERVER_LOG="$WORKDIR/server.log" start_server -i "$IMAGE" "$THREADS"
+compare "$WORKDIR/before-2.txt" "clean restart"
+stop_server
+
+if [ "$RESULT" -eq 0 ]; then
+    echo "OK: $(wc -l < "$WORKDIR/before-2.txt") nodes, two crashes and a clean restart"
+fi
+exit "$RESULT"